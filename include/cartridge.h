@@ -0,0 +1,36 @@
+#ifndef __CARTRIDGE_H_
+#define __CARTRIDGE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "utils.h"
+
+// Offsets of the cartridge header fields
+#define HEADER_TITLE 0x0134
+#define HEADER_TYPE 0x0147
+#define HEADER_ROM_SIZE 0x0148
+#define HEADER_RAM_SIZE 0x0149
+#define HEADER_CHECKSUM 0x014D
+#define HEADER_GLOBAL_CHECKSUM 0x014E
+
+struct Cartridge {
+    // Read only mapping of the rom file. The MMU maps its banks directly,
+    // so the rom is never copied.
+    BYTE* rom;
+    size_t size;
+    unsigned int rom_banks;
+
+    // Parsed header
+    char title[17];
+    BYTE type;
+    unsigned int ram_size;
+    bool header_checksum_valid;
+    WORD global_checksum;
+};
+
+bool cartridge_load(struct Cartridge* cart, const char* path);
+void cartridge_unload(struct Cartridge* cart);
+bool cartridge_verify_global_checksum(struct Cartridge* cart);
+uint64_t cartridge_hash(struct Cartridge* cart);
+
+#endif
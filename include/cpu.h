@@ -3,11 +3,131 @@
 
 #include "utils.h"
 #include <stdbool.h>
+#include <stdint.h>
 
-int execute_next();
-int execute_extended_instruction(BYTE prefix, BYTE op);
-BYTE add_with_flags_u8(BYTE a, BYTE b, bool add_carry, bool affect_carry);
-WORD add_with_flags_u16(WORD a, WORD b);
-BYTE sub_with_flags_u8(BYTE a, BYTE b, bool sub_carry, bool affect_carry);
+#define FLAG_C 4
+#define FLAG_H 5
+#define FLAG_N 6
+#define FLAG_Z 7
+
+struct GameBoy;
+
+struct Processor {
+    bool is_halted;
+    bool is_stopped;
+
+    // EI only takes effect after the next instruction
+    bool enable_interrupts_instruction;
+    // The interrupt master enable flag
+    bool interrupts_enabled;
+    // IE & IF, updated whenever either changes, so checking for an
+    // interrupt to service or to end HALT is a single test
+    BYTE interrupts_pending;
+
+    WORD SP;
+    WORD PC;
+
+    // Flags are evaluated lazily. The carry flag is always up to date in F,
+    // but ALU operations only record their kind, operands and result, and
+    // Z, N and H are computed from them when they are read.
+    BYTE lazy_op;
+    BYTE lazy_a;
+    BYTE lazy_b;
+    BYTE lazy_carry;
+    BYTE lazy_result;
+
+    // Register declarations
+    union {
+        struct {
+            BYTE F;
+            BYTE A;
+        };
+        WORD AF;
+    };
+    union {
+        struct {
+            BYTE C;
+            BYTE B;
+        };
+        WORD BC;
+    };
+    union {
+        struct {
+            BYTE E;
+            BYTE D;
+        };
+        WORD DE;
+    };
+    union {
+        struct {
+            BYTE L;
+            BYTE H;
+        };
+        WORD HL;
+    };
+};
+
+// Every opcode is handled by a function which executes it and returns the
+// number of simulated clock cycles
+typedef int (*opcode_handler)(struct GameBoy* gb);
+
+extern const opcode_handler base_opcodes[256];
+extern const opcode_handler cb_opcodes[256];
+// Length in bytes of every base opcode including its immediate operand
+extern const BYTE opcode_lengths[256];
+
+// An instruction decoded once, so executing it again neither fetches the
+// operand nor dispatches the CB prefix. The memory management unit keeps
+// them per page of every rom bank and of work ram, where writes invalidate
+// the instructions they modify. A NULL handler marks an instruction which is
+// not decoded yet.
+struct DecodedInstruction {
+    opcode_handler handler;
+    WORD operand;
+    BYTE opcode;
+};
+
+// Bytes between the start of a loop and the branch closing it, for loops
+// which are checked for only polling memory
+#define IDLE_LOOP_LENGTH 16
+// Registers an idle loop reads memory through
+#define IDLE_READ_HL 1
+#define IDLE_READ_BC 2
+#define IDLE_READ_DE 4
+#define IDLE_READ_C 8
+
+// The short loop in rom which was closed last by a branch back to its
+// start. A loop which only reads memory and changes nothing but A and F
+// comes back to the same state every iteration until an event changes the
+// memory it reads, so the iterations up to the next event can be skipped.
+struct IdleLoop {
+    // Address of the branch + 1, so 0 is no loop. Mapping an other rom
+    // bank resets it.
+    uint32_t key;
+    // Whether the body only reads memory, and which registers it reads
+    // through
+    bool pollable;
+    BYTE indirect;
+    // Clock cycles and instructions of one iteration, including the branch
+    unsigned int cycles;
+    unsigned int instructions;
+    // State at the start of the last iteration
+    unsigned long long time;
+    BYTE a;
+    BYTE f;
+    // Set at the start of every batch. Events, or the front end, may have
+    // changed memory the last iteration already read, so only one which
+    // ran within a batch tells that nothing changes.
+    bool disturbed;
+};
+
+int execute_next(struct GameBoy* gb);
+int execute_extended_instruction(struct GameBoy* gb, BYTE op);
+int cpu_run(struct GameBoy* gb);
+int cpu_service_interrupts(struct GameBoy* gb);
+void cpu_decode(struct GameBoy* gb, struct DecodedInstruction* entry, WORD addr);
+BYTE add_with_flags_u8(struct Processor* cpu, BYTE a, BYTE b, bool add_carry, bool affect_carry);
+WORD add_with_flags_u16(struct Processor* cpu, WORD a, WORD b);
+BYTE sub_with_flags_u8(struct Processor* cpu, BYTE a, BYTE b, bool sub_carry, bool affect_carry);
 
 #endif
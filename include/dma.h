@@ -0,0 +1,18 @@
+#ifndef __DMA_H_
+#define __DMA_H_ 1
+
+#include "utils.h"
+
+// Clock cycles from the write to 0xFF46 until the transfer starts, and of
+// the transfer itself (one byte per machine cycle)
+#define DMA_DELAY_CYCLES 4
+#define DMA_CYCLES 640
+#define OAM_SIZE 0xA0
+
+struct GameBoy;
+
+void dma_init(struct GameBoy* gb);
+void dma_write(struct GameBoy* gb, BYTE data);
+void dma_remap(struct GameBoy* gb);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __GAMEBOY_H_
+#define __GAMEBOY_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "mmu.h"
+#include "scheduler.h"
+#include "ppu.h"
+#include "cartridge.h"
+#include "timer.h"
+
+// The complete state of one emulated gameboy. It is a single plain
+// allocation without global state, so any number of them can run side by
+// side, and every function which needs more than one component gets it.
+struct GameBoy {
+    struct Processor cpu;
+    struct Scheduler scheduler;
+    struct MemoryManagementUnit mmu;
+    struct PixelProcessingUnit ppu;
+    struct Cartridge cart;
+    struct Timer timer;
+    // The pressed JOYPAD_* buttons
+    BYTE buttons;
+    // Hash of the boot rom, 0 if the emulation started without one
+    uint64_t boot_rom_hash;
+    // Compiled code when built with JIT, allocated on first use. It is a
+    // cache, not part of the state.
+    struct Jit* jit;
+    // The last decoded instruction which could not be kept
+    struct DecodedInstruction uncached;
+    // The immediate operand of the instruction being executed
+    WORD operand;
+    // The last short loop, checked for busy waiting. It is a cache, not
+    // part of the state.
+    struct IdleLoop idle;
+    // Instructions executed so far, including those skipped in idle loops,
+    // for benchmarks. It is not part of the state.
+    unsigned long long instructions;
+    // The gameboy this one was forked from, which owns the cartridge and
+    // the memory shared with it
+    struct GameBoy* parent;
+    // Forks of this gameboy, which use its cartridge. It must not be freed
+    // while it has any.
+    unsigned int children;
+    // The children which still share its memory. It must neither run nor
+    // load a save state while it has any.
+    unsigned int sharing;
+    // Whether this fork still shares the memory of its parent, until it
+    // loads a save state
+    bool shares_parent;
+};
+
+bool gameboy_init(struct GameBoy* gb, const char* rom_path, const char* boot_rom_path, const char* save_path);
+void gameboy_fork(struct GameBoy* parent, struct GameBoy* child);
+void gameboy_run_frames(struct GameBoy* gb, long frames);
+uint64_t gameboy_framebuffer_hash(struct GameBoy* gb);
+uint64_t gameboy_memory_hash(struct GameBoy* gb);
+void gameboy_free(struct GameBoy* gb);
+
+// Read a byte from memory
+static inline BYTE mmu_read(struct GameBoy* gb, WORD addr) {
+    BYTE* page = gb->mmu.read_pages[addr >> 8];
+    if (page) {
+        return page[addr & 0xFF];
+    }
+    return mmu_read_slow(gb, addr);
+}
+
+// Write a byte to memory
+static inline void mmu_write(struct GameBoy* gb, WORD addr, BYTE data) {
+    BYTE* page = gb->mmu.write_pages[addr >> 8];
+    if (page) {
+        page[addr & 0xFF] = data;
+        return;
+    }
+    mmu_write_slow(gb, addr, data);
+}
+
+#endif
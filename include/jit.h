@@ -0,0 +1,47 @@
+#ifndef __JIT_H_
+#define __JIT_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h"
+
+// Bytes of machine code in the cache, which is flushed when it is full
+#define JIT_CODE_SIZE (4 << 20)
+// Slots in the table of blocks, a power of two
+#define JIT_TABLE_SIZE (1 << 15)
+// Times a block is interpreted before it is compiled
+#define JIT_HOT_THRESHOLD 8
+// Instructions in a compiled block at most
+#define JIT_BLOCK_LENGTH 64
+
+struct GameBoy;
+
+// A compiled block, which runs its instructions and returns when it ends,
+// the clock reaches the deadline or the cpu halts
+typedef void (*jit_block)(struct GameBoy* gb);
+
+// A block starting at a rom address in a bank. The key is
+// (bank << 14 | (address & 0x3FFF)) + 1, so 0 marks an empty slot.
+struct JitEntry {
+    uint32_t key;
+    uint32_t count;
+    jit_block code;
+};
+
+// The compiled code of a gameboy. Only rom is compiled, it can not change
+// underneath the code. Code running from ram is always interpreted.
+struct Jit {
+    BYTE* code;
+    size_t used;
+    // Size of a host page. Only the pages a new block goes to are made
+    // writable while it is compiled.
+    size_t page_size;
+    struct JitEntry table[JIT_TABLE_SIZE];
+    unsigned int entries;
+};
+
+int jit_run(struct GameBoy* gb);
+void jit_free(struct GameBoy* gb);
+
+#endif
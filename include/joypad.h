@@ -0,0 +1,23 @@
+#ifndef __JOYPAD_H_
+#define __JOYPAD_H_ 1
+
+#include "utils.h"
+
+// Bits of the pressed buttons, the direction keys in the low nibble and
+// the action buttons in the high one, each in the order P1 reports them
+#define JOYPAD_RIGHT (1 << 0)
+#define JOYPAD_LEFT (1 << 1)
+#define JOYPAD_UP (1 << 2)
+#define JOYPAD_DOWN (1 << 3)
+#define JOYPAD_A (1 << 4)
+#define JOYPAD_B (1 << 5)
+#define JOYPAD_SELECT (1 << 6)
+#define JOYPAD_START (1 << 7)
+
+struct GameBoy;
+
+void joypad_init(struct GameBoy* gb);
+void joypad_write(struct GameBoy* gb, BYTE data);
+void joypad_set_buttons(struct GameBoy* gb, BYTE buttons);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __MBC_H_
+#define __MBC_H_ 1
+
+#include <stdbool.h>
+#include "utils.h"
+
+#define RAM_BANK_SIZE 0x2000
+#define MAX_RAM_SIZE 0x20000
+// Minimum time between two flushes of battery backed ram
+#define SAVE_FLUSH_INTERVAL_MS 1000
+
+struct Cartridge;
+struct MemoryManagementUnit;
+
+// The real time clock of MBC3 cartridges
+struct RealTimeClock {
+    // Emulated clock cycle at which the clock read zero
+    long long base;
+    // The clock value in seconds while it is halted
+    long long halted_value;
+    bool halted;
+    bool day_carry;
+
+    // Seconds, minutes, hours, day low, day high as of the last latch
+    BYTE latched[5];
+    // The last value written to 0x6000 - 0x7FFF, latching happens on 0 -> 1
+    BYTE latch;
+};
+
+struct MemoryBankController {
+    // Handle a write to the rom area, which controls the banking
+    void (*write_rom)(struct MemoryManagementUnit* mmu, WORD addr, BYTE data);
+    // Handle accesses to external ram which is not mapped: disabled ram or
+    // a selected rtc register
+    BYTE (*read_ram)(struct MemoryManagementUnit* mmu, WORD addr);
+    void (*write_ram)(struct MemoryManagementUnit* mmu, WORD addr, BYTE data);
+
+    // The external ram of the cartridge and the bank of it mapped to
+    // 0xA000 - 0xBFFF, NULL if none is mapped. Unless it is battery backed,
+    // the ram is internal_ram.
+    BYTE* ram;
+    unsigned int ram_size;
+    BYTE* mapped_ram;
+
+    // Battery backed ram is a shared mapping of the save file. A page is only
+    // mapped for writing once it is dirty, so the first write to a clean page
+    // goes through write_ram, which marks it. Flushing syncs the dirty pages
+    // and unmaps them for writing again.
+    bool battery;
+    int save_fd;
+    bool dirty[MAX_RAM_SIZE / 0x100];
+    bool any_dirty;
+    long long last_flush;
+
+    bool ram_enabled;
+    // The raw bank registers as written by the game
+    unsigned int rom_bank;
+    unsigned int ram_bank;
+    // MBC1 banking mode
+    bool advanced_mode;
+    // MBC3 rtc register selected instead of a ram bank (0x08 - 0x0C), or 0
+    BYTE rtc_register;
+    struct RealTimeClock rtc;
+    // The emulated clock of the gameboy, in clock cycles, which the rtc
+    // counts instead of the time of the host
+    const unsigned long long* clock;
+
+    // After a fork, the pages of ram which were not written since point to
+    // the memory of the parent and are not writable, see mbc_fork
+    BYTE* shared_ram[MAX_RAM_SIZE / 0x100];
+
+    BYTE internal_ram[MAX_RAM_SIZE];
+};
+
+bool mbc_init(struct MemoryManagementUnit* mmu, struct Cartridge* cart, const char* save_path, const unsigned long long* clock);
+void mbc_flush_ram(struct MemoryManagementUnit* mmu, bool force);
+void mbc_remap(struct MemoryManagementUnit* mmu);
+void mbc_fork(struct MemoryManagementUnit* mmu, struct MemoryBankController* from, const unsigned long long* clock);
+void mbc_free(struct MemoryManagementUnit* mmu);
+
+#endif
@@ -3,8 +3,14 @@
 
 #include <stdbool.h> 
 #include "utils.h"
+#include "mbc.h"
 
 #define MEM_SIZE 0x10000
+#define PAGE_SIZE 0x100
+#define ROM_BANK_SIZE 0x4000
+
+struct GameBoy;
+struct DecodedInstruction;
 
 struct test_st
 {
@@ -13,6 +19,40 @@ struct test_st
 };
 
 struct MemoryManagementUnit {
+    // One pointer per 256 byte page of the address space for reads and for
+    // writes. Pages which need special handling (IO registers, memory bank
+    // controller) are NULL and go through the slow path.
+    BYTE* read_pages[MEM_SIZE / PAGE_SIZE];
+    BYTE* write_pages[MEM_SIZE / PAGE_SIZE];
+
+    // The cartridge rom, split into banks of ROM_BANK_SIZE bytes
+    BYTE* cartridge;
+    unsigned int rom_banks;
+    // The banks mapped to 0x0000 - 0x3FFF and 0x4000 - 0x7FFF
+    unsigned int rom_bank0;
+    unsigned int rom_bank;
+    // Controls the rom and external ram banks
+    struct MemoryBankController mbc;
+    // After a fork, the pages of work ram which were not written since
+    // point to the memory of the parent and are not writable
+    BYTE* shared_wram[0x2000 / PAGE_SIZE];
+    // The decoded instructions of the pages mapped for reading, NULL where
+    // they are not kept. They are allocated per page of every rom bank
+    // (bank * 64 + page) and of work ram when first needed.
+    struct DecodedInstruction* code_pages[MEM_SIZE / PAGE_SIZE];
+    struct DecodedInstruction** rom_code;
+    // The decoded instructions of the rom are those of the parent of a
+    // fork, which frees them. Rom never changes, so the forks of a parent
+    // share them, also when they run on several threads: a page of rom is
+    // decoded as a whole before it is published, and never written after.
+    bool rom_code_shared;
+    struct DecodedInstruction* wram_code[0x2000 / PAGE_SIZE];
+    // Pages of work ram holding decoded instructions are not writable, so
+    // writes can invalidate them
+    bool code_wram[0x2000 / PAGE_SIZE];
+
+    // The boot rom is mapped over the first page until 0xFF50 is written
+    bool bios_mapped;
     BYTE bios[0x100];
     union {
         BYTE mem[0x10000];
@@ -33,16 +73,28 @@ struct MemoryManagementUnit {
             // IO registers
             BYTE io[0x80];
             // High RAM
-            BYTE hram[0x80];
+            BYTE hram[0x7F];
             // Interrupt register
             BYTE Interrupts;
         };
     };
 };
 
-// BYTE read(WORD addr);
-// WORD read_word(WORD addr);
-// void write(WORD addr, BYTE data);
-// void write_word(WORD addr, WORD data);
+void mmu_init(struct MemoryManagementUnit* mmu);
+void mmu_set_rom(struct MemoryManagementUnit* mmu, BYTE* rom, unsigned int banks);
+void mmu_map_rom_bank0(struct MemoryManagementUnit* mmu, unsigned int bank);
+void mmu_map_rom_bank(struct MemoryManagementUnit* mmu, unsigned int bank);
+void mmu_map_eram(struct MemoryManagementUnit* mmu, BYTE* ram, unsigned int size);
+void mmu_share_wram(struct MemoryManagementUnit* mmu, struct MemoryManagementUnit* parent);
+void mmu_share_rom_code(struct MemoryManagementUnit* mmu, struct MemoryManagementUnit* parent);
+struct DecodedInstruction* mmu_code_page(struct GameBoy* gb, WORD addr);
+void mmu_invalidate_code(struct MemoryManagementUnit* mmu);
+void mmu_free_code(struct MemoryManagementUnit* mmu);
+// The slow paths reach the peripherals, so they need the whole gameboy. The
+// inline fast paths mmu_read and mmu_write are in gameboy.h.
+BYTE mmu_read_slow(struct GameBoy* gb, WORD addr);
+void mmu_write_slow(struct GameBoy* gb, WORD addr, BYTE data);
+WORD mmu_read_word(struct GameBoy* gb, WORD addr);
+void mmu_write_word(struct GameBoy* gb, WORD addr, WORD data);
 
 #endif
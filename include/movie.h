@@ -0,0 +1,46 @@
+#ifndef __MOVIE_H_
+#define __MOVIE_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "savestate.h"
+
+#define MOVIE_MAGIC "GBMV"
+// Increment whenever the file layout changes
+#define MOVIE_VERSION 2
+
+// The input of a run, which replays it exactly: the hashes of the rom and
+// of the boot rom, if one was used, the state the run started from and the
+// buttons pressed during every frame.
+// A movie file is the header, the save state and one byte per frame.
+struct MovieHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t rom_hash;
+    uint64_t boot_rom_hash;
+    uint64_t state_size;
+    uint64_t frames;
+};
+
+struct Movie {
+    uint64_t rom_hash;
+    uint64_t boot_rom_hash;
+    struct SaveState* start;
+    size_t state_size;
+
+    // JOYPAD_* buttons of every frame
+    BYTE* inputs;
+    unsigned long frames;
+    unsigned long capacity;
+};
+
+bool movie_record(struct Movie* movie, struct GameBoy* gb);
+void movie_add_frame(struct Movie* movie, BYTE buttons);
+void movie_truncate(struct Movie* movie, unsigned long frames);
+bool movie_save(struct Movie* movie, const char* path);
+bool movie_load(struct Movie* movie, const char* path);
+bool movie_start_replay(struct Movie* movie, struct GameBoy* gb);
+BYTE movie_input(struct Movie* movie, unsigned long frame);
+void movie_free(struct Movie* movie);
+
+#endif
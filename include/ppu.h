@@ -0,0 +1,59 @@
+#ifndef __PPU_H_
+#define __PPU_H_ 1
+
+#include <stdbool.h>
+#include "utils.h"
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
+
+// Clock cycles of the PPU modes on a visible line
+#define OAM_SCAN_CYCLES 80
+#define DRAWING_CYCLES 172
+#define HBLANK_CYCLES 204
+#define LINE_CYCLES 456
+#define LINES 154
+
+// Tiles in vram and the 256 byte pages they occupy (768 tiles on CGB)
+#define TILE_COUNT 384
+#define TILE_DATA_PAGES (TILE_COUNT * 16 / 0x100)
+
+#define MODE_HBLANK 0
+#define MODE_VBLANK 1
+#define MODE_OAM_SCAN 2
+#define MODE_DRAWING 3
+
+// Bits of LCDC
+#define LCDC_BG_ENABLE (1 << 0)
+#define LCDC_OBJ_ENABLE (1 << 1)
+#define LCDC_OBJ_SIZE (1 << 2)
+#define LCDC_BG_MAP (1 << 3)
+#define LCDC_TILE_DATA (1 << 4)
+#define LCDC_WINDOW_ENABLE (1 << 5)
+#define LCDC_WINDOW_MAP (1 << 6)
+#define LCDC_ENABLE (1 << 7)
+
+struct PixelProcessingUnit {
+    // Shades 0 (white) to 3 (black) of the last rendered frame
+    BYTE framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH];
+    // The line of the window to draw next, which only advances on lines
+    // where the window is visible
+    BYTE window_line;
+    // Number of frames completed so far
+    unsigned long long frames;
+
+    // The tiles decoded to one color index per pixel. A page of tile data
+    // is only mapped for writing while it is dirty, so the first write
+    // after decoding goes through ppu_write_tile_data and marks it.
+    BYTE tiles[TILE_COUNT][8][8];
+    bool dirty_pages[TILE_DATA_PAGES];
+};
+
+struct GameBoy;
+
+void ppu_init(struct GameBoy* gb);
+void ppu_write_register(struct GameBoy* gb, WORD addr, BYTE data);
+void ppu_write_tile_data(struct GameBoy* gb, WORD addr, BYTE data);
+void ppu_invalidate_tiles(struct GameBoy* gb);
+
+#endif
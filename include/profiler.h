@@ -0,0 +1,30 @@
+#ifndef __PROFILER_H_
+#define __PROFILER_H_ 1
+
+#include "utils.h"
+
+// Emulated clock cycles between two samples of the program counter
+#define PROFILE_SAMPLE_PERIOD 1024
+// Slots in the histogram of sampled (bank, PC), a power of two
+#define PROFILE_SLOTS (1 << 16)
+// Where the samples are written as folded stacks for flamegraph.pl
+#define PROFILE_FOLDED_PATH "profile.folded"
+// Hot program counters listed in the report
+#define PROFILE_REPORT_PCS 32
+
+struct GameBoy;
+
+// Count an executed instruction, which started at pc in bank and took
+// cycles. For CB instructions the operand holds the second opcode. When
+// built with PROFILE, the report is written to stderr and the folded stacks
+// to PROFILE_FOLDED_PATH when the program exits. Every thread counts on its
+// own, and the report adds them up.
+void profile_instruction(WORD pc, unsigned int bank, BYTE op, WORD operand, int cycles);
+// Count the cycles of idle loop iterations skipped by the instruction being
+// executed. They are part of the cycles it returns, but are charged to idle
+// instead of to it.
+void profile_idle(int cycles);
+// The rom bank the instruction at pc is fetched from, 0 outside of rom
+unsigned int profile_bank(struct GameBoy* gb, WORD pc);
+
+#endif
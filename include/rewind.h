@@ -0,0 +1,51 @@
+#ifndef __REWIND_H_
+#define __REWIND_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "savestate.h"
+
+// Literal runs of a delta continue through fewer equal bytes than this
+#define REWIND_MIN_ZERO_RUN 4
+
+// A compressed delta in the ring buffer
+struct RewindEntry {
+    size_t offset;
+    size_t size;
+};
+
+// History of save states for stepping backwards. Only the most recent
+// state is kept in full. Every older one is stored as the run length
+// encoded XOR against the state after it, which is mostly zero since
+// little memory changes between frames. The deltas live in a ring
+// buffer of fixed size, which drops the oldest ones when it is full.
+struct Rewind {
+    // Frames between two recorded states, and frames since the last one
+    unsigned int interval;
+    unsigned int frames;
+
+    size_t state_size;
+    // The most recent recorded state, and room for saving the next one
+    struct SaveState* current;
+    struct SaveState* next;
+    bool has_current;
+    // Room for encoding one delta
+    BYTE* delta;
+
+    BYTE* buffer;
+    size_t capacity;
+    // Ring of the deltas in the buffer, from the oldest at first to the
+    // most recent one
+    struct RewindEntry* entries;
+    unsigned int max_entries;
+    unsigned int first;
+    unsigned int count;
+};
+
+bool rewind_init(struct Rewind* rewind, struct GameBoy* gb, size_t capacity, unsigned int interval);
+void rewind_frame(struct Rewind* rewind, struct GameBoy* gb);
+void rewind_record(struct Rewind* rewind, struct GameBoy* gb);
+bool rewind_step_back(struct Rewind* rewind, struct GameBoy* gb);
+void rewind_free(struct Rewind* rewind);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __SAVESTATE_H_
+#define __SAVESTATE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "gameboy.h"
+
+#define SAVESTATE_MAGIC "GBSS"
+// Increment whenever the layout of struct SaveState changes
+#define SAVESTATE_VERSION 7
+
+// A snapshot of everything that changes while a gameboy runs. The rom,
+// the boot rom and the page tables are not part of it, they are rebuilt
+// from the gameboy the state is loaded into, which has to run the same
+// cartridge, and the same boot rom while it is still mapped. States are plain memory and are only portable between
+// builds with the same struct layout, which the header size checks.
+struct SaveState {
+    char magic[4];
+    uint32_t version;
+    // sizeof(struct SaveState) of the build which wrote it
+    uint32_t header_size;
+    // Identify the cartridge
+    WORD global_checksum;
+    BYTE cartridge_type;
+    uint32_t ram_size;
+    // Hash of the boot rom the gameboy was started with, 0 for none
+    uint64_t boot_rom_hash;
+
+    struct Processor cpu;
+    BYTE buttons;
+
+    // Scheduler, without the handlers
+    unsigned long long now;
+    struct Event events[EVENT_COUNT];
+    int event_count;
+    int event_position[EVENT_COUNT];
+
+    // MMU and memory bank controller
+    bool bios_mapped;
+    unsigned int rom_bank0;
+    bool ram_enabled;
+    unsigned int rom_bank;
+    unsigned int ram_bank;
+    bool advanced_mode;
+    BYTE rtc_register;
+    struct RealTimeClock rtc;
+
+    // Timer
+    struct Timer timer;
+
+    // PPU
+    BYTE window_line;
+    unsigned long long frames;
+    BYTE framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH];
+
+    // 0x8000 - 0xFFFF: vram, the external ram area, wram, oam, io and hram
+    BYTE memory[0x8000];
+    // The external ram of the cartridge, ram_size bytes
+    BYTE ram[];
+};
+
+size_t savestate_size(struct GameBoy* gb);
+size_t savestate_save(struct GameBoy* gb, struct SaveState* state, size_t size);
+bool savestate_load(struct GameBoy* gb, const struct SaveState* state, size_t size);
+
+#endif
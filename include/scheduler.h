@@ -0,0 +1,64 @@
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_ 1
+
+#include "utils.h"
+#include "cpu.h"
+
+// Clock cycles of one frame (154 lines of 456 cycles)
+#define CYCLES_PER_FRAME 70224
+
+// Interrupt bits in IE and IF
+#define INTERRUPT_VBLANK 0
+#define INTERRUPT_STAT 1
+#define INTERRUPT_TIMER 2
+#define INTERRUPT_SERIAL 3
+#define INTERRUPT_JOYPAD 4
+
+// Everything which happens at a known point in time is an event. There is
+// at most one pending event of each type.
+enum EventType {
+    // TIMA overflow
+    EVENT_TIMER,
+    // Change of the PPU mode or LY
+    EVENT_PPU,
+    // End of an OAM DMA transfer
+    EVENT_DMA,
+    // End of a serial transfer
+    EVENT_SERIAL,
+    EVENT_COUNT
+};
+
+// Called with the time the event was scheduled for
+typedef void (*event_handler)(struct GameBoy* gb, unsigned long long time);
+
+struct Event {
+    unsigned long long time;
+    enum EventType type;
+};
+
+struct Scheduler {
+    // The emulated clock in clock cycles
+    unsigned long long now;
+    // The cpu runs until the clock reaches the deadline, which is the time
+    // of the next event or earlier
+    unsigned long long deadline;
+
+    // Min heap of the pending events, ordered by time
+    struct Event heap[EVENT_COUNT];
+    int size;
+    // Position of each event type in the heap, or -1 if not pending
+    int position[EVENT_COUNT];
+    event_handler handlers[EVENT_COUNT];
+};
+
+void scheduler_init(struct Scheduler* scheduler);
+void scheduler_set_handler(struct Scheduler* scheduler, enum EventType type, event_handler handler);
+void scheduler_schedule(struct Scheduler* scheduler, enum EventType type, unsigned long long time);
+void scheduler_cancel(struct Scheduler* scheduler, enum EventType type);
+void scheduler_end_batch(struct Scheduler* scheduler);
+void scheduler_run_until(struct GameBoy* gb, unsigned long long target);
+void request_interrupt(struct GameBoy* gb, int interrupt);
+void update_pending_interrupts(struct GameBoy* gb);
+void write_interrupt_register(struct GameBoy* gb, WORD addr, BYTE data);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __SERIAL_H_
+#define __SERIAL_H_ 1
+
+#include "utils.h"
+
+// Clock cycles to shift out one bit with the internal clock (8192 Hz)
+#define SERIAL_CYCLES_PER_BIT 512
+
+struct GameBoy;
+
+void serial_init(struct GameBoy* gb);
+void serial_write_control(struct GameBoy* gb, BYTE data);
+
+#endif
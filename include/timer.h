@@ -0,0 +1,24 @@
+#ifndef __TIMER_H_
+#define __TIMER_H_ 1
+
+#include "utils.h"
+
+struct GameBoy;
+
+// The timer never ticks. DIV is the upper byte of a 16 bit divider which
+// counts clock cycles since it was last reset, and TIMA counts the falling
+// edges of one of its bits since the time it was last brought up to date.
+// Both are derived from the clock when they are read, and the overflow of
+// TIMA is an event.
+struct Timer {
+    // Time the divider was reset
+    unsigned long long divider_base;
+    // Time io[TIMA] was brought up to date
+    unsigned long long counter_base;
+};
+
+void timer_init(struct GameBoy* gb);
+BYTE timer_read(struct GameBoy* gb, WORD addr);
+void timer_write(struct GameBoy* gb, WORD addr, BYTE data);
+
+#endif
@@ -1,11 +1,18 @@
 #ifndef __UTIL_H_
 #define __UTIL_H_ 1
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Start value of hash_bytes
+#define HASH_INIT 0xCBF29CE484222325ull
+
 typedef unsigned char BYTE;
 typedef unsigned short WORD;
 typedef signed char SIGNED_BYTE;
 typedef signed short SIGNED_WORD;
 
 WORD bytes_to_word(BYTE a, BYTE b);
+uint64_t hash_bytes(uint64_t hash, const BYTE* data, size_t size);
 
 #endif
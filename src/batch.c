@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "../include/gameboy.h"
+#include "../include/scheduler.h"
+#include "../include/joypad.h"
+#include "../include/movie.h"
+
+// Headless batch runner: runs every line of a manifest as an independent
+// gameboy on a pool of threads. A manifest line is
+//
+//     <rom path> <frames> [movie]
+//
+// With a movie, the run starts from its state and presses its buttons.
+// Lines starting with # are ignored. One result line per run is written in
+// manifest order:
+//
+//     <rom path> <frames> <ok|error> <framebuffer hash> <cycles> <milliseconds>
+
+struct Job {
+    char rom_path[4096];
+    long frames;
+    char movie_path[4096];
+
+    bool ok;
+    uint64_t hash;
+    unsigned long long cycles;
+    double milliseconds;
+};
+
+static struct Job* jobs;
+static int job_count;
+static int next_job;
+static const char* boot_rom_path;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Take jobs until there are none left. Every worker runs its own gameboy,
+// which is reused for all of its jobs.
+static void* worker(void* arg) {
+    struct GameBoy* gb = malloc(sizeof(struct GameBoy));
+    for (;;) {
+        int ix = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (ix >= job_count) {
+            free(gb);
+            return NULL;
+        }
+        struct Job* job = &jobs[ix];
+        double start = now_ms();
+
+        if (!gameboy_init(gb, job->rom_path, boot_rom_path, NULL)) {
+            job->milliseconds = now_ms() - start;
+            continue;
+        }
+        job->ok = true;
+        if (job->movie_path[0]) {
+            struct Movie movie;
+            job->ok = movie_load(&movie, job->movie_path) && movie_start_replay(&movie, gb);
+            for (long frame = 0; job->ok && frame < job->frames; frame++) {
+                joypad_set_buttons(gb, movie_input(&movie, frame));
+                gameboy_run_frames(gb, 1);
+            }
+            movie_free(&movie);
+        } else {
+            gameboy_run_frames(gb, job->frames);
+        }
+        if (job->ok) {
+            job->hash = gameboy_framebuffer_hash(gb);
+            job->cycles = gb->scheduler.now;
+        }
+        gameboy_free(gb);
+        job->milliseconds = now_ms() - start;
+    }
+}
+
+// Read the jobs from the manifest at path
+static bool read_manifest(const char* path) {
+    FILE* manifest = fopen(path, "r");
+    if (manifest == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    char line[4200];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), manifest)) {
+        struct Job job = {0};
+        if (line[0] == '#' || sscanf(line, "%4095s %ld %4095s", job.rom_path, &job.frames, job.movie_path) < 2) {
+            continue;
+        }
+        if (job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, capacity * sizeof(struct Job));
+        }
+        jobs[job_count++] = job;
+    }
+    fclose(manifest);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* results_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:b:o:")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'b':
+                boot_rom_path = optarg;
+                break;
+            case 'o':
+                results_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-b boot rom] [-o results] manifest\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j threads] [-b boot rom] [-o results] manifest\n", argv[0]);
+        return 1;
+    }
+    if (!read_manifest(argv[optind])) {
+        return 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    pthread_t* pool = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+
+    FILE* results = results_path ? fopen(results_path, "w") : stdout;
+    if (results == NULL) {
+        fprintf(stderr, "Could not open %s\n", results_path);
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < job_count; i++) {
+        struct Job* job = &jobs[i];
+        failed += !job->ok;
+        fprintf(results, "%s %ld %s %016llx %llu %.3f\n", job->rom_path, job->frames, job->ok ? "ok" : "error",
+                (unsigned long long)job->hash, job->cycles, job->milliseconds);
+    }
+    if (results != stdout) {
+        fclose(results);
+    }
+    free(jobs);
+    return failed ? 1 : 0;
+}
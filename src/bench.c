@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../include/gameboy.h"
+#include "../include/scheduler.h"
+
+// Microbenchmarks of the cpu core. Every mix is a loop over the opcodes of
+// one group, assembled here into a rom, which runs with the LCD off and
+// interrupts disabled for a fixed number of clock cycles. Roms given on the
+// command line run the same way from their entry point. Results are written
+// as JSON to stdout:
+//
+//     gameboy-bench [-c cycles] [-n runs] [rom ...]
+//
+// The time of a benchmark is the fastest of its runs. The instructions are
+// counted by the cpu while it runs.
+
+#define DEFAULT_CYCLES 100000000ULL
+#define DEFAULT_RUNS 3
+// Times the opcodes of a mix are repeated in the body of its loop
+#define MIX_REPEATS 16
+// Nominal clock of the DMG in clock cycles per second
+#define CLOCK_SPEED 4194304.0
+
+#ifndef REVISION
+#define REVISION ""
+#endif
+
+#if defined(JIT)
+#define DISPATCH_NAME "jit"
+#elif defined(THREADED_DISPATCH)
+#define DISPATCH_NAME "threaded"
+#else
+#define DISPATCH_NAME "table"
+#endif
+
+// The code of a mix is assembled into an image of the whole address space
+struct Assembler {
+    BYTE image[0x10000];
+    WORD pc;
+};
+
+static void emit_byte(struct Assembler* as, BYTE byte) {
+    as->image[as->pc++] = byte;
+}
+
+// Emit an opcode with a 16 bit operand
+static void emit_word(struct Assembler* as, BYTE op, WORD word) {
+    emit_byte(as, op);
+    emit_byte(as, word & 0xFF);
+    emit_byte(as, word >> 8);
+}
+
+static void emit_bytes(struct Assembler* as, const BYTE* bytes, size_t size) {
+    memcpy(as->image + as->pc, bytes, size);
+    as->pc += size;
+}
+
+#define EMIT(as, ...) do { \
+        static const BYTE bytes[] = { __VA_ARGS__ }; \
+        emit_bytes(as, bytes, sizeof(bytes)); \
+    } while (0)
+
+// Only flow control, the dispatch cost every other mix is measured against
+static void mix_nop(struct Assembler* as) {
+    EMIT(as, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+}
+
+// LD r,r'
+static void mix_load(struct Assembler* as) {
+    EMIT(as, 0x41, 0x4A, 0x53, 0x5C, 0x65, 0x6F, 0x78, 0x47);
+}
+
+// Loads and arithmetic with immediate operands
+static void mix_immediate(struct Assembler* as) {
+    EMIT(as, 0x06, 0x12, 0x0E, 0x34, 0x3E, 0x56, 0xC6, 0x01,
+             0xFE, 0x02, 0x11, 0x34, 0x12, 0xE6, 0xFF, 0xF6, 0x00);
+}
+
+// 8 bit arithmetic and logic on registers
+static void mix_alu(struct Assembler* as) {
+    EMIT(as, 0x80, 0x89, 0x92, 0x9B, 0xA4, 0xAD, 0xB0, 0xB9, 0x14, 0x1D);
+}
+
+// 16 bit increments, decrements and additions
+static void mix_alu16(struct Assembler* as) {
+    EMIT(as, 0x03, 0x1B, 0x09, 0x23, 0x19, 0x2B);
+}
+
+// Rotates, shifts and bit operations of the CB prefix
+static void mix_cb(struct Assembler* as) {
+    EMIT(as, 0xCB, 0x00, 0xCB, 0x19, 0xCB, 0x22, 0xCB, 0x33,
+             0xCB, 0x3C, 0xCB, 0x5F, 0xCB, 0xC8, 0xCB, 0x91);
+}
+
+// Loads and stores to work ram and high ram
+static void mix_memory(struct Assembler* as) {
+    // LD HL,C000
+    emit_word(as, 0x21, 0xC000);
+    EMIT(as, 0x2A, 0x22, 0x46, 0x71, 0x34, 0xF0, 0x80, 0xE0, 0x81);
+    emit_word(as, 0xFA, 0xC100);
+    emit_word(as, 0xEA, 0xC110);
+}
+
+// PUSH and POP
+static void mix_stack(struct Assembler* as) {
+    EMIT(as, 0xC5, 0xD5, 0xF5, 0xE1, 0xD1, 0xC1);
+}
+
+// Jumps, calls and returns, taken and not taken. Z and C are set on entry
+// and never change. The subroutines at 0x0008 and 0x0010 only return.
+static void mix_branch(struct Assembler* as) {
+    // JR +0, JR Z,+0, JR NC,+0
+    EMIT(as, 0x18, 0x00, 0x28, 0x00, 0x30, 0x00);
+    // JP Z,next and JP NC,next
+    emit_word(as, 0xCA, as->pc + 3);
+    emit_word(as, 0xD2, as->pc + 3);
+    // CALL, RST 08, CALL NZ and CALL Z
+    emit_word(as, 0xCD, 0x0008);
+    emit_byte(as, 0xCF);
+    emit_word(as, 0xC4, 0x0010);
+    emit_word(as, 0xCC, 0x0010);
+}
+
+struct Mix {
+    const char* name;
+    void (*body)(struct Assembler* as);
+    // Where the loop is placed, in rom or in work ram
+    WORD origin;
+};
+
+static const struct Mix mixes[] = {
+    { "nop", mix_nop, 0x0150 },
+    { "load", mix_load, 0x0150 },
+    { "immediate", mix_immediate, 0x0150 },
+    { "alu", mix_alu, 0x0150 },
+    { "alu16", mix_alu16, 0x0150 },
+    { "cb", mix_cb, 0x0150 },
+    { "memory", mix_memory, 0x0150 },
+    { "stack", mix_stack, 0x0150 },
+    { "branch", mix_branch, 0x0150 },
+    // Same as alu, but from work ram, which is never compiled and has to
+    // check for writes to its code
+    { "alu_wram", mix_alu, 0xC200 },
+};
+
+#define MIX_COUNT (sizeof(mixes) / sizeof(mixes[0]))
+
+// Assemble the loop of a mix and the rom around it
+static void assemble(struct Assembler* as, const struct Mix* mix) {
+    memset(as->image, 0, sizeof(as->image));
+
+    // Subroutines of the branch mix: RET, and RET Z followed by RET
+    as->image[0x0008] = 0xC9;
+    as->image[0x0010] = 0xC8;
+    as->image[0x0011] = 0xC9;
+
+    // Entry point and a rom only cartridge header
+    as->pc = 0x0100;
+    emit_word(as, 0xC3, mix->origin);
+    memcpy(as->image + HEADER_TITLE, "BENCH", 5);
+    BYTE checksum = 0;
+    for (int addr = HEADER_TITLE; addr < HEADER_CHECKSUM; addr++) {
+        checksum = checksum - as->image[addr] - 1;
+    }
+    as->image[HEADER_CHECKSUM] = checksum;
+
+    as->pc = mix->origin;
+    for (int i = 0; i < MIX_REPEATS; i++) {
+        mix->body(as);
+    }
+    emit_word(as, 0xC3, mix->origin);
+}
+
+// Start a gameboy on the rom of a mix. The cartridge is loaded from a
+// temporary file, which is removed again once it is mapped.
+static bool init_mix(struct GameBoy* gb, const struct Mix* mix, struct Assembler* as) {
+    char path[] = "/tmp/gameboy-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create a temporary rom\n");
+        return false;
+    }
+    bool written = write(fd, as->image, 2 * ROM_BANK_SIZE) == 2 * ROM_BANK_SIZE;
+    close(fd);
+    bool ok = written && gameboy_init(gb, path, NULL, NULL);
+    unlink(path);
+    if (!ok) {
+        return false;
+    }
+
+    // Code in work ram is copied there
+    if (mix->origin >= 0x8000) {
+        for (unsigned int addr = mix->origin; addr < as->pc; addr++) {
+            mmu_write(gb, addr, as->image[addr]);
+        }
+    }
+
+    mmu_write(gb, 0xFF40, 0x00);
+    mmu_write(gb, 0xFFFF, 0x00);
+    gb->cpu.SP = 0xD000;
+    gb->cpu.PC = mix->origin;
+    return true;
+}
+
+static bool init_benchmark(struct GameBoy* gb, const struct Mix* mix, struct Assembler* as, const char* rom_path) {
+    if (mix) {
+        return init_mix(gb, mix, as);
+    }
+    return gameboy_init(gb, rom_path, NULL, NULL);
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_json_string(const char* string) {
+    putchar('"');
+    for (const char* c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            putchar('\\');
+        }
+        if ((unsigned char)*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+// Run one benchmark, either a mix or a rom, and print its result. The cost
+// of a mix is also given over the cost of the nop mix, which is only fetch
+// and dispatch. Returns false if it could not be started.
+static bool run_benchmark(struct GameBoy* gb, const struct Mix* mix, const char* rom_path, unsigned long long cycles, int runs) {
+    static struct Assembler as;
+    if (mix) {
+        assemble(&as, mix);
+    }
+
+    double best = 0;
+    unsigned long long emulated = 0;
+    unsigned long long instructions = 0;
+    for (int run = 0; run < runs; run++) {
+        if (!init_benchmark(gb, mix, &as, rom_path)) {
+            return false;
+        }
+        double start = now_seconds();
+        scheduler_run_until(gb, cycles);
+        double seconds = now_seconds() - start;
+        if (run == 0 || seconds < best) {
+            best = seconds;
+        }
+        emulated = gb->scheduler.now;
+        instructions = gb->instructions;
+        gameboy_free(gb);
+    }
+
+    static double nop_ns;
+    double ns = instructions ? best * 1e9 / instructions : 0.0;
+    if (mix == &mixes[0]) {
+        nop_ns = ns;
+    }
+
+    printf("%s\n    {\"name\": ", mix == &mixes[0] ? "" : ",");
+    print_json_string(mix ? mix->name : rom_path);
+    printf(", \"kind\": \"%s\", \"cycles\": %llu, \"instructions\": %llu, \"seconds\": %.6f, "
+           "\"emulated_mhz\": %.2f, \"realtime\": %.2f, \"ns_per_instruction\": %.3f, \"cycles_per_instruction\": %.3f",
+           mix ? "mix" : "rom", emulated, instructions, best,
+           emulated / best / 1e6, emulated / best / CLOCK_SPEED, ns,
+           instructions ? (double)emulated / instructions : 0.0);
+    if (mix) {
+        printf(", \"ns_over_nop\": %.3f", ns - nop_ns);
+    }
+    printf("}");
+    fflush(stdout);
+    return true;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-c cycles] [-n runs] [rom ...]\n", program);
+}
+
+int main(int argc, char** argv) {
+    unsigned long long cycles = DEFAULT_CYCLES;
+    int runs = DEFAULT_RUNS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cycles = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cycles == 0 || runs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct GameBoy* gb = malloc(sizeof(struct GameBoy));
+    bool ok = true;
+    printf("{\"revision\": \"%s\", \"dispatch\": \"%s\", \"runs\": %d, \"benchmarks\": [", REVISION, DISPATCH_NAME, runs);
+    for (unsigned int ix = 0; ix < MIX_COUNT; ix++) {
+        ok &= run_benchmark(gb, &mixes[ix], NULL, cycles, runs);
+    }
+    for (int ix = optind; ix < argc; ix++) {
+        ok &= run_benchmark(gb, NULL, argv[ix], cycles, runs);
+    }
+    printf("\n]}\n");
+    free(gb);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/cartridge.h"
+#include "../include/mmu.h"
+
+// Size of the external ram for each value of the RAM size header field
+static const unsigned int ram_sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+
+// Parse the header of the mapped rom
+static void parse_header(struct Cartridge* cart) {
+    BYTE* rom = cart->rom;
+
+    memcpy(cart->title, rom + HEADER_TITLE, 16);
+    cart->title[16] = '\0';
+    cart->type = rom[HEADER_TYPE];
+
+    // The rom has 32 KiB << n, but never more banks than the file holds
+    unsigned int banks = 2u << rom[HEADER_ROM_SIZE];
+    cart->rom_banks = banks < cart->size / ROM_BANK_SIZE ? banks : cart->size / ROM_BANK_SIZE;
+
+    BYTE ram_size = rom[HEADER_RAM_SIZE];
+    cart->ram_size = ram_size < sizeof(ram_sizes) / sizeof(ram_sizes[0]) ? ram_sizes[ram_size] : 0;
+
+    // The header checksum covers the title up to the version number
+    BYTE checksum = 0;
+    for (int addr = HEADER_TITLE; addr < HEADER_CHECKSUM; addr++) {
+        checksum = checksum - rom[addr] - 1;
+    }
+    cart->header_checksum_valid = checksum == rom[HEADER_CHECKSUM];
+    cart->global_checksum = bytes_to_word(rom[HEADER_GLOBAL_CHECKSUM], rom[HEADER_GLOBAL_CHECKSUM + 1]);
+}
+
+// Map the rom file at path read only and parse its header. Returns false
+// if the file can not be used as a cartridge.
+bool cartridge_load(struct Cartridge* cart, const char* path) {
+    memset(cart, 0, sizeof(*cart));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 2 * ROM_BANK_SIZE) {
+        fprintf(stderr, "%s is not a valid rom\n", path);
+        close(fd);
+        return false;
+    }
+
+    // The mapping is shared between all processes running the same rom
+    void* rom = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (rom == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return false;
+    }
+
+    cart->rom = rom;
+    cart->size = st.st_size;
+    parse_header(cart);
+    if (!cart->header_checksum_valid) {
+        fprintf(stderr, "Warning: header checksum of %s does not match\n", path);
+    }
+    return true;
+}
+
+void cartridge_unload(struct Cartridge* cart) {
+    if (cart->rom) {
+        munmap(cart->rom, cart->size);
+    }
+    memset(cart, 0, sizeof(*cart));
+}
+
+// Hash of the whole rom, which identifies the game exactly
+uint64_t cartridge_hash(struct Cartridge* cart) {
+    return hash_bytes(HASH_INIT, cart->rom, cart->size);
+}
+
+// The global checksum touches every page of the rom, so it is only
+// verified on request instead of on every load
+bool cartridge_verify_global_checksum(struct Cartridge* cart) {
+    WORD checksum = 0;
+    for (size_t addr = 0; addr < cart->size; addr++) {
+        if (addr != HEADER_GLOBAL_CHECKSUM && addr != HEADER_GLOBAL_CHECKSUM + 1) {
+            checksum += cart->rom[addr];
+        }
+    }
+    return checksum == cart->global_checksum;
+}
@@ -1,69 +1,118 @@
 #include <stdio.h>
 #include <stdbool.h>
-#include "../include/mmu.h"
 #include "../include/cpu.h"
+#include "../include/gameboy.h"
+#include "../include/jit.h"
+#include "../include/profiler.h"
 
-#define FLAG_C 4
-#define FLAG_H 5
-#define FLAG_N 6
-#define FLAG_Z 7
-
-extern BYTE mem[];
-
-struct Processor {
-    bool is_halted;
-    bool is_stopped;
-
-    // Both IE and DE only take effect after one cycle 
-    bool enable_interrupts_instruction;
-    bool disable_interrupts_instruction;
-
-    WORD SP;
-    WORD PC = 0;
-
-    // Register declarations
-    union {
-        struct {
-            BYTE F;
-            BYTE A;
-        };
-        WORD AF;
-    };
-    union {
-        struct {
-            BYTE C;
-            BYTE B;
-        };
-        WORD BC;
-    };
-    union {
-        struct {
-            BYTE E;
-            BYTE D;
-        };
-        WORD DE;
-    };
-    union {
-        struct {
-            BYTE F;
-            BYTE H;
-        };
-        WORD HF;
-    };
-}
-
-BYTE read_next();
-WORD read_next_word();
-
-bool get_flag(Processor* cpu, BYTE ix) {
-    return (cpu->F >> ix) & 1 == 1;
-}
-
-void set_flag(BYTE ix) {
+// Take the immediate byte of the current instruction, which was decoded
+// with it, and increment the program counter. Every handler advances the
+// program counter by a constant, so the next fetch never waits for the
+// length of the instruction.
+static inline BYTE read_next(struct GameBoy* gb) {
+    gb->cpu.PC++;
+    return gb->operand;
+}
+
+// Take the immediate word of the current instruction and increment the
+// program counter twice
+static inline WORD read_next_word(struct GameBoy* gb) {
+    gb->cpu.PC += 2;
+    return gb->operand;
+}
+
+// Push a word onto the stack
+static inline void push(struct GameBoy* gb, WORD val) {
+    gb->cpu.SP -= 2;
+    mmu_write_word(gb, gb->cpu.SP, val);
+}
+
+// Pop a word from the stack
+static inline WORD pop(struct GameBoy* gb) {
+    WORD res = mmu_read_word(gb, gb->cpu.SP);
+    gb->cpu.SP += 2;
+    return res;
+}
+
+// The kinds of operations which leave lazy flags. The result gives Z, the
+// kind N and H: ADD and SUB compute H from the operands, AND sets it and
+// LOGIC clears it.
+#define LAZY_NONE 0
+#define LAZY_ADD 1
+#define LAZY_SUB 2
+#define LAZY_AND 3
+#define LAZY_LOGIC 4
+
+// Record the lazy flags of an operation, the operands are only needed for
+// ADD and SUB
+static inline void set_lazy_flags(struct Processor* cpu, BYTE op, BYTE result) {
+    cpu->lazy_op = op;
+    cpu->lazy_result = result;
+}
+
+static inline void set_lazy_operands(struct Processor* cpu, BYTE a, BYTE b, BYTE carry) {
+    cpu->lazy_a = a;
+    cpu->lazy_b = b;
+    cpu->lazy_carry = carry;
+}
+
+// Compute the pending lazy flags into F
+static inline void sync_flags(struct Processor* cpu) {
+    if (cpu->lazy_op == LAZY_NONE) {
+        return;
+    }
+
+    BYTE f = cpu->F & (1 << FLAG_C);
+    if (cpu->lazy_result == 0) {
+        f |= 1 << FLAG_Z;
+    }
+    switch (cpu->lazy_op) {
+        case LAZY_ADD:
+            if ((cpu->lazy_a & 0xF) + (cpu->lazy_b & 0xF) + cpu->lazy_carry > 0xF) {
+                f |= 1 << FLAG_H;
+            }
+            break;
+        case LAZY_SUB:
+            f |= 1 << FLAG_N;
+            if ((cpu->lazy_a & 0xF) < (cpu->lazy_b & 0xF) + cpu->lazy_carry) {
+                f |= 1 << FLAG_H;
+            }
+            break;
+        case LAZY_AND:
+            f |= 1 << FLAG_H;
+            break;
+    }
+    cpu->F = f;
+    cpu->lazy_op = LAZY_NONE;
+}
+
+// Read a flag. The carry flag and Z of a pending operation are read without
+// computing the other flags.
+static inline bool get_flag(struct Processor* cpu, BYTE ix) {
+    if (ix == FLAG_Z && cpu->lazy_op != LAZY_NONE) {
+        return cpu->lazy_result == 0;
+    }
+    if (ix != FLAG_C) {
+        sync_flags(cpu);
+    }
+    return (cpu->F >> ix) & 1;
+}
+
+static inline void set_flag(struct Processor* cpu, BYTE ix) {
+    if (ix != FLAG_C) {
+        sync_flags(cpu);
+    }
     cpu->F |= 1 << ix;
 }
 
-void set_flag_to(Processor* cpu, BYTE ix, bool to) {
+static inline void unset_flag(struct Processor* cpu, BYTE ix) {
+    if (ix != FLAG_C) {
+        sync_flags(cpu);
+    }
+    cpu->F &= ~(1 << ix);
+}
+
+static inline void set_flag_to(struct Processor* cpu, BYTE ix, bool to) {
     if (to) {
         set_flag(cpu, ix);
     } else {
@@ -71,1708 +120,1228 @@ void set_flag_to(Processor* cpu, BYTE ix, bool to) {
     }
 }
 
-void unset_flag(Processor* cpu, BYTE ix) {
-    cpu->F &= ~(1 << ix);
+// Set F to just the carry flag, for an operation which leaves lazy flags
+static inline void set_carry_only(struct Processor* cpu, bool carry) {
+    cpu->F = carry << FLAG_C;
 }
 
-BYTE add_with_flags_u8(Processor* cpu, BYTE a, BYTE b, bool add_carry, bool affect_carry) {
-    // Reset all the flags
-    cpu->F = 0;
+BYTE add_with_flags_u8(struct Processor* cpu, BYTE a, BYTE b, bool add_carry, bool affect_carry) {
+    BYTE carry = add_carry && get_flag(cpu, FLAG_C);
+    BYTE res = a + b + carry;
 
-    if(add_carry) {
-        if(get_flag(cpu, FLAG_C)) {
-            b++;
-        }
-    }
-
-    BYTE res = a + b;
-
-    // Set the carry flag accordingly
+    // Set the carry flag accordingly, INC leaves it untouched
     if(affect_carry) {
-        set_flag_to(cpu, FLAG_C, res < a);
+        set_carry_only(cpu, a + b + carry > 0xFF);
     }
-
-    // Calculate the half carry flag
-    set_flag_to(cpu, FLAG_H, (a & 0xF) + (b & 0xF) > 0xF);
+    set_lazy_flags(cpu, LAZY_ADD, res);
+    set_lazy_operands(cpu, a, b, carry);
 
     return res;
 }
 
-WORD add_with_flags_u16(Processor* cpu, WORD a, WORD b) {
+WORD add_with_flags_u16(struct Processor* cpu, WORD a, WORD b) {
     WORD res = a + b;
 
     // Check for an overflow
-    if(res < a) {
-        set_flag(cpu, FLAG_C);
-    }
-
+    set_flag_to(cpu, FLAG_C, res < a);
     unset_flag(cpu, FLAG_N);
 
     // Calculate the half carry flag
-    set_flag_to(FLAG_H, (a & 0xFFF) + (b & 0xFFF) > 0xFFF);
+    set_flag_to(cpu, FLAG_H, (a & 0xFFF) + (b & 0xFFF) > 0xFFF);
 
     return res;
 }
 
-BYTE sub_with_flags_u8(Processor* cpu, BYTE a, BYTE b, bool sub_carry, bool affect_carry) {
-    // Reset all the flags
-    cpu->F = 0;
-    set_flag(cpu, FLAG_N);
-
-    // Set the carry flag accordingly
-    if(sub_carry) {
-        if(get_flag(cpu, FLAG_C)) {
-            b++;
-        }
-    }
-
-    BYTE res = a - b;
+BYTE sub_with_flags_u8(struct Processor* cpu, BYTE a, BYTE b, bool sub_carry, bool affect_carry) {
+    BYTE carry = sub_carry && get_flag(cpu, FLAG_C);
+    BYTE res = a - b - carry;
 
+    // Set the carry flag accordingly, DEC leaves it untouched
     if(affect_carry) {
-        set_flag_to(cpu, FLAG_C, res > a);
+        set_carry_only(cpu, a < b + carry);
     }
-
-    // Calculate the half carry flag
-    SIGNED_BYTE a_ = a & 0xF;
-    set_flag_to(cpu, FLAG_H, a_ - (b & 0xF) < 0);
+    set_lazy_flags(cpu, LAZY_SUB, res);
+    set_lazy_operands(cpu, a, b, carry);
 
     return res;
 }
-// Test bit b in register reg
-void BIT(cpu, int reg, int b) {
-    if (((get_register(val) >> b) & 1) == 0) {
-        set_flag(FLAG_Z);
-    }
-    unset_flag(FLAG_N);
-    set_flag(FLAG_H);
-}
 
-// Set bit b in 8 bit register reg
-void SET(int reg, int b) {
-    reg |= 1 << b;
+// Add the next (signed) byte to SP. The flags are set as if it was
+// an unsigned 8 bit addition on the lower byte.
+static inline WORD add_signed_to_sp(struct GameBoy* gb) {
+    struct Processor* cpu = &gb->cpu;
+    BYTE val = read_next(gb);
+    WORD res = cpu->SP + (SIGNED_BYTE)val;
+
+    cpu->F = 0;
+    cpu->lazy_op = LAZY_NONE;
+    set_flag_to(cpu, FLAG_H, (cpu->SP & 0xF) + (val & 0xF) > 0xF);
+    set_flag_to(cpu, FLAG_C, (cpu->SP & 0xFF) + val > 0xFF);
+    return res;
 }
 
-// Set bit b in 16 bit register A, B
-void SET(int A, int B, int b) {
-    WORD res = get_16b_register(A, B) | (1 << b);
-    set_16b_register(res);
+// Test bit b in val
+static inline void BIT(struct Processor* cpu, BYTE val, int b) {
+    set_lazy_flags(cpu, LAZY_AND, val & (1 << b));
 }
 
-// Reset bit b in register reg
-void RES(int reg, int b) {
-    reg &= ~(1 << b);
+// Set bit b in val
+static inline BYTE SET(BYTE val, int b) {
+    return val | (1 << b);
 }
 
+// Reset bit b in val
+static inline BYTE RES(BYTE val, int b) {
+    return val & ~(1 << b);
+}
 
 // Logical AND with register A, result in A.
-void AND(Processor* cpu, BYTE val) {
+static inline void AND(struct Processor* cpu, BYTE val) {
     cpu->A = cpu->A & val;
-    set_flag_to(cpu, FLAG_Z, cpu->A == 0);
-    unset_flag(cpu, FLAG_N);
-    set_flag(cpu, FLAG_H);
-    unset_flag(cpu, FLAG_C);
+    set_carry_only(cpu, false);
+    set_lazy_flags(cpu, LAZY_AND, cpu->A);
 }
 
 // Logical OR with register A, result in A.
-void OR(Processor* cpu, BYTE val) {
+static inline void OR(struct Processor* cpu, BYTE val) {
     cpu->A = cpu->A | val;
-    cpu->F = 0;
-    set_flag_to(cpu, FLAG_Z, cpu->A == 0);
+    set_carry_only(cpu, false);
+    set_lazy_flags(cpu, LAZY_LOGIC, cpu->A);
 }
 
 // Logical exclusive OR with register A, result in A
-void XOR(BYTE val) {
+static inline void XOR(struct Processor* cpu, BYTE val) {
     cpu->A = cpu->A ^ val;
-    cpu->F = 0;
-    set_flag_to(cpu, FLAG_Z, cpu->A == 0);
+    set_carry_only(cpu, false);
+    set_lazy_flags(cpu, LAZY_LOGIC, cpu->A);
 }
 
-// Rotate left. Old bit 7 to Carry flag.
-BYTE RLC(BYTE val) {
-    BYTE res =(val << 1) | (val >> 7);
-    set_flag_to(FLAG_C, (val >> 7) & 1);
-    if(res == 0) {
-        set_flag(FLAG_Z);
-    }
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
+// Set the flags of a rotate or shift
+static inline BYTE shifted(struct Processor* cpu, BYTE res, bool carry) {
+    set_carry_only(cpu, carry);
+    set_lazy_flags(cpu, LAZY_LOGIC, res);
     return res;
 }
+
+// Rotate left. Old bit 7 to Carry flag.
+static inline BYTE RLC(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val << 1) | (val >> 7), (val >> 7) & 1);
+}
+
 // Swap upper and lower nibles.
-BYTE SWAP(BYTE val) {
-    set_register(F, 0); // reset all flags
-    res = (val >> 4) | (val << 4);
-    set_flag_to(FLAG_Z, res == 0);
-    return res;
+static inline BYTE SWAP(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val >> 4) | (val << 4), false);
 }
 
 // Rotate left through the Carry flag.
-BYTE RL(BYTE val) {
-    BYTE res = (val << 1) | get_flag(FLAG_C);
-    set_flag_to(FLAG_C, (val >> 7) & 1);
-    if(res == 0) {
-        set_flag(FLAG_Z);
-    }
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    return res;
+static inline BYTE RL(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val << 1) | get_flag(cpu, FLAG_C), (val >> 7) & 1);
 }
 
 // Rotate right through the Carry flag.
-BYTE RR(BYTE val) {
-    BYTE res = (val >> 1) | (get_flag(FLAG_C) << 7);
-    set_flag_to(FLAG_C, val & 1);
-
-    if(res == 0) {
-        set_flag(FLAG_Z);
-    }
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    return res;
+static inline BYTE RR(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val >> 1) | (get_flag(cpu, FLAG_C) << 7), val & 1);
 }
+
 // Rotate right. Old bit 0 to Carry flag
-BYTE RRC(BYTE val) {
-    BYTE res = (val >> 1) | ((val & 0x01) << 7);
-    set_flag_to(FLAG_C, val & 0x01); // last bit
-    if(res == 0) {
-        set_flag(FLAG_Z);
-    }
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    return res;
+static inline BYTE RRC(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val >> 1) | ((val & 0x01) << 7), val & 0x01);
 }
 
 // Shift left into Carry. LSB of n set to 0.
-BYTE SLA(BYTE val) {
-    BYTE res = val << 1;
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    set_flag_to(FLAG_C, (val >> 7) & 1);
-    set_flag_to(FLAG_Z, res == 0);
-    return res;
+static inline BYTE SLA(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, val << 1, (val >> 7) & 1);
 }
+
 // Shift right into Carry. MSB does not change.
-BYTE SRA(BYTE val) {
-    BYTE res = (val >> 1) | (val & 0x100);
-    set_flag_to(FLAG_Z, res == 0);
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    set_flag_to(FLAG_C, val & 1);
-    return res;
+static inline BYTE SRA(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, (val >> 1) | (val & 0x80), val & 1);
 }
 
 // Shift right into Carry. MSB set to 0.
-BYTE SRL(BYTE val) {
-    set_flag_to(FLAG_Z, (val >> 1) == 0);
-    unset_flag(FLAG_N);
-    unset_flag(FLAG_H);
-    set_flag_to(FLAG_C, val & 1);
-    return val >> 1;
-}
-
-// Execute the next instruction, increment the program counter and return the 
-// number of simulated clock cycles 
-int execute_next(Processor* cpu) {
-    switch(read_next()) {
-        BYTE val, val_2, res;
-        WORD addr;
-        // LD B, n
-        case 0x06:
-            cpu->B = read_next();
-            return 8;
-        // LD C, n
-        case 0x0E:
-            cpu->C = read_next();
-            return 8;
-        // LD D, n
-        case 0x16:
-            cpu->D = read_next();
-            return 8;
-        // LD E, n
-        case 0x1E:
-            cpu->E = read_next();
-            return 8;
-        // LD H, n
-        case 0x26:
-            cpu->H = read_next();
-            return 8;
-        // LD L, n
-        case 0x2E:
-            cpu->L = read_next();
-            return 8;
-        // LD A, A
-        case 0x7F:
-            cpu->A = read_next();
-            return 4;
-        // LD A, B
-        case 0x78:
-            cpu->A = cpu->B;
-            return 4;
-        // LD A, C
-        case 0x79:
-            cpu->A = cpu->C;
-            return 4;
-        // LD A, D
-        case 0x7A:
-            cpu->A = cpu->D;
-            return 4;
-        // LD A, E
-        case 0x7B:
-            cpu->A = cpu->E;
-            return 4;
-        // LD A, H
-        case 0x7C:
-            cpu->A = cpu->H;
-            return 4;
-        // LD A, L
-        case 0x7D:
-            cpu->A = cpu->L;
-            return 4;
-        // LD A, <BC>
-        case 0x0A:
-            cpu->A = read(cpu->BC);
-            return 8;
-        // LD A, <DE>
-        case 0x1A:
-            cpu->A = read(cpu->DE);
-            return 8;
-        // LD A, <HL>
-        case 0x7E:
-            cpu->A = read(cpu->HL);
-            return 8;
-        // LD A, <nn>
-        case 0xFA:
-            cpu->A = read(read_next_word());
-            return 16;
-        // LD A, #
-        case 0x3E:
-            cpu->A = read_next();
-            return 8;
-        // LD B, A
-        case 0x47:
-            cpu->B = cpu->A;
-            return 4;
-        // LD B, B
-        case 0x40:
-            cpu->B = cpu->B;
-            return 4;
-        // LD B, C
-        case 0x41:
-            cpu->B = cpu->C;
-            return 4;
-        // LD B, D
-        case 0x42:
-            cpu->B = cpu->D;
-            return 4;
-        // LD B, E
-        case 0x43:
-            cpu->B = cpu->E;
-            return 4;
-        // LD B, H
-        case 0x44:
-            cpu->B = cpu->H;
-            return 4;
-        // LD B, L
-        case 0x45:
-            cpu->B = cpu->L;
-            return 4;
-        // LD B, <HL>
-        case 0x46:
-            cpu->B = read(cpu->HL);
-            return 8;
-        // LD C, A
-        case 0x4F:
-            cpu->C = cpu->A;
-            return 4;
-        // LD C, B
-        case 0x48:
-            cpu->C = cpu->B;
-            return 4;
-        // LD C, C
-        case 0x49:
-            cpu->C = cpu->C;
-            return 4;
-        // LD C, D
-        case 0x4A:
-            cpu->C = cpu->D;
-            return 4;
-        // LD C, E
-        case 0x4B:
-            cpu->C = cpu->E;
-            return 4;
-        // LD C, H
-        case 0x4C:
-            cpu->C = cpu->H;
-            return 4;
-        // LD C, L
-        case 0x4D:
-            cpu->C = cpu->L;
-            return 4;
-        // LD C, <HL>
-        case 0x4E:
-            cpu->C = read(cpu->HL);
-            return 8;
-        // LD D, A
-        case 0x57:
-            cpu->D = cpu->A;
-            return 4;
-        // LD D, B
-        case 0x50:
-            cpu->D = cpu->B;
-            return 4;
-        // LD D, C
-        case 0x51:
-            cpu->D = cpu->C;
-            return 4;
-        // LD D, D
-        case 0x52:
-            cpu->D = cpu->D;
-            return 4;
-        // LD D, E
-        case 0x53:
-            cpu->D = cpu->E;
-            return 4;
-        // LD D, H
-        case 0x54:
-            cpu->D = cpu->H;
-            return 4;
-        // LD D, L
-        case 0x55:
-            cpu->D = cpu->L;
-            return 4;
-        // LD D, <HL>
-        case 0x56:
-            cpu->D = read(cpu->HL);
-            return 8;
-        // LD E, A
-        case 0x5F:
-            cpu->E = cpu->A;
-            return 4;
-        // LD E, B
-        case 0x58:
-            cpu->E = cpu->B;
-            return 4;
-        // LD E, C
-        case 0x59:
-            cpu->E = cpu->C;
-            return 4;
-        // LD E, D
-        case 0x5A:
-            cpu->E = cpu->D;
-            return 4;
-        // LD E, E
-        case 0x5B:
-            cpu->E = cpu->E;
-            return 4;
-        // LD E, H
-        case 0x5C:
-            cpu->E = cpu->H;
-            return 4;
-        // LD E, L
-        case 0x5D:
-            cpu->E = cpu->L;
-            return 4;
-        // LD E, <HL>
-        case 0x5E:
-            cpu->E = read(cpu->HL);
-            return 8;
-        // LD H, A
-        case 0x67:
-            cpu->H = cpu->A;
-            return 4;
-        // LD H, B
-        case 0x60:
-            cpu->H = cpu->B;
-            return 4;
-        // LD H, C
-        case 0x61:
-            cpu->H = cpu->C;
-            return 4;
-        // LD H, D
-        case 0x62:
-            cpu->H = cpu->D;
-            return 4;
-        // LD H, E
-        case 0x63:
-            cpu->H = cpu->E;
-            return 4;
-        // LD H, H
-        case 0x64:
-            cpu->H = cpu->H;
-            return 4;
-        // LD H, L
-        case 0x65:
-            cpu->H = cpu->L;
-            return 4;
-        // LD H, <HL>
-        case 0x66:
-            cpu->H = read(cpu->HL);
-            return 8;
-        // LD L, A
-        case 0x6F:
-            cpu->L = cpu->A;
-            return 4;
-        // LD L, B
-        case 0x68:
-            cpu->L = cpu->B;
-            return 4;
-        // LD L, C
-        case 0x69:
-            cpu->L = cpu->C;
-            return 4;
-        // LD L, D
-        case 0x6A:
-            cpu->L = cpu->D;
-            return 4;
-        // LD L, E
-        case 0x6B:
-            cpu->L = cpu->E;
-            return 4;
-        // LD L, H
-        case 0x6C:
-            cpu->L = cpu->H;
-            return 4;
-        // LD L, L
-        case 0x6D:
-            cpu->L = cpu->L;
-            return 4;
-        // LD L, <HL>
-        case 0x6E:
-            cpu->L = read(cpu->HL);
-            return 8;
-        // LD <HL>, B
-        case 0x70:
-            write(cpu->HL, cpu->B);
-            return 8;
-        // LD <HL>, C
-        case 0x71:
-            write(cpu->HL, cpu->C);
-            return 8;
-        // LD <HL>, D
-        case 0x72:
-            write(cpu->HL, cpu->D);
-            return 8;
-        // LD <HL>, E
-        case 0x73:
-            write(cpu->HL, cpu->E);
-            return 8;
-        // LD <HL>, H
-        case 0x74:
-            write(cpu->HL, cpu->H);
-            return 8;
-        // LD <HL>, L
-        case 0x75:
-            write(cpu->HL, cpu->L);
-            return 8;
-        // LD <HL>, n
-        case 0x36:
-            write(cpu->HL, read_next());
-            return 12;
-        // LD <BC>, A
-        case 0x02:
-            write(cpu->BC, cpu->A);
-            return 8;
-        // LD <DE>, A
-        case 0x12:
-            write(cpu->DE, cpu->A);
-            return 8;
-        // LD <HL>, A
-        case 0x77:
-            write(cpu->HL, cpu->A);
-            return 8;
-        // LD <nn>, A
-        case 0xEA:
-            write(read_next_word(), cpu->A);
-            return 16;
-        // LD A, <0xFF00 + C>
-        case 0xF2:
-            cpu->A = read(0xFF00 + cpu->C);
-            return 8;
-        // LD <0xFF00 + C>
-        case 0xE2:
-            write(0xFF00 + cpu->C, cpu->A);
-            return 8;
-        // LDD A, <HL>
-        case 0x3A:
-            cpu->A = read(cpu->HL);
-            cpu->HL--;
-            return 8;
-        // LDD <HL>, A
-        case 0x32:
-            write(cpu->HL, cpu->A);
-            cpu->HL--;
-            return 8;
-        // LDI A, <HL>
-        case 0x2A:
-            cpu->A = read(cpu->HL);
-            cpu->HL++;
-            return 8;
-        // LDI <HL>, A
-        case 0x22:
-            write(cpu->HL, cpu->A);
-            cpu->HL++;
-            return 8;
-        // LDH <0xFF00 + n>, A
-        case 0xE0:
-            addr = 0xFF00 + read_next();
-            write(addr, cpu->A);
-            return 12;
-        // LDH A, <0xFF00 + n>
-        case 0xF0:
-            cpu->A = read(0xFF00 + read_next());
-            return 12;
-        // LD BC, nn
-        case 0x01:
-            cpu->BC = read_next_word();
-            return 12;
-        // LD DE, nn
-        case 0x11:
-            cpu->DE = read_next_word();
-            return 12;
-        // LD HL, nn
-        case 0x21:
-            cpu->HL = read_next_word();
-            return 12;
-        // LD SP, nn
-        case 0x31:
-            cpu->SP = read_next_word();
-            return 12;
-        // LD SP, HL
-        case 0xF9:
-            cpu->SP = cpu->HL;
-            return 8;
-        // LDHL SP, n
-        case 0xF8:
-            val = read_next();
-            // TODO: there is probably a bug with val_2 here
-            // Hacky was to set the flags as if it was an 8bit operation
-            add_with_flags_u8((BYTE)cpu->SP, val_2, false, true);
-
-            cpu->HL = cpu->SP + val;
-            // This instruction resets the zero flag
-            unset_flag(cpu, FLAG_Z);
-            return 12;
-        // LD <nn>, SP
-        case 0x08:
-            addr = read_next_word();
-            write_word(addr, cpu->SP);
-            return 20;
-        // PUSH AF
-        case 0xF5:
-            write_word(cpu->SP, cpu->AF);
-            cpu->SP -= 2;
-            return 16;
-        // PUSH BC
-        case 0xC5:
-            write_word(cpu->SP, cpu->BC);
-            cpu->SP -= 2;
-            return 16;
-        // PUSH DE
-        case 0xD5:
-            write_word(cpu->SP, cpu->DE);
-            cpu->SP -= 2;
-            return 16;
-        // PUSH HL
-        case 0xE5:
-            write_word(cpu->SP, cpu->HL);
-            cpu->SP -= 2;
-            return 16;
-        // POP AF
-        case 0xF1:
-            cpu->AF = read_word(cpu->SP);
-            cpu->SP += 2;
-            return 12;
-        // POP BC
-        case 0xC1:
-            cpu->BC = read_word(cpu->SP);
-            cpu->SP += 2;
-            return 12;
-        // POP DE
-        case 0xD1:
-            cpu->DE = read_word(cpu->SP);
-            cpu->SP += 2;
-            return 12;
-        // POP HL
-        case 0xE1:
-            cpu->HL = read_word(cpu->SP);
-            cpu->SP += 2;
-            return 12;
-        // ADD A, A
-        case 0x87:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->A, false, true);
-            return 4;
-        // ADD A, B
-        case 0x80:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->B, false, true);
-            return 4;
-        // ADD A, C
-        case 0x81:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->C, false, true);
-            return 4;
-        // ADD A, D
-        case 0x82:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->D, false, true);
-            return 4;
-        // ADD A, E
-        case 0x83:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->E, false, true);
-            return 4;
-        // ADD A, H
-        case 0x84:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->H, false, true);
-            return 4;
-        // ADD A, L
-        case 0x85:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->L, false, true);
-            return 4;
-        // ADD A, <HL>
-        case 0x86:
-            cpu->A = add_with_flags_u8(cpu->A, read(cpu->HL), false, true);
-            return 8;
-        // ADD A, #
-        case 0xC6:
-            cpu->A = add_with_flags_u8(cpu->A, read_next(), false, true);
-            return 8;
-        // ADC A, A
-        case 0x8F:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->A, true, true);
-            return 4;
-        // ADC A, B
-        case 0x88:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->B, true, true);
-            return 4;
-        // ADC A, C
-        case 0x89:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->C, true, true);
-            return 4;
-        // ADC A, D
-        case 0x8A:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->D, true, true);
-            return 4;
-        // ADC A, E
-        case 0x8B:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->E, true, true);
-            return 4;
-        // ADC A, H
-        case 0x8C:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->H, true, true);
-            return 4;
-        // ADC A, L
-        case 0x8D:
-            cpu->A = add_with_flags_u8(cpu->A, cpu->L, true, true);
-            return 4;
-        // ADC A, <HL>
-        case 0x8E:
-            cpu->A = add_with_flags_u8(cpu->A, read(cpu->HL), true, true);
-            return 8;
-        // ADC A, #
-        case 0xCE:
-            cpu->A = add_with_flags_u8(cpu->A, read_next(), true, true);
-            return 8;
-        // SUB A, A
-        case 0x97:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->A, false, true);
-            return 4;
-        // SUB A, B
-        case 0x90:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->B, false, true);
-            return 4;
-        // SUB A, C
-        case 0x91:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->C, false, true);
-            return 4;
-        // SUB A, D
-        case 0x92:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->D, false, true);
-            return 4;
-        // SUB A, E
-        case 0x93:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->E, false, true);
-            return 4;
-        // SUB A, H
-        case 0x94:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->H, false, true);
-            return 4;
-        // SUB A, L
-        case 0x95:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->L, false, true);
-            return 4;
-        // SUB A, <HL>
-        case 0x96:
-            cpu->A = sub_with_flags_u8(cpu->A, read(cpu->HL), false, true);
-            return 8;
-        // SUB A, #
-        case 0xD6:
-            cpu->A = sub_with_flags_u8(cpu->A, read_next(), false, true);
-            return 8;
-        // SBC A, A
-        case 0x9F:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->A, true, true);
-            return 4;
-        // SBC A, B
-        case 0x98:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->B, true, true);
-            return 4;
-        // SBC A, C
-        case 0x99:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->C, true, true);
-            return 4;
-        // SBC A, D
-        case 0x9A:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->D, true, true);
-            return 4;
-        // SBC A, E
-        case 0x9B:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->E, true, true);
-            return 4;
-        // SBC A, H
-        case 0x9C:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->H, true, true);
-            return 4;
-        // SBC A, L
-        case 0x9D:
-            cpu->A = sub_with_flags_u8(cpu->A, cpu->L, true, true);
-            return 4;
-        // SBC A, <HL>
-        case 0x9E:
-            cpu->A = sub_with_flags_u8(cpu->A, read(cpu->HL), true, true);
-            return 8;
-        // SBC A, #
-        // Unknown Opcode. Probably never used anyways
-        // case 0xCE:
-        //     cpu->A = sub_with_flags_u8(cpu->A, read_next(), true, true);
-        //     return ??;
-        // AND A, A
-        case 0xA7:
-            AND(cpu, cpu->A);
-            return 4;
-        // AND A, B
-        case 0xA0:
-            AND(cpu, cpu->B);
-            return 4;
-        // AND A, C
-        case 0xA1:
-            AND(cpu, cpu->C);
-            return 4;
-        // AND A, D
-        case 0xA2:
-            AND(cpu, cpu->D);
-            return 4;
-        // AND A, E
-        case 0xA3:
-            AND(cpu, cpu->E);
-            return 4;
-        // AND A, H
-        case 0xA4:
-            AND(cpu, cpu->H);
-            return 4;
-        // AND A, L
-        case 0xA5:
-            AND(cpu, cpu->L);
-            return 4;
-        // AND A, <HL>
-        case 0xA6:
-            AND(cpu, read(cpu->HL));
-            return 8;
-        // AND A, #
-        case 0xE6:
-            AND(cpu, read_next());
-            return 8;
-        // OR A, A
-        case 0xB7:
-            OR(cpu, cpu->A);
-            return 4;
-        // OR A, B
-        case 0xB0:
-            OR(cpu, cpu->B);
-            return 4;
-        // OR A, C
-        case 0xB1:
-            OR(cpu, cpu->C);
-            return 4;
-        // OR A, D
-        case 0xB2:
-            OR(cpu, cpu->D);
-            return 4;
-        // OR A, E
-        case 0xB3:
-            OR(cpu, cpu->E);
-            return 4;
-        // OR A, H
-        case 0xB4:
-            OR(cpu, cpu->H);
-            return 4;
-        // OR A, L
-        case 0xB5:
-            OR(cpu, cpu->L);
-            return 4;
-        // OR A, <HL>
-        case 0xB6:
-            OR(cpu, read(cpu->HL));
-            return 8;
-        // OR A, #
-        case 0xF6:
-            OR(cpu, read_next());
-            return 8;
-        // XOR A, A
-        case 0xAF:
-            XOR(cpu, cpu->A);
-            return 4;
-        // XOR A, B
-        case 0xA8:
-            XOR(cpu, cpu->B);
-            return 4;
-        // XOR A, C
-        case 0xA9:
-            XOR(cpu, cpu->C);
-            return 4;
-        // XOR A, D
-        case 0xAA:
-            XOR(cpu, cpu->D);
-            return 4;
-        // XOR A, E
-        case 0xAB:
-            XOR(cpu, cpu->E);
-            return 4;
-        // XOR A, H
-        case 0xAC:
-            XOR(cpu, cpu->H);
-            return 4;
-        // XOR A, L
-        case 0xAD:
-            XOR(cpu, cpu->L);
-            return 4;
-        // XOR A, <HL>
-        case 0xAE:
-            XOR(cpu, read(cpu->HL));
-            return 8;
-        // XOR A, #
-        case 0xEE:
-            XOR(cpu, read_next());
-            return 8;
-        // CP A, A
-        case 0xBF:
-            sub_with_flags_u8(cpu->A, cpu->A, false, true);
-            return 4;
-        // CP A, B
-        case 0xB8:
-            sub_with_flags_u8(cpu->A, cpu->B, false, true);
-            return 4;
-        // CP A, C
-        case 0xB9:
-            sub_with_flags_u8(cpu->A, cpu->C, false, true);
-            return 4;
-        // CP A, D
-        case 0xBA:
-            sub_with_flags_u8(cpu->A, cpu->D, false, true);
-            return 4;
-        // CP A, E
-        case 0xBB:
-            sub_with_flags_u8(cpu->A, cpu->E, false, true);
-            return 4;
-        // CP A, H
-        case 0xBC:
-            sub_with_flags_u8(cpu->A, cpu->H, false, true);
-            return 4;
-        // CP A, L
-        case 0xBD:
-            sub_with_flags_u8(cpu->A, cpu->L, false, true);
-            return 4;
-        // CP A, <HL>
-        case 0xBE:
-            sub_with_flags_u8(cpu->A, read(cpu->HL), false, true);
-            return 8;
-        // CP A, #
-        case 0xFE:
-            sub_with_flags_u8(cpu->A, read_next(), false, true);
-            return 8;
-        // INC A
-        case 0x3C:
-            cpu->A = add_with_flags_u8(cpu->A, 1, false, false);
-            return 4;
-        // INC B
-        case 0x04:
-            cpu->B = add_with_flags_u8(cpu->B, 1, false, false);
-            return 4;
-        // INC C
-        case 0x0C:
-            cpu->C = add_with_flags_u8(cpu->C, 1, false, false);
-            return 4;
-        // INC D
-        case 0x14:
-            cpu->D = add_with_flags_u8(cpu->D, 1, false, false);
-            return 4;
-        // INC E
-        case 0x1C:
-            cpu->E = add_with_flags_u8(cpu->E, 1, false, false);
-            return 4;
-        // INC H
-        case 0x24:
-            cpu->H = add_with_flags_u8(cpu->H, 1, false, false);
-            return 4;
-        // INC L
-        case 0x2C:
-            cpu->L = add_with_flags_u8(cpu->L, 1, false, false);
-            return 4;
-        // INC <HL>
-        case 0x34:
-            val = add_with_flags_u8(read(cpu->HL), 1, false, false);
-            write(cpu->HL, val);
-            return 12;
-        // DEC A
-        case 0x3D:
-            cpu->A = sub_with_flags_u8(cpu->A, 1, false, false);
-            return 4;
-        // DEC B
-        case 0x05:
-            cpu->B = sub_with_flags_u8(cpu->B, 1, false, false);
-            return 4;
-        // DEC C
-        case 0x0D:
-            cpu->C = sub_with_flags_u8(cpu->C, 1, false, false);
-            return 4;
-        // DEC D
-        case 0x15:
-            cpu->D = sub_with_flags_u8(cpu->D, 1, false, false);
-            return 4;
-        // DEC E
-        case 0x1D:
-            cpu->E = sub_with_flags_u8(cpu->E, 1, false, false);
-            return 4;
-        // DEC H
-        case 0x25:
-            cpu->H = sub_with_flags_u8(cpu->H, 1, false, false);
-            return 4;
-        // DEC L
-        case 0x2D:
-            cpu->L = sub_with_flags_u8(cpu->L, 1, false, false);
-            return 4;
-        // DEC <HL>
-        case 0x35:
-            val = sub_with_flags_u8(read(cpu->HL), 1, false, false);
-            write(cpu->HL, val);
-            return 12;
-        // ADD HL, BC
-        case 0x09:
-            cpu->HL = add_with_flags_u16(cpu->HL, cpu->BC);
-            return 8;
-        // ADD HL, DE
-        case 0x19:
-            cpu->HL = add_with_flags_u16(cpu->HL, cpu->DE);
-            return 8;
-        // ADD HL, HL
-        case 0x29:
-            cpu->HL = add_with_flags_u16(cpu->HL, cpu->HL);
-            return 8;
-        // ADD HL, SP
-        case 0x39:
-            cpu->HL = add_with_flags_u16(cpu->HL, cpu->SP);
-            return 8;
-        // ADD SP, # 
-        // TODO: verify this works
-        case 0xE8: 
-            {
-                val = (SIGNED_BYTE)read_next();
-                res = cpu->SP + val;
-
-                set_flag_to(cpu, FLAG_H, ((cpu->SP ^ res ^ val) & 0x1000) ? true : false);
-
-                if (val < 0) {
-                    set_flag_to(cpu, FLAG_C, res > cpu->SP);
-                }
-                else {
-                    set_flag_to(cpu, FLAG_C, res < cpu->SP);
-                }
-
-                // this instruction resets the zero and subtraction flag
-                unset_flag(cpu, FLAG_Z);
-                unset_flag(cpu, FLAG_N);
-
-                cpu->SP = res;
-            }
-            return 16;
-        // INC BC
-        case 0x03:
-            cpu->BC++;
-            return 8;
-        // INC DE
-        case 0x13:
-            cpu->DE++;
-            return 8;
-        // INC HL
-        case 0x23:
-            cpu->HL++;
-            return 8;
-        // INC SP
-        case 0x33:
-            cpu->SP++;
-            return 8;
-        // DEC BC
-        case 0x0B:
-            cpu->BC--;
-            return 8;
-        // DEC DE
-        case 0x1B:
-            cpu->DE--;
-            return 8;
-        // DEC HL
-        case 0x2B: 
-            cpu->HL--;
-            return 8;
-        // DEC SP
-        case 0x3B:
-            cpu->SP--;
-            return 8;
-        // DAA
-        case 0x27:
-            printf("UNIMPLEMENTED: 0x27");
-            return 4;
-        // CPL
-        case 0x2F:
-            cpu->A = ~cpu->A;
-            set_flag(cpu, FLAG_N);
-            set_flag(cpu, FLAG_H);
-            return 4;
-        // CCF
-        case 0x3F:
-            unset_flag(cpu, FLAG_N);
-            unset_flag(cpu, FLAG_H);
-            get_flag(cpu, FLAG_C) ? unset_flag(cpu, FLAG_C) : set_flag(cpu, FLAG_C);
-            return 4;
-        // SCF
-        case 0x37:
-            unset_flag(cpu, FLAG_N);
-            unset_flag(cpu, FLAG_H);
-            set_flag(cpu, FLAG_C);
-            return 4;
-        // NOP
-        case 0x00:
-            return 4;
-        // HALT
-        case 0x76:
-            cpu->is_halted = true;
-            return 4;
-        // DI
-        case 0xF3:
-            cpu->disable_interrupts_instruction = true;
-            return 4;
-        // EI
-        case 0xFB:
-            cpu->enable_interrupts_instruction = true;
-            return 4;
-        // TODO: continue implementing the new cpu type
-        // RLCA
-        case 0x07:
-            val = get_register(A);
-            set_flag_to(FLAG_C, (val >> 7) & 1);
-            set_register(A, (val << 1) | (val >> 7));
-            if(get_register(A) == 0) {
-                set_flag(FLAG_Z);
-            }
-            unset_flag(FLAG_N);
-            unset_flag(FLAG_H);
-            return 4;
-        // RLA
-        case 0x17:
-            val = get_register(A);
-            {
-                BYTE old_a = val;
-                set_register(A, (val << 1) | get_flag(FLAG_C));
-                set_flag_to(FLAG_C, (old_a >> 7) & 1);
-            }
-            if(get_register(A) == 0) {
-                set_flag(FLAG_Z);
-            }
-            unset_flag(FLAG_N);
-            unset_flag(FLAG_H);
-            return 4;
-        // RRCA
-        case 0x0F:
-            val = get_register(A);
-            set_flag_to(FLAG_C, val & 0x01);
-            set_register(A, (val >> 1) | ((val & 0x01) << 7));
-            if(get_register(A) == 0) {
-                set_flag(FLAG_Z);
+static inline BYTE SRL(struct Processor* cpu, BYTE val) {
+    return shifted(cpu, val >> 1, val & 1);
+}
+
+// Whether a byte read by an idle loop can only change through an event.
+// The timer counts on its own and the rtc of the cartridge follows the host
+// clock, so loops reading them never idle.
+static bool idle_read_safe(struct GameBoy* gb, WORD addr) {
+    if (addr == 0xFF04 || addr == 0xFF05) {
+        return false;
+    }
+    return addr >= 0xFF00 || gb->mmu.read_pages[addr >> 8] != NULL;
+}
+
+// Check whether the body of a loop, from start up to the branch at end,
+// only reads memory into A and F. Sets the registers it reads through and
+// the clock cycles and instructions of the body, which are fixed for such a
+// loop.
+static bool idle_loop_pollable(struct GameBoy* gb, WORD start, WORD end, struct IdleLoop* idle) {
+    WORD addr = start;
+    idle->indirect = 0;
+    idle->cycles = 0;
+    idle->instructions = 0;
+    while (addr != end) {
+        BYTE op = mmu_read(gb, addr);
+        BYTE low = op & 7;
+        int cycles;
+        if (op == 0x00 || (op >= 0x78 && op <= 0x7F && low != 6) || (op >= 0x80 && op <= 0xBF && low != 6)) {
+            // NOP, LD A,r and arithmetic on A with a register
+            cycles = 4;
+        } else if (op == 0x7E || (op >= 0x80 && op <= 0xBF)) {
+            // LD A,(HL) and arithmetic on A with (HL)
+            idle->indirect |= IDLE_READ_HL;
+            cycles = 8;
+        } else if (op == 0x3C || op == 0x3D || op == 0x2F || op == 0x37 || op == 0x3F || op == 0x27
+                || op == 0x07 || op == 0x0F || op == 0x17 || op == 0x1F) {
+            // INC A, DEC A, CPL, SCF, CCF, DAA and the rotates of A
+            cycles = 4;
+        } else if (op == 0x0A || op == 0x1A) {
+            idle->indirect |= op == 0x0A ? IDLE_READ_BC : IDLE_READ_DE;
+            cycles = 8;
+        } else if (op == 0xF2) {
+            idle->indirect |= IDLE_READ_C;
+            cycles = 8;
+        } else if (op == 0x3E || ((op & 0xC7) == 0xC6)) {
+            // LD A,n and arithmetic on A with n
+            cycles = 8;
+        } else if (op == 0xF0 && idle_read_safe(gb, 0xFF00 | mmu_read(gb, addr + 1))) {
+            cycles = 12;
+        } else if (op == 0xFA && idle_read_safe(gb, mmu_read_word(gb, addr + 1))) {
+            cycles = 16;
+        } else if (op == 0xCB) {
+            // BIT on any register, and all other CB opcodes only on A
+            BYTE cb = mmu_read(gb, addr + 1);
+            if ((cb & 7) == 6 && cb >= 0x40 && cb < 0x80) {
+                idle->indirect |= IDLE_READ_HL;
+                cycles = 12;
+            } else if ((cb & 7) == 7 || (cb >= 0x40 && cb < 0x80)) {
+                cycles = 8;
+            } else {
+                return false;
             }
-            unset_flag(FLAG_N);
-            unset_flag(FLAG_H);
-            return 4;
-        // RRA
-        case 0x1F:
-            val = get_register(A);
-            set_register(A, (val >> 1) | (get_flag(FLAG_C) << 7));
-            set_flag_to(FLAG_C, val & 1);
-            if(get_register(A) == 0) {
-                set_flag(FLAG_Z);
+        } else {
+            return false;
+        }
+        idle->cycles += cycles;
+        idle->instructions++;
+        addr += opcode_lengths[op];
+        // The body has to end exactly at the branch
+        if ((WORD)(addr - start) > IDLE_LOOP_LENGTH) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called when the branch at branch, which takes cycles, jumps back to the
+// start of a loop in rom. If the loop only polls memory, and the state at
+// its start is the same as one iteration before with no event in between,
+// nothing changes until the next event. The iterations which end before the deadline are skipped, and
+// their clock cycles returned, so the batch ends at the same point it would
+// have without skipping.
+static __attribute__((noinline)) int idle_loop(struct GameBoy* gb, WORD branch, int cycles) {
+    struct Processor* cpu = &gb->cpu;
+    struct Scheduler* scheduler = &gb->scheduler;
+    struct IdleLoop* idle = &gb->idle;
+    if (branch >= 0x8000 || (branch < 0x100 && gb->mmu.bios_mapped)) {
+        return 0;
+    }
+
+    bool first = idle->key != (uint32_t)branch + 1;
+    if (first) {
+        idle->key = branch + 1;
+        idle->pollable = idle_loop_pollable(gb, cpu->PC, branch, idle);
+        idle->cycles += cycles;
+        idle->instructions++;
+    }
+    if (!idle->pollable) {
+        return 0;
+    }
+
+    sync_flags(cpu);
+    unsigned long long now = scheduler->now;
+    unsigned long long skipped = 0;
+    bool disturbed = idle->disturbed;
+    idle->disturbed = false;
+    if (!first && !disturbed && now - idle->time == idle->cycles && cpu->A == idle->a && cpu->F == idle->f) {
+        // Reads through registers are only known now
+        bool safe = (!(idle->indirect & IDLE_READ_HL) || idle_read_safe(gb, cpu->HL))
+            && (!(idle->indirect & IDLE_READ_BC) || idle_read_safe(gb, cpu->BC))
+            && (!(idle->indirect & IDLE_READ_DE) || idle_read_safe(gb, cpu->DE))
+            && (!(idle->indirect & IDLE_READ_C) || idle_read_safe(gb, 0xFF00 | cpu->C));
+        unsigned long long next = now + cycles;
+        if (safe && scheduler->deadline > next) {
+            unsigned long long iterations = (scheduler->deadline - next) / idle->cycles;
+            if (iterations > (1 << 30) / idle->cycles) {
+                iterations = (1 << 30) / idle->cycles;
             }
-            unset_flag(FLAG_N);
-            unset_flag(FLAG_H);
-            return 4;
+            skipped = iterations * idle->cycles;
+            gb->instructions += iterations * idle->instructions;
+        }
+    }
+#if defined(PROFILE)
+    if (skipped) {
+        profile_idle(skipped);
+    }
+#endif
+    idle->time = now + skipped;
+    idle->a = cpu->A;
+    idle->f = cpu->F;
+    return skipped;
+}
 
+// Whether the loop closed by the branch at branch was checked last and
+// does not only poll memory, like most short loops which count
+static inline bool idle_loop_rejected(struct GameBoy* gb, WORD branch) {
+    return gb->idle.key == (uint32_t)branch + 1 && !gb->idle.pollable;
+}
 
-        // Extended instruction set 10
-        case 0x10:
-            return execute_extended_instruction(0x10, read_next());
-        // Extended instruction set CB
-        case 0xCB:
-            return execute_extended_instruction(0xCB, read_next());
-        default:
-            printf("Unknown Instruction\n");
-            return 1;
+// HALT with interrupts disabled and one pending does not halt. Instead the
+// program counter is not incremented after reading the next opcode, so
+// the opcode is read again as the first byte of its operand. A HALT bugged
+// this way again stays at the same address forever.
+static int halt_bug(struct GameBoy* gb) {
+    WORD pc = gb->cpu.PC;
+    BYTE op = mmu_read(gb, pc);
+    if (op == 0x76) {
+        return 0;
+    }
+    gb->operand = opcode_lengths[op] == 3 ? mmu_read_word(gb, pc) : op;
+    return base_opcodes[op](gb);
+}
+
+// Relative jump by the next (signed) byte if cond holds
+static inline int jump_relative(struct GameBoy* gb, bool cond) {
+    struct Processor* cpu = &gb->cpu;
+    SIGNED_BYTE offset = read_next(gb);
+    if (cond) {
+        cpu->PC += offset;
+        // A short loop might be busy waiting
+        WORD branch = cpu->PC - offset - 2;
+        if (offset < 0 && offset >= -IDLE_LOOP_LENGTH - 2 && !idle_loop_rejected(gb, branch)) {
+            return 12 + idle_loop(gb, branch, 12);
+        }
+        return 12;
+    }
+    return 8;
+}
+
+// Jump to the next word if cond holds
+static inline int jump(struct GameBoy* gb, bool cond) {
+    struct Processor* cpu = &gb->cpu;
+    WORD addr = read_next_word(gb);
+    if (cond) {
+        WORD branch = cpu->PC - 3;
+        cpu->PC = addr;
+        // A short loop might be busy waiting
+        if (addr <= branch && branch - addr <= IDLE_LOOP_LENGTH && !idle_loop_rejected(gb, branch)) {
+            return 16 + idle_loop(gb, branch, 16);
+        }
+        return 16;
+    }
+    return 12;
+}
+
+// Call the subroutine at the next word if cond holds
+static inline int call(struct GameBoy* gb, bool cond) {
+    struct Processor* cpu = &gb->cpu;
+    WORD addr = read_next_word(gb);
+    if (cond) {
+        push(gb, cpu->PC);
+        cpu->PC = addr;
+        return 24;
+    }
+    return 12;
+}
+
+// Return from a subroutine if cond holds
+static inline int ret(struct GameBoy* gb, bool cond) {
+    struct Processor* cpu = &gb->cpu;
+    if (cond) {
+        cpu->PC = pop(gb);
+        return 20;
+    }
+    return 8;
+}
+
+// Call one of the fixed restart vectors
+static inline int rst(struct GameBoy* gb, WORD addr) {
+    push(gb, gb->cpu.PC);
+    gb->cpu.PC = addr;
+    return 16;
+}
+
+// Handler for the opcodes which are not part of the instruction set
+static inline int unknown_instruction(struct GameBoy* gb) {
+    WORD addr = gb->cpu.PC - 1;
+    printf("Unknown Instruction 0x%02X at 0x%04X\n", mmu_read(gb, addr), addr);
+    return 4;
+}
+
+// Define the handler for a base opcode. Handlers take the gameboy, the body
+// also gets its processor as cpu.
+#define OPCODE(op) \
+    static inline int op_##op##_body(struct GameBoy* gb, struct Processor* cpu); \
+    static inline int op_##op(struct GameBoy* gb) { return op_##op##_body(gb, &gb->cpu); } \
+    static inline int op_##op##_body(struct GameBoy* gb, struct Processor* cpu)
+// Define the handler for a CB prefixed opcode
+#define CB_OPCODE(op) static inline int cb_##op(struct GameBoy* gb)
+
+// List the 16 entries prefix##hi##0 to prefix##hi##F of an opcode table row
+#define ROW(prefix, hi) \
+    prefix##hi##0, prefix##hi##1, prefix##hi##2, prefix##hi##3, \
+    prefix##hi##4, prefix##hi##5, prefix##hi##6, prefix##hi##7, \
+    prefix##hi##8, prefix##hi##9, prefix##hi##A, prefix##hi##B, \
+    prefix##hi##C, prefix##hi##D, prefix##hi##E, prefix##hi##F
+#define TABLE(prefix) \
+    ROW(prefix, 0x0), ROW(prefix, 0x1), ROW(prefix, 0x2), ROW(prefix, 0x3), \
+    ROW(prefix, 0x4), ROW(prefix, 0x5), ROW(prefix, 0x6), ROW(prefix, 0x7), \
+    ROW(prefix, 0x8), ROW(prefix, 0x9), ROW(prefix, 0xA), ROW(prefix, 0xB), \
+    ROW(prefix, 0xC), ROW(prefix, 0xD), ROW(prefix, 0xE), ROW(prefix, 0xF)
+
+// NOP
+OPCODE(0x00) { return 4; }
+// LD BC, nn
+OPCODE(0x01) { cpu->BC = read_next_word(gb); return 12; }
+// LD <BC>, A
+OPCODE(0x02) { mmu_write(gb, cpu->BC, cpu->A); return 8; }
+// INC BC
+OPCODE(0x03) { cpu->BC++; return 8; }
+// INC B
+OPCODE(0x04) { cpu->B = add_with_flags_u8(cpu, cpu->B, 1, false, false); return 4; }
+// DEC B
+OPCODE(0x05) { cpu->B = sub_with_flags_u8(cpu, cpu->B, 1, false, false); return 4; }
+// LD B, n
+OPCODE(0x06) { cpu->B = read_next(gb); return 8; }
+// RLCA
+OPCODE(0x07) { cpu->A = RLC(cpu, cpu->A); unset_flag(cpu, FLAG_Z); return 4; }
+// LD <nn>, SP
+OPCODE(0x08) { mmu_write_word(gb, read_next_word(gb), cpu->SP); return 20; }
+// ADD HL, BC
+OPCODE(0x09) { cpu->HL = add_with_flags_u16(cpu, cpu->HL, cpu->BC); return 8; }
+// LD A, <BC>
+OPCODE(0x0A) { cpu->A = mmu_read(gb, cpu->BC); return 8; }
+// DEC BC
+OPCODE(0x0B) { cpu->BC--; return 8; }
+// INC C
+OPCODE(0x0C) { cpu->C = add_with_flags_u8(cpu, cpu->C, 1, false, false); return 4; }
+// DEC C
+OPCODE(0x0D) { cpu->C = sub_with_flags_u8(cpu, cpu->C, 1, false, false); return 4; }
+// LD C, n
+OPCODE(0x0E) { cpu->C = read_next(gb); return 8; }
+// RRCA
+OPCODE(0x0F) { cpu->A = RRC(cpu, cpu->A); unset_flag(cpu, FLAG_Z); return 4; }
+
+// STOP
+OPCODE(0x10) {
+    read_next(gb);
+    cpu->is_halted = true;
+    cpu->is_stopped = true;
+    return 4;
+}
+// LD DE, nn
+OPCODE(0x11) { cpu->DE = read_next_word(gb); return 12; }
+// LD <DE>, A
+OPCODE(0x12) { mmu_write(gb, cpu->DE, cpu->A); return 8; }
+// INC DE
+OPCODE(0x13) { cpu->DE++; return 8; }
+// INC D
+OPCODE(0x14) { cpu->D = add_with_flags_u8(cpu, cpu->D, 1, false, false); return 4; }
+// DEC D
+OPCODE(0x15) { cpu->D = sub_with_flags_u8(cpu, cpu->D, 1, false, false); return 4; }
+// LD D, n
+OPCODE(0x16) { cpu->D = read_next(gb); return 8; }
+// RLA
+OPCODE(0x17) { cpu->A = RL(cpu, cpu->A); unset_flag(cpu, FLAG_Z); return 4; }
+// JR n
+OPCODE(0x18) { return jump_relative(gb, true); }
+// ADD HL, DE
+OPCODE(0x19) { cpu->HL = add_with_flags_u16(cpu, cpu->HL, cpu->DE); return 8; }
+// LD A, <DE>
+OPCODE(0x1A) { cpu->A = mmu_read(gb, cpu->DE); return 8; }
+// DEC DE
+OPCODE(0x1B) { cpu->DE--; return 8; }
+// INC E
+OPCODE(0x1C) { cpu->E = add_with_flags_u8(cpu, cpu->E, 1, false, false); return 4; }
+// DEC E
+OPCODE(0x1D) { cpu->E = sub_with_flags_u8(cpu, cpu->E, 1, false, false); return 4; }
+// LD E, n
+OPCODE(0x1E) { cpu->E = read_next(gb); return 8; }
+// RRA
+OPCODE(0x1F) { cpu->A = RR(cpu, cpu->A); unset_flag(cpu, FLAG_Z); return 4; }
+
+// JR NZ, n
+OPCODE(0x20) { return jump_relative(gb, !get_flag(cpu, FLAG_Z)); }
+// LD HL, nn
+OPCODE(0x21) { cpu->HL = read_next_word(gb); return 12; }
+// LDI <HL>, A
+OPCODE(0x22) { mmu_write(gb, cpu->HL++, cpu->A); return 8; }
+// INC HL
+OPCODE(0x23) { cpu->HL++; return 8; }
+// INC H
+OPCODE(0x24) { cpu->H = add_with_flags_u8(cpu, cpu->H, 1, false, false); return 4; }
+// DEC H
+OPCODE(0x25) { cpu->H = sub_with_flags_u8(cpu, cpu->H, 1, false, false); return 4; }
+// LD H, n
+OPCODE(0x26) { cpu->H = read_next(gb); return 8; }
+// DAA
+OPCODE(0x27) {
+    BYTE correction = 0;
+    bool carry = get_flag(cpu, FLAG_C);
+    bool subtract = get_flag(cpu, FLAG_N);
+
+    if (get_flag(cpu, FLAG_H) || (!subtract && (cpu->A & 0xF) > 0x9)) {
+        correction |= 0x06;
+    }
+    if (carry || (!subtract && cpu->A > 0x99)) {
+        correction |= 0x60;
+        carry = true;
+    }
+    cpu->A = subtract ? cpu->A - correction : cpu->A + correction;
+
+    set_flag_to(cpu, FLAG_Z, cpu->A == 0);
+    unset_flag(cpu, FLAG_H);
+    set_flag_to(cpu, FLAG_C, carry);
+    return 4;
+}
+// JR Z, n
+OPCODE(0x28) { return jump_relative(gb, get_flag(cpu, FLAG_Z)); }
+// ADD HL, HL
+OPCODE(0x29) { cpu->HL = add_with_flags_u16(cpu, cpu->HL, cpu->HL); return 8; }
+// LDI A, <HL>
+OPCODE(0x2A) { cpu->A = mmu_read(gb, cpu->HL++); return 8; }
+// DEC HL
+OPCODE(0x2B) { cpu->HL--; return 8; }
+// INC L
+OPCODE(0x2C) { cpu->L = add_with_flags_u8(cpu, cpu->L, 1, false, false); return 4; }
+// DEC L
+OPCODE(0x2D) { cpu->L = sub_with_flags_u8(cpu, cpu->L, 1, false, false); return 4; }
+// LD L, n
+OPCODE(0x2E) { cpu->L = read_next(gb); return 8; }
+// CPL
+OPCODE(0x2F) {
+    cpu->A = ~cpu->A;
+    set_flag(cpu, FLAG_N);
+    set_flag(cpu, FLAG_H);
+    return 4;
+}
+
+// JR NC, n
+OPCODE(0x30) { return jump_relative(gb, !get_flag(cpu, FLAG_C)); }
+// LD SP, nn
+OPCODE(0x31) { cpu->SP = read_next_word(gb); return 12; }
+// LDD <HL>, A
+OPCODE(0x32) { mmu_write(gb, cpu->HL--, cpu->A); return 8; }
+// INC SP
+OPCODE(0x33) { cpu->SP++; return 8; }
+// INC <HL>
+OPCODE(0x34) { mmu_write(gb, cpu->HL, add_with_flags_u8(cpu, mmu_read(gb, cpu->HL), 1, false, false)); return 12; }
+// DEC <HL>
+OPCODE(0x35) { mmu_write(gb, cpu->HL, sub_with_flags_u8(cpu, mmu_read(gb, cpu->HL), 1, false, false)); return 12; }
+// LD <HL>, n
+OPCODE(0x36) { mmu_write(gb, cpu->HL, read_next(gb)); return 12; }
+// SCF
+OPCODE(0x37) {
+    unset_flag(cpu, FLAG_N);
+    unset_flag(cpu, FLAG_H);
+    set_flag(cpu, FLAG_C);
+    return 4;
+}
+// JR C, n
+OPCODE(0x38) { return jump_relative(gb, get_flag(cpu, FLAG_C)); }
+// ADD HL, SP
+OPCODE(0x39) { cpu->HL = add_with_flags_u16(cpu, cpu->HL, cpu->SP); return 8; }
+// LDD A, <HL>
+OPCODE(0x3A) { cpu->A = mmu_read(gb, cpu->HL--); return 8; }
+// DEC SP
+OPCODE(0x3B) { cpu->SP--; return 8; }
+// INC A
+OPCODE(0x3C) { cpu->A = add_with_flags_u8(cpu, cpu->A, 1, false, false); return 4; }
+// DEC A
+OPCODE(0x3D) { cpu->A = sub_with_flags_u8(cpu, cpu->A, 1, false, false); return 4; }
+// LD A, n
+OPCODE(0x3E) { cpu->A = read_next(gb); return 8; }
+// CCF
+OPCODE(0x3F) {
+    unset_flag(cpu, FLAG_N);
+    unset_flag(cpu, FLAG_H);
+    set_flag_to(cpu, FLAG_C, !get_flag(cpu, FLAG_C));
+    return 4;
+}
+
+// LD B, B
+OPCODE(0x40) { cpu->B = cpu->B; return 4; }
+// LD B, C
+OPCODE(0x41) { cpu->B = cpu->C; return 4; }
+// LD B, D
+OPCODE(0x42) { cpu->B = cpu->D; return 4; }
+// LD B, E
+OPCODE(0x43) { cpu->B = cpu->E; return 4; }
+// LD B, H
+OPCODE(0x44) { cpu->B = cpu->H; return 4; }
+// LD B, L
+OPCODE(0x45) { cpu->B = cpu->L; return 4; }
+// LD B, <HL>
+OPCODE(0x46) { cpu->B = mmu_read(gb, cpu->HL); return 8; }
+// LD B, A
+OPCODE(0x47) { cpu->B = cpu->A; return 4; }
+// LD C, B
+OPCODE(0x48) { cpu->C = cpu->B; return 4; }
+// LD C, C
+OPCODE(0x49) { cpu->C = cpu->C; return 4; }
+// LD C, D
+OPCODE(0x4A) { cpu->C = cpu->D; return 4; }
+// LD C, E
+OPCODE(0x4B) { cpu->C = cpu->E; return 4; }
+// LD C, H
+OPCODE(0x4C) { cpu->C = cpu->H; return 4; }
+// LD C, L
+OPCODE(0x4D) { cpu->C = cpu->L; return 4; }
+// LD C, <HL>
+OPCODE(0x4E) { cpu->C = mmu_read(gb, cpu->HL); return 8; }
+// LD C, A
+OPCODE(0x4F) { cpu->C = cpu->A; return 4; }
+// LD D, B
+OPCODE(0x50) { cpu->D = cpu->B; return 4; }
+// LD D, C
+OPCODE(0x51) { cpu->D = cpu->C; return 4; }
+// LD D, D
+OPCODE(0x52) { cpu->D = cpu->D; return 4; }
+// LD D, E
+OPCODE(0x53) { cpu->D = cpu->E; return 4; }
+// LD D, H
+OPCODE(0x54) { cpu->D = cpu->H; return 4; }
+// LD D, L
+OPCODE(0x55) { cpu->D = cpu->L; return 4; }
+// LD D, <HL>
+OPCODE(0x56) { cpu->D = mmu_read(gb, cpu->HL); return 8; }
+// LD D, A
+OPCODE(0x57) { cpu->D = cpu->A; return 4; }
+// LD E, B
+OPCODE(0x58) { cpu->E = cpu->B; return 4; }
+// LD E, C
+OPCODE(0x59) { cpu->E = cpu->C; return 4; }
+// LD E, D
+OPCODE(0x5A) { cpu->E = cpu->D; return 4; }
+// LD E, E
+OPCODE(0x5B) { cpu->E = cpu->E; return 4; }
+// LD E, H
+OPCODE(0x5C) { cpu->E = cpu->H; return 4; }
+// LD E, L
+OPCODE(0x5D) { cpu->E = cpu->L; return 4; }
+// LD E, <HL>
+OPCODE(0x5E) { cpu->E = mmu_read(gb, cpu->HL); return 8; }
+// LD E, A
+OPCODE(0x5F) { cpu->E = cpu->A; return 4; }
+// LD H, B
+OPCODE(0x60) { cpu->H = cpu->B; return 4; }
+// LD H, C
+OPCODE(0x61) { cpu->H = cpu->C; return 4; }
+// LD H, D
+OPCODE(0x62) { cpu->H = cpu->D; return 4; }
+// LD H, E
+OPCODE(0x63) { cpu->H = cpu->E; return 4; }
+// LD H, H
+OPCODE(0x64) { cpu->H = cpu->H; return 4; }
+// LD H, L
+OPCODE(0x65) { cpu->H = cpu->L; return 4; }
+// LD H, <HL>
+OPCODE(0x66) { cpu->H = mmu_read(gb, cpu->HL); return 8; }
+// LD H, A
+OPCODE(0x67) { cpu->H = cpu->A; return 4; }
+// LD L, B
+OPCODE(0x68) { cpu->L = cpu->B; return 4; }
+// LD L, C
+OPCODE(0x69) { cpu->L = cpu->C; return 4; }
+// LD L, D
+OPCODE(0x6A) { cpu->L = cpu->D; return 4; }
+// LD L, E
+OPCODE(0x6B) { cpu->L = cpu->E; return 4; }
+// LD L, H
+OPCODE(0x6C) { cpu->L = cpu->H; return 4; }
+// LD L, L
+OPCODE(0x6D) { cpu->L = cpu->L; return 4; }
+// LD L, <HL>
+OPCODE(0x6E) { cpu->L = mmu_read(gb, cpu->HL); return 8; }
+// LD L, A
+OPCODE(0x6F) { cpu->L = cpu->A; return 4; }
+// LD <HL>, B
+OPCODE(0x70) { mmu_write(gb, cpu->HL, cpu->B); return 8; }
+// LD <HL>, C
+OPCODE(0x71) { mmu_write(gb, cpu->HL, cpu->C); return 8; }
+// LD <HL>, D
+OPCODE(0x72) { mmu_write(gb, cpu->HL, cpu->D); return 8; }
+// LD <HL>, E
+OPCODE(0x73) { mmu_write(gb, cpu->HL, cpu->E); return 8; }
+// LD <HL>, H
+OPCODE(0x74) { mmu_write(gb, cpu->HL, cpu->H); return 8; }
+// LD <HL>, L
+OPCODE(0x75) { mmu_write(gb, cpu->HL, cpu->L); return 8; }
+// HALT
+OPCODE(0x76) {
+    if (!cpu->interrupts_pending || cpu->interrupts_enabled) {
+        cpu->is_halted = true;
+        return 4;
+    }
+    // Right after EI, the interrupt is serviced before the next opcode is
+    // read, and returns to the HALT
+    if (cpu->enable_interrupts_instruction) {
+        cpu->PC--;
+        return 4;
     }
+    return 4 + halt_bug(gb);
+}
+// LD <HL>, A
+OPCODE(0x77) { mmu_write(gb, cpu->HL, cpu->A); return 8; }
+// LD A, B
+OPCODE(0x78) { cpu->A = cpu->B; return 4; }
+// LD A, C
+OPCODE(0x79) { cpu->A = cpu->C; return 4; }
+// LD A, D
+OPCODE(0x7A) { cpu->A = cpu->D; return 4; }
+// LD A, E
+OPCODE(0x7B) { cpu->A = cpu->E; return 4; }
+// LD A, H
+OPCODE(0x7C) { cpu->A = cpu->H; return 4; }
+// LD A, L
+OPCODE(0x7D) { cpu->A = cpu->L; return 4; }
+// LD A, <HL>
+OPCODE(0x7E) { cpu->A = mmu_read(gb, cpu->HL); return 8; }
+// LD A, A
+OPCODE(0x7F) { cpu->A = cpu->A; return 4; }
+
+// ADD A, B
+OPCODE(0x80) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->B, false, true); return 4; }
+// ADD A, C
+OPCODE(0x81) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->C, false, true); return 4; }
+// ADD A, D
+OPCODE(0x82) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->D, false, true); return 4; }
+// ADD A, E
+OPCODE(0x83) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->E, false, true); return 4; }
+// ADD A, H
+OPCODE(0x84) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->H, false, true); return 4; }
+// ADD A, L
+OPCODE(0x85) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->L, false, true); return 4; }
+// ADD A, <HL>
+OPCODE(0x86) { cpu->A = add_with_flags_u8(cpu, cpu->A, mmu_read(gb, cpu->HL), false, true); return 8; }
+// ADD A, A
+OPCODE(0x87) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->A, false, true); return 4; }
+// ADC A, B
+OPCODE(0x88) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->B, true, true); return 4; }
+// ADC A, C
+OPCODE(0x89) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->C, true, true); return 4; }
+// ADC A, D
+OPCODE(0x8A) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->D, true, true); return 4; }
+// ADC A, E
+OPCODE(0x8B) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->E, true, true); return 4; }
+// ADC A, H
+OPCODE(0x8C) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->H, true, true); return 4; }
+// ADC A, L
+OPCODE(0x8D) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->L, true, true); return 4; }
+// ADC A, <HL>
+OPCODE(0x8E) { cpu->A = add_with_flags_u8(cpu, cpu->A, mmu_read(gb, cpu->HL), true, true); return 8; }
+// ADC A, A
+OPCODE(0x8F) { cpu->A = add_with_flags_u8(cpu, cpu->A, cpu->A, true, true); return 4; }
+// SUB A, B
+OPCODE(0x90) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->B, false, true); return 4; }
+// SUB A, C
+OPCODE(0x91) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->C, false, true); return 4; }
+// SUB A, D
+OPCODE(0x92) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->D, false, true); return 4; }
+// SUB A, E
+OPCODE(0x93) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->E, false, true); return 4; }
+// SUB A, H
+OPCODE(0x94) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->H, false, true); return 4; }
+// SUB A, L
+OPCODE(0x95) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->L, false, true); return 4; }
+// SUB A, <HL>
+OPCODE(0x96) { cpu->A = sub_with_flags_u8(cpu, cpu->A, mmu_read(gb, cpu->HL), false, true); return 8; }
+// SUB A, A
+OPCODE(0x97) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->A, false, true); return 4; }
+// SBC A, B
+OPCODE(0x98) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->B, true, true); return 4; }
+// SBC A, C
+OPCODE(0x99) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->C, true, true); return 4; }
+// SBC A, D
+OPCODE(0x9A) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->D, true, true); return 4; }
+// SBC A, E
+OPCODE(0x9B) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->E, true, true); return 4; }
+// SBC A, H
+OPCODE(0x9C) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->H, true, true); return 4; }
+// SBC A, L
+OPCODE(0x9D) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->L, true, true); return 4; }
+// SBC A, <HL>
+OPCODE(0x9E) { cpu->A = sub_with_flags_u8(cpu, cpu->A, mmu_read(gb, cpu->HL), true, true); return 8; }
+// SBC A, A
+OPCODE(0x9F) { cpu->A = sub_with_flags_u8(cpu, cpu->A, cpu->A, true, true); return 4; }
+// AND A, B
+OPCODE(0xA0) { AND(cpu, cpu->B); return 4; }
+// AND A, C
+OPCODE(0xA1) { AND(cpu, cpu->C); return 4; }
+// AND A, D
+OPCODE(0xA2) { AND(cpu, cpu->D); return 4; }
+// AND A, E
+OPCODE(0xA3) { AND(cpu, cpu->E); return 4; }
+// AND A, H
+OPCODE(0xA4) { AND(cpu, cpu->H); return 4; }
+// AND A, L
+OPCODE(0xA5) { AND(cpu, cpu->L); return 4; }
+// AND A, <HL>
+OPCODE(0xA6) { AND(cpu, mmu_read(gb, cpu->HL)); return 8; }
+// AND A, A
+OPCODE(0xA7) { AND(cpu, cpu->A); return 4; }
+// XOR A, B
+OPCODE(0xA8) { XOR(cpu, cpu->B); return 4; }
+// XOR A, C
+OPCODE(0xA9) { XOR(cpu, cpu->C); return 4; }
+// XOR A, D
+OPCODE(0xAA) { XOR(cpu, cpu->D); return 4; }
+// XOR A, E
+OPCODE(0xAB) { XOR(cpu, cpu->E); return 4; }
+// XOR A, H
+OPCODE(0xAC) { XOR(cpu, cpu->H); return 4; }
+// XOR A, L
+OPCODE(0xAD) { XOR(cpu, cpu->L); return 4; }
+// XOR A, <HL>
+OPCODE(0xAE) { XOR(cpu, mmu_read(gb, cpu->HL)); return 8; }
+// XOR A, A
+OPCODE(0xAF) { XOR(cpu, cpu->A); return 4; }
+// OR A, B
+OPCODE(0xB0) { OR(cpu, cpu->B); return 4; }
+// OR A, C
+OPCODE(0xB1) { OR(cpu, cpu->C); return 4; }
+// OR A, D
+OPCODE(0xB2) { OR(cpu, cpu->D); return 4; }
+// OR A, E
+OPCODE(0xB3) { OR(cpu, cpu->E); return 4; }
+// OR A, H
+OPCODE(0xB4) { OR(cpu, cpu->H); return 4; }
+// OR A, L
+OPCODE(0xB5) { OR(cpu, cpu->L); return 4; }
+// OR A, <HL>
+OPCODE(0xB6) { OR(cpu, mmu_read(gb, cpu->HL)); return 8; }
+// OR A, A
+OPCODE(0xB7) { OR(cpu, cpu->A); return 4; }
+// CP A, B
+OPCODE(0xB8) { sub_with_flags_u8(cpu, cpu->A, cpu->B, false, true); return 4; }
+// CP A, C
+OPCODE(0xB9) { sub_with_flags_u8(cpu, cpu->A, cpu->C, false, true); return 4; }
+// CP A, D
+OPCODE(0xBA) { sub_with_flags_u8(cpu, cpu->A, cpu->D, false, true); return 4; }
+// CP A, E
+OPCODE(0xBB) { sub_with_flags_u8(cpu, cpu->A, cpu->E, false, true); return 4; }
+// CP A, H
+OPCODE(0xBC) { sub_with_flags_u8(cpu, cpu->A, cpu->H, false, true); return 4; }
+// CP A, L
+OPCODE(0xBD) { sub_with_flags_u8(cpu, cpu->A, cpu->L, false, true); return 4; }
+// CP A, <HL>
+OPCODE(0xBE) { sub_with_flags_u8(cpu, cpu->A, mmu_read(gb, cpu->HL), false, true); return 8; }
+// CP A, A
+OPCODE(0xBF) { sub_with_flags_u8(cpu, cpu->A, cpu->A, false, true); return 4; }
 
+// RET NZ
+OPCODE(0xC0) { return ret(gb, !get_flag(cpu, FLAG_Z)); }
+// POP BC
+OPCODE(0xC1) { cpu->BC = pop(gb); return 12; }
+// JP NZ, nn
+OPCODE(0xC2) { return jump(gb, !get_flag(cpu, FLAG_Z)); }
+// JP nn
+OPCODE(0xC3) { return jump(gb, true); }
+// CALL NZ, nn
+OPCODE(0xC4) { return call(gb, !get_flag(cpu, FLAG_Z)); }
+// PUSH BC
+OPCODE(0xC5) { push(gb, cpu->BC); return 16; }
+// ADD A, #
+OPCODE(0xC6) { cpu->A = add_with_flags_u8(cpu, cpu->A, read_next(gb), false, true); return 8; }
+// RST 00
+OPCODE(0xC7) { return rst(gb, 0x00); }
+// RET Z
+OPCODE(0xC8) { return ret(gb, get_flag(cpu, FLAG_Z)); }
+// RET
+OPCODE(0xC9) { cpu->PC = pop(gb); return 16; }
+// JP Z, nn
+OPCODE(0xCA) { return jump(gb, get_flag(cpu, FLAG_Z)); }
+// Extended instruction set CB
+OPCODE(0xCB) { return execute_extended_instruction(gb, gb->operand); }
+// CALL Z, nn
+OPCODE(0xCC) { return call(gb, get_flag(cpu, FLAG_Z)); }
+// CALL nn
+OPCODE(0xCD) { return call(gb, true); }
+// ADC A, #
+OPCODE(0xCE) { cpu->A = add_with_flags_u8(cpu, cpu->A, read_next(gb), true, true); return 8; }
+// RST 08
+OPCODE(0xCF) { return rst(gb, 0x08); }
+
+// RET NC
+OPCODE(0xD0) { return ret(gb, !get_flag(cpu, FLAG_C)); }
+// POP DE
+OPCODE(0xD1) { cpu->DE = pop(gb); return 12; }
+// JP NC, nn
+OPCODE(0xD2) { return jump(gb, !get_flag(cpu, FLAG_C)); }
+OPCODE(0xD3) { return unknown_instruction(gb); }
+// CALL NC, nn
+OPCODE(0xD4) { return call(gb, !get_flag(cpu, FLAG_C)); }
+// PUSH DE
+OPCODE(0xD5) { push(gb, cpu->DE); return 16; }
+// SUB A, #
+OPCODE(0xD6) { cpu->A = sub_with_flags_u8(cpu, cpu->A, read_next(gb), false, true); return 8; }
+// RST 10
+OPCODE(0xD7) { return rst(gb, 0x10); }
+// RET C
+OPCODE(0xD8) { return ret(gb, get_flag(cpu, FLAG_C)); }
+// RETI, which enables interrupts without delay
+OPCODE(0xD9) {
+    cpu->PC = pop(gb);
+    cpu->interrupts_enabled = true;
+    if (cpu->interrupts_pending) {
+        scheduler_end_batch(&gb->scheduler);
+    }
+    return 16;
 }
+// JP C, nn
+OPCODE(0xDA) { return jump(gb, get_flag(cpu, FLAG_C)); }
+OPCODE(0xDB) { return unknown_instruction(gb); }
+// CALL C, nn
+OPCODE(0xDC) { return call(gb, get_flag(cpu, FLAG_C)); }
+OPCODE(0xDD) { return unknown_instruction(gb); }
+// SBC A, #
+OPCODE(0xDE) { cpu->A = sub_with_flags_u8(cpu, cpu->A, read_next(gb), true, true); return 8; }
+// RST 18
+OPCODE(0xDF) { return rst(gb, 0x18); }
 
-// Execute an instruction from the extended instruction set, returning
-// the number of simulated machine cycles
-int execute_extended_instruction(BYTE prefix, BYTE op) {
-    switch (prefix) {
-        case 0x10:
-            switch (op) {
-                // STOP
-                case 0x00:
-                    is_halted = true;
-                    is_stopped = true;
-                    return 4;
-                default:
-                    printf("Unknown 10 extended Instruction\n");
-                    return 1;
+// LDH <0xFF00 + n>, A
+OPCODE(0xE0) { mmu_write(gb, 0xFF00 + read_next(gb), cpu->A); return 12; }
+// POP HL
+OPCODE(0xE1) { cpu->HL = pop(gb); return 12; }
+// LD <0xFF00 + C>, A
+OPCODE(0xE2) { mmu_write(gb, 0xFF00 + cpu->C, cpu->A); return 8; }
+OPCODE(0xE3) { return unknown_instruction(gb); }
+OPCODE(0xE4) { return unknown_instruction(gb); }
+// PUSH HL
+OPCODE(0xE5) { push(gb, cpu->HL); return 16; }
+// AND A, #
+OPCODE(0xE6) { AND(cpu, read_next(gb)); return 8; }
+// RST 20
+OPCODE(0xE7) { return rst(gb, 0x20); }
+// ADD SP, #
+OPCODE(0xE8) { cpu->SP = add_signed_to_sp(gb); return 16; }
+// JP HL
+OPCODE(0xE9) { cpu->PC = cpu->HL; return 4; }
+// LD <nn>, A
+OPCODE(0xEA) { mmu_write(gb, read_next_word(gb), cpu->A); return 16; }
+OPCODE(0xEB) { return unknown_instruction(gb); }
+OPCODE(0xEC) { return unknown_instruction(gb); }
+OPCODE(0xED) { return unknown_instruction(gb); }
+// XOR A, #
+OPCODE(0xEE) { XOR(cpu, read_next(gb)); return 8; }
+// RST 28
+OPCODE(0xEF) { return rst(gb, 0x28); }
+
+// LDH A, <0xFF00 + n>
+OPCODE(0xF0) { cpu->A = mmu_read(gb, 0xFF00 + read_next(gb)); return 12; }
+// POP AF, the lower nibble of F is always zero
+OPCODE(0xF1) { cpu->AF = pop(gb) & 0xFFF0; cpu->lazy_op = LAZY_NONE; return 12; }
+// LD A, <0xFF00 + C>
+OPCODE(0xF2) { cpu->A = mmu_read(gb, 0xFF00 + cpu->C); return 8; }
+// DI, which also cancels an EI right before it
+OPCODE(0xF3) {
+    cpu->interrupts_enabled = false;
+    cpu->enable_interrupts_instruction = false;
+    return 4;
+}
+OPCODE(0xF4) { return unknown_instruction(gb); }
+// PUSH AF
+OPCODE(0xF5) { sync_flags(cpu); push(gb, cpu->AF); return 16; }
+// OR A, #
+OPCODE(0xF6) { OR(cpu, read_next(gb)); return 8; }
+// RST 30
+OPCODE(0xF7) { return rst(gb, 0x30); }
+// LDHL SP, n
+OPCODE(0xF8) { cpu->HL = add_signed_to_sp(gb); return 12; }
+// LD SP, HL
+OPCODE(0xF9) { cpu->SP = cpu->HL; return 8; }
+// LD A, <nn>
+OPCODE(0xFA) { cpu->A = mmu_read(gb, read_next_word(gb)); return 16; }
+// EI, ends the batch so the scheduler can enable interrupts after the next
+// instruction. An event due right after EI may request an interrupt, which
+// must wait for that instruction too.
+OPCODE(0xFB) {
+    cpu->enable_interrupts_instruction = true;
+    scheduler_end_batch(&gb->scheduler);
+    return 4;
+}
+OPCODE(0xFC) { return unknown_instruction(gb); }
+OPCODE(0xFD) { return unknown_instruction(gb); }
+// CP A, #
+OPCODE(0xFE) { sub_with_flags_u8(cpu, cpu->A, read_next(gb), false, true); return 8; }
+// RST 38
+OPCODE(0xFF) { return rst(gb, 0x38); }
 
+// The operand of a CB prefixed instruction is encoded in its lowest 3 bits:
+// B, C, D, E, H, L, <HL>, A. <HL> has no register and is handled separately.
+static inline BYTE* cb_register(struct Processor* cpu, BYTE r) {
+    switch (r) {
+        case 0: return &cpu->B;
+        case 1: return &cpu->C;
+        case 2: return &cpu->D;
+        case 3: return &cpu->E;
+        case 4: return &cpu->H;
+        case 5: return &cpu->L;
+        default: return &cpu->A;
+    }
+}
+
+// Execute the CB prefixed instruction op. Bits 7-6 select the group
+// (rotate/shift, BIT, RES, SET), bits 5-3 the bit index or the kind of
+// rotate/shift and bits 2-0 the operand. Every handler calls this with a
+// constant op, so it is inlined and folded into a handler specialized for
+// exactly one operation and operand.
+static inline __attribute__((always_inline)) int cb_execute(struct GameBoy* gb, const BYTE op) {
+    struct Processor* cpu = &gb->cpu;
+    // Step over the byte after the prefix. Decoded CB instructions call
+    // their handler directly, without going through the prefix.
+    cpu->PC++;
+    const BYTE b = (op >> 3) & 7;
+    const BYTE r = op & 7;
+    BYTE val = r == 6 ? mmu_read(gb, cpu->HL) : *cb_register(cpu, r);
+
+    switch (op >> 6) {
+        case 0:
+            switch (b) {
+                case 0: val = RLC(cpu, val); break;
+                case 1: val = RRC(cpu, val); break;
+                case 2: val = RL(cpu, val); break;
+                case 3: val = RR(cpu, val); break;
+                case 4: val = SLA(cpu, val); break;
+                case 5: val = SRA(cpu, val); break;
+                case 6: val = SWAP(cpu, val); break;
+                default: val = SRL(cpu, val); break;
             }
             break;
-        case 0xCB:
-            switch (op) {
-                BYTE val, res;
-                WORD addr;
-                // SWAP A
-                case 0x37:
-                    val = get_register(A);
-                    set_register(A, SWAP(val));
-                    return 8;
-                // SWAP B
-                case 0x30:
-                    val = get_register(B);
-                    set_register(B, SWAP(val));
-                    return 8;
-                // SWAP C
-                case 0x31:
-                    val = get_register(C);
-                    set_register(C, SWAP(val));
-                    return 8;
-                // SWAP D
-                case 0x32:
-                    val = get_register(D);
-                    set_register(D, SWAP(val));
-                    return 8;
-                // SWAP E
-                case 0x33:
-                    val = get_register(E);
-                    set_register(E, SWAP(val));
-                    return 8;
-                // SWAP H
-                case 0x34:
-                    val = get_register(H);
-                    set_register(H, SWAP(val));
-                    return 8;
-                // SWAP L
-                case 0x35:
-                    val = get_register(L);
-                    set_register(L, SWAP(val));
-                    return 8;
-                // SWAP <HL>
-                case 0x36:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, SWAP(val));
-                    return 16;
-                // RLC A
-                case 0x07:
-                    val = get_register(A);
-                    set_register(A, RLC(val));
-                    return 8;
-                // RLC B
-                case 0x00:
-                    val = get_register(B);
-                    set_register(B, RLC(val));
-                    return 8;
-                // RLC C
-                case 0x01:
-                    val = get_register(C);
-                    set_register(C, RLC(val));
-                    return 8;
-                // RLC D
-                case 0x02:
-                    val = get_register(D);
-                    set_register(D, RLC(val));
-                    return 8;
-                // RLC E
-                case 0x03:
-                    val = get_register(E);
-                    set_register(E, RLC(val));
-                    return 8;
-                // RLC H
-                case 0x04:
-                    val = get_register(H);
-                    set_register(H, RLC(val));
-                    return 8;
-                // RLC L
-                case 0x05:
-                    val = get_register(L);
-                    set_register(L, RLC(val))
-                    return 8;
-                // RLC <HL>
-                case 0x06:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, RLC(val));
-                    return 16;
-                // RL A
-                case 0x17:
-                    val = get_register(A);
-                    set_register(A, RL(val));
-                    return 8;
-                // RL B
-                case 0x10:
-                    val = get_register(B);
-                    set_register(B, RL(val));
-                    return 8;
-                // RL C
-                case 0x11:
-                    val = get_register(C);
-                    set_register(C, RL(val));
-                    return 8;
-                // RL D
-                case 0x12:
-                    val = get_register(D);
-                    set_register(D, RL(val));
-                    return 8;
-                // RL E
-                case 0x13:
-                    val = get_register(E);
-                    set_register(E, RL(val));
-                    return 8;
-                // RL H
-                case 0x14:
-                    val = get_register(H);
-                    set_register(H, RL(val));
-                    return 8;
-                // RL L
-                case 0x15:
-                    val = get_register(L);
-                    set_register(L, RL(val));
-                    return 8;
-                // RL <HL>
-                case 0x16:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, RL(val));
-                    return 16;
-                // RRC A
-                case 0x0F:
-                    val = get_register(A);
-                    set_register(A, RRC(val));
-                    return 8;
-                // RRC B
-                case 0x08:
-                    val = get_register(B);
-                    set_register(B, RRC(val));
-                    return 8;
-                // RRC C
-                case 0x09:
-                    val = get_register(C);
-                    set_register(C, RRC(val));
-                    return 8;
-                // RRC D
-                case 0x0A:
-                    val = get_register(D);
-                    set_register(D, RRC(val));
-                    return 8;
-                // RRC E
-                case 0x0B:
-                    val = get_register(E);
-                    set_register(E, RRC(val));
-                    return 8;
-                // RRC H
-                case 0x0C:
-                    val = get_register(H);
-                    set_register(H, RRC(val));
-                    return 8;
-                // RRC L
-                case 0x0D:
-                    val = get_register(L);
-                    set_register(L, RRC(val));
-                    return 8;
-                // RRC <HL>
-                case 0x0E:
-                    addr = get_16b_register(A, B);
-                    val = read(addr);
-                    write(addr, RRC(val));
-                    return 16;
-                // RR A
-                case 0x1F:
-                    val = get_register(A);
-                    set_register(A, RR(val));
-                    return 8;
-                // RR B
-                case 0x18:
-                    val = get_register(B);
-                    set_register(B, RR(val));
-                    return 8;
-                // RR C
-                case 0x19:
-                    val = get_register(C);
-                    set_register(C, RR(val));
-                    return 8;
-                // RR D
-                case 0x1A:
-                    val = get_register(D);
-                    set_register(D, RR(val));
-                    return 8;
-                // RR E
-                case 0x1B:
-                    val = get_register(E);
-                    set_register(E, RR(val));
-                    return 8;
-                // RR H
-                case 0x1C:
-                    val = get_register(H);
-                    set_register(H, RR(val));
-                    return 8;
-                // RR L
-                case 0x1D:
-                    val = get_register(L);
-                    set_register(L, RR(val));
-                    return 8;
-                // RR <HL>
-                case 0x1E:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, RR(val));
-                    return 16;
-                // SLA A
-                case 0x27:
-                    val = get_register(A);
-                    set_register(A, SLA(val));
-                    return 8;
-                // SLA B
-                case 0x20:
-                    val = get_register(B);
-                    set_register(B, SLA(val));
-                    return 8;
-                // SLA C
-                case 0x21:
-                    val = get_register(C);
-                    set_register(C, SLA(val));
-                    return 8;
-                // SLA D
-                case 0x22:
-                    val = get_register(D);
-                    set_register(D, SLA(val));
-                    return 8;
-                // SLA E
-                case 0x23:
-                    val = get_register(E);
-                    set_register(E, SLA(val));
-                    return 8;
-                // SLA H
-                case 0x24:
-                    val = get_register(H);
-                    set_register(H, SLA(val));
-                    return 8;
-                // SLA L
-                case 0x25:
-                    val = get_register(L);
-                    set_register(L, SLA(val));
-                    return 8;
-                // SLA <HL>
-                case 0x26:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, SLA(val));
-                    return 16;
-                // SRA A
-                case 0x2F:
-                    val = get_register(A);
-                    set_register(A, SRA(val));
-                    return 8;
-                // SRA B
-                case 0x2F:
-                    val = get_register(B);
-                    set_register(B, SRA(val));
-                    return 8;
-                // SRA C
-                case 0x2F:
-                    val = get_register(C);
-                    set_register(C, SRA(val));
-                    return 8;
-                // SRA D
-                case 0x2F:
-                    val = get_register(D);
-                    set_register(D, SRA(val));
-                    return 8;
-                // SRA E
-                case 0x2F:
-                    val = get_register(E);
-                    set_register(E, SRA(val));
-                    return 8;
-                // SRA H
-                case 0x2F:
-                    val = get_register(H);
-                    set_register(H, SRA(val));
-                    return 8;
-                // SRA L
-                case 0x2F:
-                    val = get_register(L);
-                    set_register(L, SRA(val));
-                    return 8;
-                // SRA <HL>
-                case 0x2F:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, SRA(val));
-                    return 16;
-                // SRL A
-                case 0x3F:
-                    val = get_register(A);
-                    write_register(A, SRL(val));
-                    return 8;
-                // SRL B
-                case 0x38:
-                    val = get_register(B);
-                    write_register(B, SRL(val));
-                    return 8;
-                // SRL C
-                case 0x39:
-                    val = get_register(C);
-                    write_register(C, SRL(val));
-                    return 8;
-                // SRL D
-                case 0x3A:
-                    val = get_register(D);
-                    write_register(D, SRL(val));
-                    return 8;
-                // SRL E
-                case 0x3B:
-                    val = get_register(E);
-                    write_register(E, SRL(val));
-                    return 8;
-                // SRL H
-                case 0x3C:
-                    val = get_register(H);
-                    write_register(H, SRL(val));
-                    return 8;
-                // SRL L
-                case 0x3D:
-                    val = get_register(L);
-                    write_register(L, SRL(val));
-                    return 8;
-                // SRL <HL>
-                case 0x3E:
-                    addr = get_16b_register(H, L);
-                    val = read(addr);
-                    write(addr, SRL(val));
-                    return 16;
-                case 0x47: BIT(get_register(A), 0); return 8; 
-                case 0x4F: BIT(get_register(A), 1); return 8; 
-                case 0x57: BIT(get_register(A), 2); return 8; 
-                case 0x5F: BIT(get_register(A), 3); return 8; 
-                case 0x67: BIT(get_register(A), 4); return 8; 
-                case 0x6F: BIT(get_register(A), 5); return 8; 
-                case 0x77: BIT(get_register(A), 6); return 8; 
-                case 0x7F: BIT(get_register(A), 7); return 8; 
-                case 0x40: BIT(get_register(B), 0); return 8; 
-                case 0x48: BIT(get_register(B), 1); return 8; 
-                case 0x50: BIT(get_register(B), 2); return 8; 
-                case 0x58: BIT(get_register(B), 3); return 8; 
-                case 0x60: BIT(get_register(B), 4); return 8; 
-                case 0x48: BIT(get_register(B), 1); return 8;
-                case 0x50: BIT(get_register(B), 2); return 8;
-                case 0x58: BIT(get_register(B), 3); return 8;
-                case 0x60: BIT(get_register(B), 4); return 8;
-                case 0x68: BIT(get_register(B), 5); return 8;
-                case 0x70: BIT(get_register(B), 6); return 8;
-                case 0x78: BIT(get_register(B), 7); return 8;
-                case 0x41: BIT(get_register(C), 0); return 8;
-                case 0x49: BIT(get_register(C), 1); return 8;
-                case 0x51: BIT(get_register(C), 2); return 8;
-                case 0x59: BIT(get_register(C), 3); return 8;
-                case 0x61: BIT(get_register(C), 4); return 8;
-                case 0x69: BIT(get_register(C), 5); return 8;
-                case 0x71: BIT(get_register(C), 6); return 8;
-                case 0x79: BIT(get_register(C), 7); return 8;
-                case 0x42: BIT(get_register(D), 0); return 8;
-                case 0x4A: BIT(get_register(D), 1); return 8;
-                case 0x52: BIT(get_register(D), 2); return 8;
-                case 0x5A: BIT(get_register(D), 3); return 8;
-                case 0x62: BIT(get_register(D), 4); return 8;
-                case 0x6A: BIT(get_register(D), 5); return 8;
-                case 0x72: BIT(get_register(D), 6); return 8;
-                case 0x7A: BIT(get_register(D), 7); return 8;
-                case 0x43: BIT(get_register(E), 0); return 8;
-                case 0x4B: BIT(get_register(E), 1); return 8;
-                case 0x53: BIT(get_register(E), 2); return 8;
-                case 0x5B: BIT(get_register(E), 3); return 8;
-                case 0x63: BIT(get_register(E), 4); return 8;
-                case 0x6B: BIT(get_register(E), 5); return 8;
-                case 0x73: BIT(get_register(E), 6); return 8;
-                case 0x7B: BIT(get_register(E), 7); return 8;
-                case 0x44: BIT(get_register(H), 0); return 8;
-                case 0x4C: BIT(get_register(H), 1); return 8;
-                case 0x54: BIT(get_register(H), 2); return 8;
-                case 0x5C: BIT(get_register(H), 3); return 8;
-                case 0x64: BIT(get_register(H), 4); return 8;
-                case 0x6C: BIT(get_register(H), 5); return 8;
-                case 0x74: BIT(get_register(H), 6); return 8;
-		        case 0x7C: BIT(get_register(H), 7); return 8;
-                case 0x45: BIT(get_register(L), 0); return 8;
-                case 0x4D: BIT(get_register(L), 1); return 8;
-                case 0x55: BIT(get_register(L), 2); return 8;
-                case 0x5D: BIT(get_register(L), 3); return 8;
-                case 0x65: BIT(get_register(L), 4); return 8;
-                case 0x6D: BIT(get_register(L), 5); return 8;
-                case 0x75: BIT(get_register(L), 6); return 8;
-                case 0x7D: BIT(get_register(L), 7); return 8;
-                case 0x46: BIT(read(get_16b_register(H, L)), 0); return 16;
-                case 0x4E: BIT(read(get_16b_register(H, L)), 1); return 16;
-                case 0x56: BIT(read(get_16b_register(H, L)), 2); return 16;
-                case 0x5E: BIT(read(get_16b_register(H, L)), 3); return 16;
-                case 0x66: BIT(read(get_16b_register(H, L)), 4); return 16;
-                case 0x6E: BIT(read(get_16b_register(H, L)), 5); return 16;
-                case 0x76: BIT(read(get_16b_register(H, L)), 6); return 16;
-                case 0x7E: BIT(read(get_16b_register(H, L)), 7); return 16;
-
-                case 0xC7: SET(A, 0); return 8;
-                case 0xCF: SET(A, 1); return 8;
-                case 0xD7: SET(A, 2); return 8;
-                case 0xDF: SET(A, 3); return 8;
-                case 0xE7: SET(A, 4); return 8;
-                case 0xEF: SET(A, 5); return 8;
-                case 0xF7: SET(A, 6); return 8;
-                case 0xFF: SET(A, 7); return 8;
-                case 0xC0: SET(B, 0); return 8;
-                case 0xC8: SET(B, 1); return 8;
-                case 0xD0: SET(B, 2); return 8;
-                case 0xD8: SET(B, 3); return 8;
-                case 0xE0: SET(B, 4); return 8;
-                case 0xE8: SET(B, 5); return 8;
-                case 0xF0: SET(B, 6); return 8;
-                case 0xF8: SET(B, 7); return 8;
-                case 0xC1: SET(C, 0); return 8;
-                case 0xC9: SET(C, 1); return 8;
-                case 0xD1: SET(C, 2); return 8;
-                case 0xD9: SET(C, 3); return 8;
-                case 0xE1: SET(C, 4); return 8;
-                case 0xE9: SET(C, 5); return 8;
-                case 0xF1: SET(C, 6); return 8;
-                case 0xF9: SET(C, 7); return 8;
-                case 0xC2: SET(D, 0); return 8;
-                case 0xCA: SET(D, 1); return 8;
-                case 0xD2: SET(D, 2); return 8;
-                case 0xDA: SET(D, 3); return 8;
-                case 0xE2: SET(D, 4); return 8;
-                case 0xEA: SET(D, 5); return 8;
-                case 0xF2: SET(D, 6); return 8;
-                case 0xFA: SET(D, 7); return 8;
-                case 0xC3: SET(E, 0); return 8;
-                case 0xCB: SET(E, 1); return 8;
-                case 0xD3: SET(E, 2); return 8;
-                case 0xDB: SET(E, 3); return 8;
-                case 0xE3: SET(E, 4); return 8;
-                case 0xEB: SET(E, 5); return 8;
-                case 0xF3: SET(E, 6); return 8;
-                case 0xFB: SET(E, 7); return 8;
-                case 0xC4: SET(H, 0); return 8;
-                case 0xCC: SET(H, 1); return 8;
-                case 0xD4: SET(H, 2); return 8;
-                case 0xDC: SET(H, 3); return 8;
-                case 0xE4: SET(H, 4); return 8;
-                case 0xEC: SET(H, 5); return 8;
-                case 0xF4: SET(H, 6); return 8;
-                case 0xFC: SET(H, 7); return 8;
-                case 0xC5: SET(L, 0); return 8;
-                case 0xCD: SET(L, 1); return 8;
-                case 0xD5: SET(L, 2); return 8;
-                case 0xDD: SET(L, 3); return 8;
-                case 0xE5: SET(L, 4); return 8;
-                case 0xED: SET(L, 5); return 8;
-                case 0xF5: SET(L, 6); return 8;
-                case 0xFD: SET(L, 7); return 8;
-                case 0xC6: SET_16B(H, L, 0); return 16;
-                case 0xCE: SET_16B(H, L, 1); return 16;
-                case 0xD6: SET_16B(H, L, 2); return 16;
-                case 0xDE: SET_16B(H, L, 3); return 16;
-                case 0xE6: SET_16B(H, L, 4); return 16;
-                case 0xEE: SET_16B(H, L, 5); return 16;
-                case 0xF6: SET_16B(H, L, 6); return 16;
-                case 0xFE: SET_16B(H, L, 7); return 16;
-
-                // case 0x87: RES(A, 0); op(2, 2); break;
-                // case 0x8F: RES(A, 1); op(2, 2); break;
-                // case 0x97: RES(A, 2); op(2, 2); break;
-                // case 0x9F: RES(A, 3); op(2, 2); break;
-                // case 0xA7: RES(A, 4); op(2, 2); break;
-                // case 0xAF: RES(A, 5); op(2, 2); break;
-                // case 0xB7: RES(A, 6); op(2, 2); break;
-                // case 0xBF: RES(A, 7); op(2, 2); break;
-                // case 0x80: RES(B, 0); op(2, 2); break;
-                // case 0x88: RES(B, 1); op(2, 2); break;
-                // case 0x90: RES(B, 2); op(2, 2); break;
-                // case 0x98: RES(B, 3); op(2, 2); break;
-                // case 0xA0: RES(B, 4); op(2, 2); break;
-                // case 0xA8: RES(B, 5); op(2, 2); break;
-                // case 0xB0: RES(B, 6); op(2, 2); break;
-                // case 0xB8: RES(B, 7); op(2, 2); break;
-                // case 0x81: RES(C, 0); op(2, 2); break;
-                // case 0x89: RES(C, 1); op(2, 2); break;
-                // case 0x91: RES(C, 2); op(2, 2); break;
-                // case 0x99: RES(C, 3); op(2, 2); break;
-                // case 0xA1: RES(C, 4); op(2, 2); break;
-                // case 0xA9: RES(C, 5); op(2, 2); break;
-                // case 0xB1: RES(C, 6); op(2, 2); break;
-                // case 0xB9: RES(C, 7); op(2, 2); break;
-                // case 0x82: RES(D, 0); op(2, 2); break;
-                // case 0x8A: RES(D, 1); op(2, 2); break;
-                // case 0x92: RES(D, 2); op(2, 2); break;
-                // case 0x9A: RES(D, 3); op(2, 2); break;
-                // case 0xA2: RES(D, 4); op(2, 2); break;
-                // case 0xAA: RES(D, 5); op(2, 2); break;
-                // case 0xB2: RES(D, 6); op(2, 2); break;
-                // case 0xBA: RES(D, 7); op(2, 2); break;
-                // case 0x83: RES(E, 0); op(2, 2); break;
-                // case 0x8B: RES(E, 1); op(2, 2); break;
-                // case 0x93: RES(E, 2); op(2, 2); break;
-                // case 0x9B: RES(E, 3); op(2, 2); break;
-                // case 0xA3: RES(E, 4); op(2, 2); break;
-                // case 0xAB: RES(E, 5); op(2, 2); break;
-                // case 0xB3: RES(E, 6); op(2, 2); break;
-                // case 0xBB: RES(E, 7); op(2, 2); break;
-                // case 0x84: RES(H, 0); op(2, 2); break;
-                // case 0x8C: RES(H, 1); op(2, 2); break;
-                // case 0x94: RES(H, 2); op(2, 2); break;
-                // case 0x9C: RES(H, 3); op(2, 2); break;
-                // case 0xA4: RES(H, 4); op(2, 2); break;
-                // case 0xAC: RES(H, 5); op(2, 2); break;
-                // case 0xB4: RES(H, 6); op(2, 2); break;
-                // case 0xBC: RES(H, 7); op(2, 2); break;
-                // case 0x85: RES(L, 0); op(2, 2); break;
-                // case 0x8D: RES(L, 1); op(2, 2); break;
-                // case 0x95: RES(L, 2); op(2, 2); break;
-                // case 0x9D: RES(L, 3); op(2, 2); break;
-                // case 0xA5: RES(L, 4); op(2, 2); break;
-                // case 0xAD: RES(L, 5); op(2, 2); break;
-                // case 0xB5: RES(L, 6); op(2, 2); break;
-                // case 0xBD: RES(L, 7); op(2, 2); break;
-                // case 0x86: RES(Pair(reg_H, reg_L).address(), 0); op(2, 4); break;
-                // case 0x8E: RES(Pair(reg_H, reg_L).address(), 1); op(2, 4); break;
-                // case 0x96: RES(Pair(reg_H, reg_L).address(), 2); op(2, 4); break;
-                // case 0x9E: RES(Pair(reg_H, reg_L).address(), 3); op(2, 4); break;
-                // case 0xA6: RES(Pair(reg_H, reg_L).address(), 4); op(2, 4); break;
-                // case 0xAE: RES(Pair(reg_H, reg_L).address(), 5); op(2, 4); break;
-                // case 0xB6: RES(Pair(reg_H, reg_L).address(), 6); op(2, 4); break;
-                // case 0xBE: RES(Pair(reg_H, reg_L).address(), 7); op(2, 4); break;                   return 1;
-                default:
-                    printf("Unknown CB extended Instruction\n");
-            }
+        case 1:
+            // BIT only reads its operand
+            BIT(cpu, val, b);
+            return r == 6 ? 12 : 8;
+        case 2:
+            val = RES(val, b);
             break;
+        default:
+            val = SET(val, b);
+            break;
+    }
+
+    if (r == 6) {
+        mmu_write(gb, cpu->HL, val);
+        return 16;
+    }
+    *cb_register(cpu, r) = val;
+    return 8;
+}
+
+// Define the handlers for the CB prefixed opcodes hi0 to hiF
+#define CB_DEFINE(op) CB_OPCODE(op) { return cb_execute(gb, op); }
+#define CB_DEFINE_ROW(hi) \
+    CB_DEFINE(hi##0) CB_DEFINE(hi##1) CB_DEFINE(hi##2) CB_DEFINE(hi##3) \
+    CB_DEFINE(hi##4) CB_DEFINE(hi##5) CB_DEFINE(hi##6) CB_DEFINE(hi##7) \
+    CB_DEFINE(hi##8) CB_DEFINE(hi##9) CB_DEFINE(hi##A) CB_DEFINE(hi##B) \
+    CB_DEFINE(hi##C) CB_DEFINE(hi##D) CB_DEFINE(hi##E) CB_DEFINE(hi##F)
+
+CB_DEFINE_ROW(0x0) CB_DEFINE_ROW(0x1) CB_DEFINE_ROW(0x2) CB_DEFINE_ROW(0x3)
+CB_DEFINE_ROW(0x4) CB_DEFINE_ROW(0x5) CB_DEFINE_ROW(0x6) CB_DEFINE_ROW(0x7)
+CB_DEFINE_ROW(0x8) CB_DEFINE_ROW(0x9) CB_DEFINE_ROW(0xA) CB_DEFINE_ROW(0xB)
+CB_DEFINE_ROW(0xC) CB_DEFINE_ROW(0xD) CB_DEFINE_ROW(0xE) CB_DEFINE_ROW(0xF)
+
+// The handlers of the base opcodes, indexed by the opcode
+const opcode_handler base_opcodes[256] = { TABLE(op_) };
+// The handlers of the CB prefixed opcodes, indexed by the byte after the prefix
+const opcode_handler cb_opcodes[256] = { TABLE(cb_) };
+
+const BYTE opcode_lengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+};
+
+// Decode the instruction at addr into entry
+void cpu_decode(struct GameBoy* gb, struct DecodedInstruction* entry, WORD addr) {
+    BYTE op = mmu_read(gb, addr);
+    entry->opcode = op;
+    switch (opcode_lengths[op]) {
+        case 1: entry->operand = 0; break;
+        case 2: entry->operand = mmu_read(gb, addr + 1); break;
+        default: entry->operand = mmu_read_word(gb, addr + 1); break;
+    }
+    entry->handler = op == 0xCB ? cb_opcodes[entry->operand] : base_opcodes[op];
+}
+
+// Decode the instruction at PC, which is not decoded yet. Instructions
+// crossing a page, or on a page without decoded instructions, are decoded
+// again every time. Pages of rom come decoded as a whole, and may be shared
+// with other forks, so they are never written here.
+static __attribute__((noinline)) const struct DecodedInstruction* fetch_slow(struct GameBoy* gb) {
+    WORD pc = gb->cpu.PC;
+    struct DecodedInstruction* page = (pc & 0xFF) < 0xFE ? mmu_code_page(gb, pc) : NULL;
+    struct DecodedInstruction* entry = page ? &page[pc & 0xFF] : &gb->uncached;
+    if (page == NULL || pc >= 0x8000) {
+        cpu_decode(gb, entry, pc);
+    }
+    return entry;
+}
+
+// Look up the decoded instruction at PC, decoding it if needed, and step
+// over the opcode. The handler steps over the rest.
+static inline const struct DecodedInstruction* fetch(struct GameBoy* gb) {
+    WORD pc = gb->cpu.PC;
+    const struct DecodedInstruction* page = gb->mmu.code_pages[pc >> 8];
+    const struct DecodedInstruction* entry = page ? &page[pc & 0xFF] : NULL;
+    if (entry == NULL || entry->handler == NULL) {
+        entry = fetch_slow(gb);
+    }
+    gb->cpu.PC = pc + 1;
+    gb->operand = entry->operand;
+    return entry;
+}
+
+#if defined(PROFILE)
+// Execute the next instruction and count it in the profile. The decoded
+// instruction and the bank are taken first, as the handler may invalidate
+// the one and switch the other.
+static inline int execute_profiled(struct GameBoy* gb) {
+    WORD pc = gb->cpu.PC;
+    unsigned int bank = profile_bank(gb, pc);
+    const struct DecodedInstruction* entry = fetch(gb);
+    BYTE op = entry->opcode;
+    WORD operand = entry->operand;
+    int cycles = entry->handler(gb);
+    gb->instructions++;
+    profile_instruction(pc, bank, op, operand, cycles);
+    return cycles;
+}
+#endif
+
+// Execute the next instruction, increment the program counter and return the
+// number of simulated clock cycles
+int execute_next(struct GameBoy* gb) {
+#if defined(PROFILE)
+    return execute_profiled(gb);
+#else
+    gb->instructions++;
+    return fetch(gb)->handler(gb);
+#endif
+}
+
+// Execute an instruction from the CB extended instruction set, returning
+// the number of simulated clock cycles
+int execute_extended_instruction(struct GameBoy* gb, BYTE op) {
+    return cb_opcodes[op](gb);
+}
+
+#if defined(PROFILE)
+// Run instructions until the clock reaches the deadline of the scheduler or
+// the cpu halts, counting every one. Profiling always uses this loop, so
+// the profile is the same whichever dispatch the build uses otherwise.
+int cpu_run(struct GameBoy* gb) {
+    struct Scheduler* scheduler = &gb->scheduler;
+    unsigned long long start = scheduler->now;
+    while (scheduler->now < scheduler->deadline && !gb->cpu.is_halted) {
+        scheduler->now += execute_profiled(gb);
     }
+    return scheduler->now - start;
+}
+#elif defined(JIT)
+// Run instructions until the clock reaches the deadline of the scheduler or
+// the cpu halts, using compiled code for hot blocks. Returns the number of
+// simulated clock cycles.
+int cpu_run(struct GameBoy* gb) {
+    return jit_run(gb);
+}
+#elif defined(THREADED_DISPATCH)
+// Every opcode gets its own label, which executes the inlined handler and
+// jumps straight to the label of the next opcode. This way each opcode has
+// its own indirect branch, which is a lot easier on the branch predictor
+// than a single shared one.
+#define LABEL(op) label_##op: scheduler->now += op_##op(gb); DISPATCH();
+#define LABEL_ROW(hi) \
+    LABEL(hi##0) LABEL(hi##1) LABEL(hi##2) LABEL(hi##3) \
+    LABEL(hi##4) LABEL(hi##5) LABEL(hi##6) LABEL(hi##7) \
+    LABEL(hi##8) LABEL(hi##9) LABEL(hi##A) LABEL(hi##B) \
+    LABEL(hi##C) LABEL(hi##D) LABEL(hi##E) LABEL(hi##F)
+#define DISPATCH() \
+    if (scheduler->now >= scheduler->deadline || gb->cpu.is_halted) { \
+        gb->instructions += instructions; \
+        return scheduler->now - start; \
+    } \
+    instructions++; \
+    goto *labels[fetch(gb)->opcode]
+
+// Run instructions until the clock reaches the deadline of the scheduler or
+// the cpu halts. Returns the number of simulated clock cycles.
+int cpu_run(struct GameBoy* gb) {
+    static void* const labels[256] = { TABLE(&&label_) };
+    struct Scheduler* scheduler = &gb->scheduler;
+    unsigned long long start = scheduler->now;
+    unsigned long long instructions = 0;
+
+    DISPATCH();
+    LABEL_ROW(0x0) LABEL_ROW(0x1) LABEL_ROW(0x2) LABEL_ROW(0x3)
+    LABEL_ROW(0x4) LABEL_ROW(0x5) LABEL_ROW(0x6) LABEL_ROW(0x7)
+    LABEL_ROW(0x8) LABEL_ROW(0x9) LABEL_ROW(0xA) LABEL_ROW(0xB)
+    LABEL_ROW(0xC) LABEL_ROW(0xD) LABEL_ROW(0xE) LABEL_ROW(0xF)
+    return scheduler->now - start;
+}
+#else
+// Run instructions until the clock reaches the deadline of the scheduler or
+// the cpu halts. Returns the number of simulated clock cycles.
+int cpu_run(struct GameBoy* gb) {
+    struct Scheduler* scheduler = &gb->scheduler;
+    unsigned long long start = scheduler->now;
+    unsigned long long instructions = 0;
+    while (scheduler->now < scheduler->deadline && !gb->cpu.is_halted) {
+        scheduler->now += fetch(gb)->handler(gb);
+        instructions++;
+    }
+    gb->instructions += instructions;
+    return scheduler->now - start;
+}
+#endif
+
+// Service the highest priority interrupt which is requested and enabled.
+// Returns the number of clock cycles this took.
+int cpu_service_interrupts(struct GameBoy* gb) {
+    struct Processor* cpu = &gb->cpu;
+    BYTE pending = cpu->interrupts_pending;
+    if (!pending) {
+        return 0;
+    }
+
+    // A requested interrupt ends HALT, even if interrupts are disabled
+    cpu->is_halted = false;
+    cpu->is_stopped = false;
+    if (!cpu->interrupts_enabled) {
+        return 0;
+    }
+
+    // The lowest bit has the highest priority
+    int interrupt = __builtin_ctz(pending);
+    gb->mmu.io[0x0F] &= ~(1 << interrupt);
+    update_pending_interrupts(gb);
+    cpu->interrupts_enabled = false;
+    push(gb, cpu->PC);
+    cpu->PC = 0x40 + interrupt * 8;
+    return 20;
 }
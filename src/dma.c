@@ -0,0 +1,54 @@
+#include <string.h>
+#include "../include/dma.h"
+#include "../include/scheduler.h"
+#include "../include/gameboy.h"
+
+#define DMA 0x46
+
+// OAM DMA copies 160 bytes from 0xXX00 to OAM. Instead of a byte per
+// machine cycle, the whole block is copied by the event at the end of the
+// transfer. Until then OAM is left to the slow path, where the cpu reads
+// 0xFF and its writes are lost, as on hardware. Only OAM is blocked: on
+// hardware the cpu can only reach high ram and the IO registers during the
+// transfer, but games wait for it in high ram, and blocking the rest would
+// mean remapping every page twice per transfer.
+static void transfer(struct GameBoy* gb, unsigned long long time) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    WORD source = mmu->io[DMA] << 8;
+    // Above work ram, the transfer reads the echo of work ram
+    if (source >= 0xE000) {
+        source -= 0x2000;
+    }
+
+    // The page is read where it is mapped, which also covers pages a fork
+    // still shares with its parent
+    BYTE* page = mmu->read_pages[source >> 8];
+    if (page) {
+        memcpy(mmu->oam, page, OAM_SIZE);
+    } else {
+        for (int i = 0; i < OAM_SIZE; i++) {
+            mmu->oam[i] = mmu_read_slow(gb, source + i);
+        }
+    }
+    dma_remap(gb);
+}
+
+void dma_init(struct GameBoy* gb) {
+    scheduler_set_handler(&gb->scheduler, EVENT_DMA, transfer);
+}
+
+// Writing 0xFF46 starts a transfer from the page written, or restarts the
+// one in progress
+void dma_write(struct GameBoy* gb, BYTE data) {
+    gb->mmu.io[DMA] = data;
+    scheduler_schedule(&gb->scheduler, EVENT_DMA, gb->scheduler.now + DMA_DELAY_CYCLES + DMA_CYCLES);
+    dma_remap(gb);
+}
+
+// Map OAM unless a transfer is in progress. The mapping is not part of a
+// save state, so it is derived again after loading one and after a fork.
+void dma_remap(struct GameBoy* gb) {
+    BYTE* oam = gb->scheduler.position[EVENT_DMA] < 0 ? gb->mmu.oam : NULL;
+    gb->mmu.read_pages[0xFE] = oam;
+    gb->mmu.write_pages[0xFE] = oam;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../include/gameboy.h"
+#include "../include/serial.h"
+#include "../include/timer.h"
+#include "../include/dma.h"
+#include "../include/joypad.h"
+#include "../include/jit.h"
+
+// Set up the state the boot rom leaves behind, for running without one
+static void skip_boot_rom(struct GameBoy* gb) {
+    struct Processor* cpu = &gb->cpu;
+    cpu->AF = 0x01B0;
+    cpu->BC = 0x0013;
+    cpu->DE = 0x00D8;
+    cpu->HL = 0x014D;
+    cpu->SP = 0xFFFE;
+    cpu->PC = 0x0100;
+
+    mmu_write(gb, 0xFF47, 0xFC);
+    mmu_write(gb, 0xFF48, 0xFF);
+    mmu_write(gb, 0xFF49, 0xFF);
+    mmu_write(gb, 0xFF40, 0x91);
+    mmu_write(gb, 0xFF50, 0x01);
+}
+
+// Set up a gameboy running the rom at rom_path. Without a boot rom, the
+// emulation starts at the entry point of the cartridge. Battery backed ram
+// is only kept if save_path is given.
+bool gameboy_init(struct GameBoy* gb, const char* rom_path, const char* boot_rom_path, const char* save_path) {
+    memset(gb, 0, sizeof(*gb));
+    mmu_init(&gb->mmu);
+    scheduler_init(&gb->scheduler);
+    serial_init(gb);
+    timer_init(gb);
+    dma_init(gb);
+    ppu_init(gb);
+    joypad_init(gb);
+
+    if (boot_rom_path) {
+        FILE *boot_rom = fopen(boot_rom_path, "r");
+        if (boot_rom == NULL) {
+            fprintf(stderr, "Could not open %s\n", boot_rom_path);
+            return false;
+        }
+        fread(gb->mmu.bios, 1, 0x100, boot_rom);
+        fclose(boot_rom);
+        gb->boot_rom_hash = hash_bytes(HASH_INIT, gb->mmu.bios, sizeof(gb->mmu.bios));
+    }
+
+    // The banks of the cartridge are mapped straight from the file
+    if (!cartridge_load(&gb->cart, rom_path)) {
+        return false;
+    }
+    if (!mbc_init(&gb->mmu, &gb->cart, save_path, &gb->scheduler.now)) {
+        cartridge_unload(&gb->cart);
+        return false;
+    }
+
+    if (!boot_rom_path) {
+        skip_boot_rom(gb);
+    }
+    return true;
+}
+
+// Fork the gameboy into child, which continues from the same state. Work
+// ram and cartridge ram are shared copy on write at page granularity, so
+// forking copies about 32 KiB (mostly vram and the framebuffer) no matter
+// how much ram the cartridge has, and a child only pays for the pages it
+// writes. The parent, and the parents it was forked from, must neither
+// run nor be freed while a child shares their memory, and must outlive the
+// children using their cartridge, which the counts of every gameboy check.
+// The child has to be zeroed memory, or a fork which is forked again and
+// lets go of its previous parent.
+void gameboy_fork(struct GameBoy* parent, struct GameBoy* child) {
+    struct MemoryManagementUnit* mmu = &child->mmu;
+    assert(child->children == 0);
+    if (child->parent) {
+        child->parent->children--;
+        child->parent->sharing -= child->shares_parent;
+    }
+    jit_free(child);
+    parent->children++;
+    parent->sharing++;
+    child->shares_parent = true;
+
+    child->cpu = parent->cpu;
+    child->scheduler = parent->scheduler;
+    child->cart = parent->cart;
+    child->timer = parent->timer;
+    child->buttons = parent->buttons;
+    child->boot_rom_hash = parent->boot_rom_hash;
+    child->parent = parent;
+    child->idle = parent->idle;
+    child->instructions = parent->instructions;
+
+    mmu_init(mmu);
+    memcpy(mmu->bios, parent->mmu.bios, sizeof(mmu->bios));
+    memcpy(mmu->vram, parent->mmu.vram, sizeof(mmu->vram));
+    // OAM, IO registers, high ram and IE
+    memcpy(mmu->mem + 0xFE00, parent->mmu.mem + 0xFE00, 0x200);
+    mmu_share_wram(mmu, &parent->mmu);
+
+    mmu_set_rom(mmu, parent->mmu.cartridge, parent->mmu.rom_banks);
+    mmu_share_rom_code(mmu, &parent->mmu);
+    mmu->bios_mapped = parent->mmu.bios_mapped;
+    mmu_map_rom_bank0(mmu, parent->mmu.rom_bank0);
+    mbc_fork(mmu, &parent->mmu.mbc, &child->scheduler.now);
+    dma_remap(child);
+
+    child->ppu.window_line = parent->ppu.window_line;
+    child->ppu.frames = parent->ppu.frames;
+    memcpy(child->ppu.framebuffer, parent->ppu.framebuffer, sizeof(child->ppu.framebuffer));
+    ppu_invalidate_tiles(child);
+}
+
+// Run for the given number of frames, or forever if negative
+void gameboy_run_frames(struct GameBoy* gb, long frames) {
+    for (long frame = 0; frame != frames; frame++) {
+        scheduler_run_until(gb, gb->scheduler.now + CYCLES_PER_FRAME);
+    }
+}
+
+// Hash of the framebuffer
+uint64_t gameboy_framebuffer_hash(struct GameBoy* gb) {
+    return hash_bytes(HASH_INIT, &gb->ppu.framebuffer[0][0], sizeof(gb->ppu.framebuffer));
+}
+
+// Hash of the memory a game keeps its state in: work ram, high ram and
+// the cartridge ram. Pages a fork shares are read from where they are.
+uint64_t gameboy_memory_hash(struct GameBoy* gb) {
+    struct MemoryBankController* mbc = &gb->mmu.mbc;
+    uint64_t hash = HASH_INIT;
+    for (unsigned int page = 0; page < 0x2000 / PAGE_SIZE; page++) {
+        BYTE* shared = gb->mmu.shared_wram[page];
+        hash = hash_bytes(hash, shared ? shared : gb->mmu.wram + page * PAGE_SIZE, PAGE_SIZE);
+    }
+    hash = hash_bytes(hash, gb->mmu.hram, sizeof(gb->mmu.hram));
+    for (unsigned int page = 0; page < mbc->ram_size >> 8; page++) {
+        BYTE* shared = mbc->shared_ram[page];
+        hash = hash_bytes(hash, shared ? shared : mbc->ram + (page << 8), 0x100);
+    }
+    return hash;
+}
+
+void gameboy_free(struct GameBoy* gb) {
+    assert(gb->children == 0);
+    jit_free(gb);
+    mbc_free(&gb->mmu);
+    mmu_free_code(&gb->mmu);
+    if (gb->parent) {
+        gb->parent->children--;
+        gb->parent->sharing -= gb->shares_parent;
+        gb->parent = NULL;
+        gb->shares_parent = false;
+    } else {
+        cartridge_unload(&gb->cart);
+    }
+}
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../include/jit.h"
+#include "../include/gameboy.h"
+
+// Whether an opcode ends a block: jumps, calls, returns, restarts, HALT,
+// STOP, EI and the opcodes which are not part of the instruction set
+static bool ends_block(BYTE op) {
+    switch (op) {
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0x76:
+        case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7: case 0xC8:
+        case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+        case 0xD0: case 0xD2: case 0xD3: case 0xD4: case 0xD7: case 0xD8:
+        case 0xD9: case 0xDA: case 0xDB: case 0xDC: case 0xDD: case 0xDF:
+        case 0xE3: case 0xE4: case 0xE7: case 0xE9: case 0xEB: case 0xEC:
+        case 0xED: case 0xEF:
+        case 0xF4: case 0xFB: case 0xFC: case 0xFD: case 0xFF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Interpret instructions up to the end of the block at PC
+static void interpret_block(struct GameBoy* gb) {
+    struct Scheduler* scheduler = &gb->scheduler;
+    BYTE op;
+    do {
+        op = mmu_read(gb, gb->cpu.PC);
+        scheduler->now += execute_next(gb);
+    } while (!ends_block(op) && scheduler->now < scheduler->deadline && !gb->cpu.is_halted);
+}
+
+// Key of the block at PC in the table, or 0 if it is not in rom. The last
+// bytes of a rom area are left out, an instruction there could have its
+// operand in another bank.
+static uint32_t block_key(struct GameBoy* gb, WORD pc) {
+    if (pc >= 0x8000 || (pc & 0x3FFF) >= 0x3FFE || (pc < 0x100 && gb->mmu.bios_mapped)) {
+        return 0;
+    }
+    unsigned int bank = pc < 0x4000 ? gb->mmu.rom_bank0 : gb->mmu.rom_bank;
+    return ((bank << 14) | (pc & 0x3FFF)) + 1;
+}
+
+#if defined(__x86_64__)
+
+static void flush(struct Jit* jit) {
+    memset(jit->table, 0, sizeof(jit->table));
+    jit->entries = 0;
+    jit->used = 0;
+}
+
+static struct Jit* get_jit(struct GameBoy* gb) {
+    if (gb->jit == NULL) {
+        struct Jit* jit = malloc(sizeof(struct Jit));
+        if (jit == NULL) {
+            return NULL;
+        }
+        jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit->code == MAP_FAILED) {
+            free(jit);
+            return NULL;
+        }
+        jit->page_size = sysconf(_SC_PAGESIZE);
+        flush(jit);
+        gb->jit = jit;
+    }
+    return gb->jit;
+}
+
+// Find the slot of key, which is either its entry or the empty slot for it
+static struct JitEntry* lookup(struct Jit* jit, uint32_t key) {
+    unsigned int ix = (key * 2654435761u) & (JIT_TABLE_SIZE - 1);
+    while (jit->table[ix].key != key && jit->table[ix].key != 0) {
+        ix = (ix + 1) & (JIT_TABLE_SIZE - 1);
+    }
+    return &jit->table[ix];
+}
+
+static BYTE* emit(BYTE* out, const BYTE* bytes, size_t size) {
+    memcpy(out, bytes, size);
+    return out + size;
+}
+
+static BYTE* emit32(BYTE* out, uint32_t value) {
+    memcpy(out, &value, 4);
+    return out + 4;
+}
+
+static BYTE* emit64(BYTE* out, uint64_t value) {
+    memcpy(out, &value, 8);
+    return out + 8;
+}
+
+// Machine code of one instruction, INSTRUCTION_SIZE bytes at most:
+//     mov word [rbx + operand], immediate operand if there is one
+//     add word [rbx + PC], 1 for the opcode, the handler adds the rest
+//     add qword [rbx + instructions], 1
+//     mov rdi, rbx
+//     mov rax, handler
+//     call rax
+//     movsxd rax, eax
+//     add [rbx + now], rax
+//     mov rax, [rbx + now]
+//     cmp rax, [rbx + deadline]
+//     jae exit
+//     cmp byte [rbx + is_halted], 0
+//     jne exit
+// The jumps are patched once the exit is known.
+#define INSTRUCTION_SIZE 84
+// Machine code of a whole block at most: the instructions, the prologue and
+// the exit
+#define BLOCK_SIZE (JIT_BLOCK_LENGTH * INSTRUCTION_SIZE + 16)
+
+static BYTE* emit_instruction(BYTE* out, const struct DecodedInstruction* instruction, BYTE** exits) {
+    if (opcode_lengths[instruction->opcode] > 1) {
+        out = emit(out, (BYTE[]){0x66, 0xC7, 0x83}, 3);
+        out = emit32(out, offsetof(struct GameBoy, operand));
+        out = emit(out, (BYTE[]){instruction->operand & 0xFF, instruction->operand >> 8}, 2);
+    }
+    out = emit(out, (BYTE[]){0x66, 0x83, 0x83}, 3);
+    out = emit32(out, offsetof(struct GameBoy, cpu.PC));
+    *out++ = 1;
+    out = emit(out, (BYTE[]){0x48, 0x83, 0x83}, 3);
+    out = emit32(out, offsetof(struct GameBoy, instructions));
+    *out++ = 1;
+    out = emit(out, (BYTE[]){0x48, 0x89, 0xDF, 0x48, 0xB8}, 5);
+    out = emit64(out, (uint64_t)instruction->handler);
+    out = emit(out, (BYTE[]){0xFF, 0xD0, 0x48, 0x63, 0xC0, 0x48, 0x01, 0x83}, 8);
+    out = emit32(out, offsetof(struct GameBoy, scheduler.now));
+    out = emit(out, (BYTE[]){0x48, 0x8B, 0x83}, 3);
+    out = emit32(out, offsetof(struct GameBoy, scheduler.now));
+    out = emit(out, (BYTE[]){0x48, 0x3B, 0x83}, 3);
+    out = emit32(out, offsetof(struct GameBoy, scheduler.deadline));
+    out = emit(out, (BYTE[]){0x0F, 0x83}, 2);
+    exits[0] = out;
+    out = emit32(out, 0);
+    out = emit(out, (BYTE[]){0x80, 0xBB}, 2);
+    out = emit32(out, offsetof(struct GameBoy, cpu.is_halted));
+    *out++ = 0;
+    out = emit(out, (BYTE[]){0x0F, 0x85}, 2);
+    exits[1] = out;
+    out = emit32(out, 0);
+    return out;
+}
+
+// Compile the block at PC, which is in rom. Instructions are compiled to
+// calls of their handlers with the operand stored right before, which saves
+// the fetch, decode and dispatch, up to the end of the block or of the rom
+// area it starts in.
+static jit_block compile(struct GameBoy* gb, struct Jit* jit) {
+    if (jit->used + BLOCK_SIZE > JIT_CODE_SIZE) {
+        return NULL;
+    }
+    BYTE* start = jit->code + jit->used;
+    BYTE* out = start;
+    BYTE* exits[JIT_BLOCK_LENGTH * 2];
+    int count = 0;
+
+    // The host pages the block can reach, the code is mapped page aligned
+    size_t first = jit->used & ~(jit->page_size - 1);
+    size_t last = (jit->used + BLOCK_SIZE + jit->page_size - 1) & ~(jit->page_size - 1);
+    if (last > JIT_CODE_SIZE) {
+        last = JIT_CODE_SIZE;
+    }
+    if (mprotect(jit->code + first, last - first, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+    // push rbx; mov rbx, rdi
+    out = emit(out, (BYTE[]){0x53, 0x48, 0x89, 0xFB}, 4);
+
+    WORD pc = gb->cpu.PC;
+    WORD area = pc & 0xC000;
+    for (int i = 0; i < JIT_BLOCK_LENGTH; i++) {
+        struct DecodedInstruction instruction;
+        cpu_decode(gb, &instruction, pc);
+        out = emit_instruction(out, &instruction, exits + count);
+        count += 2;
+        pc += opcode_lengths[instruction.opcode];
+        // The next instruction has to lie completely in the area
+        if (ends_block(instruction.opcode) || ((pc + 2) & 0xC000) != area) {
+            break;
+        }
+    }
+
+    // exit: pop rbx; ret
+    for (int i = 0; i < count; i++) {
+        uint32_t offset = out - (exits[i] + 4);
+        memcpy(exits[i], &offset, 4);
+    }
+    out = emit(out, (BYTE[]){0x5B, 0xC3}, 2);
+    jit->used = (out - jit->code + 15) & ~15;
+
+    if (mprotect(jit->code + first, last - first, PROT_READ | PROT_EXEC) != 0) {
+        return NULL;
+    }
+    return (jit_block)start;
+}
+
+// The compiled block at PC, compiling it once it is hot. NULL if it has to
+// be interpreted.
+static jit_block find_block(struct GameBoy* gb) {
+    uint32_t key = block_key(gb, gb->cpu.PC);
+    struct Jit* jit;
+    if (key == 0 || (jit = get_jit(gb)) == NULL) {
+        return NULL;
+    }
+    struct JitEntry* entry = lookup(jit, key);
+    if (entry->key == 0) {
+        if (jit->entries >= JIT_TABLE_SIZE * 3 / 4) {
+            flush(jit);
+            entry = lookup(jit, key);
+        }
+        entry->key = key;
+        jit->entries++;
+    }
+    if (entry->code || ++entry->count < JIT_HOT_THRESHOLD) {
+        return entry->code;
+    }
+    entry->code = compile(gb, jit);
+    if (entry->code == NULL) {
+        // The cache is full, start over
+        flush(jit);
+    }
+    return NULL;
+}
+
+void jit_free(struct GameBoy* gb) {
+    if (gb->jit) {
+        munmap(gb->jit->code, JIT_CODE_SIZE);
+        free(gb->jit);
+        gb->jit = NULL;
+    }
+}
+
+#else
+
+static jit_block find_block(struct GameBoy* gb) {
+    return NULL;
+}
+
+void jit_free(struct GameBoy* gb) {
+}
+
+#endif
+
+// Run instructions until the clock reaches the deadline of the scheduler or
+// the cpu halts, a block at a time. Returns the number of simulated clock
+// cycles.
+int jit_run(struct GameBoy* gb) {
+    struct Scheduler* scheduler = &gb->scheduler;
+    unsigned long long start = scheduler->now;
+    while (scheduler->now < scheduler->deadline && !gb->cpu.is_halted) {
+        jit_block block = find_block(gb);
+        if (block) {
+            block(gb);
+        } else {
+            interpret_block(gb);
+        }
+    }
+    return scheduler->now - start;
+}
@@ -0,0 +1,42 @@
+#include "../include/joypad.h"
+#include "../include/gameboy.h"
+
+#define P1 0x00
+// P1 bits which select the direction keys and the action buttons, active low
+#define P1_SELECT_DIRECTIONS (1 << 4)
+#define P1_SELECT_BUTTONS (1 << 5)
+
+// Update P1 from the pressed buttons of the selected groups, which read as
+// 0. A line going low requests the joypad interrupt.
+static void update(struct GameBoy* gb) {
+    BYTE select = gb->mmu.io[P1] & (P1_SELECT_DIRECTIONS | P1_SELECT_BUTTONS);
+    BYTE pressed = 0;
+    if (!(select & P1_SELECT_DIRECTIONS)) {
+        pressed |= gb->buttons & 0x0F;
+    }
+    if (!(select & P1_SELECT_BUTTONS)) {
+        pressed |= gb->buttons >> 4;
+    }
+    BYTE value = 0xC0 | select | (~pressed & 0x0F);
+    if (gb->mmu.io[P1] & ~value & 0x0F) {
+        request_interrupt(gb, INTERRUPT_JOYPAD);
+    }
+    gb->mmu.io[P1] = value;
+}
+
+void joypad_init(struct GameBoy* gb) {
+    gb->buttons = 0;
+    gb->mmu.io[P1] = 0xCF;
+}
+
+// Only the group select bits of P1 are writable
+void joypad_write(struct GameBoy* gb, BYTE data) {
+    gb->mmu.io[P1] = (gb->mmu.io[P1] & 0x0F) | (data & (P1_SELECT_DIRECTIONS | P1_SELECT_BUTTONS));
+    update(gb);
+}
+
+// Press exactly the given JOYPAD_* buttons
+void joypad_set_buttons(struct GameBoy* gb, BYTE buttons) {
+    gb->buttons = buttons;
+    update(gb);
+}
@@ -1,35 +1,159 @@
 #include <stdio.h>
-// #include "../include/cpu.h"
-#include "../include/mmu.h"
-
-#define SCREEN_WIDTH 144
-#define SCREEN_HEIGHT 160
-
-int main() {
-    struct MMU mmu;
-    mmu.bios[0] = 1;
-    printf("=> %u", mmu.bios[0]);
-
-    // // Read rom files
-    // FILE *boot_rom = fopen("roms/boot.gb", "r");
-    // FILE *game_rom = fopen("roms/rom1.gb", "r");
-
-    // if(boot_rom == NULL || game_rom == NULL) {
-    //     fprintf(stderr, "Could not open all required files\n");
-    //     return 1;
-    // }
-    // // fread(mem, 1, 0x100, boot_rom);
-
-    // fclose(boot_rom);
-    // fclose(game_rom);
-
-    // // Execute the program
-    // execute_next();
-    // printf("%02X\n", get_register(A));
-    // set_register(A, 2);
-    // printf("%02X\n", get_register(A));
-    // printf("%04X\n", get_16b_register(A, B));
-    // set_16b_register(A, B, 2);
-    // printf("%04X\n", get_16b_register(A, B));
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../include/gameboy.h"
+#include "../include/joypad.h"
+#include "../include/movie.h"
+#include "../include/rewind.h"
+
+// Bytes of history kept for the REWIND lines of an inputs file
+#define REWIND_BUFFER_SIZE (16 << 20)
+
+// The emulated gameboy, too large for the stack
+static struct GameBoy gameboy;
+
+static const char* usage = "Usage: %s [-b boot rom] [-i inputs] [-m movie] [-r movie] [rom] [frames]\n";
+
+// Parse a line of an input file, which lists the buttons pressed during one
+// frame, e.g. "A RIGHT". Anything else, like "-", presses nothing.
+static BYTE parse_buttons(char* line) {
+    static const char* names[] = {"RIGHT", "LEFT", "UP", "DOWN", "A", "B", "SELECT", "START"};
+    BYTE buttons = 0;
+    for (char* name = strtok(line, " \t\r\n"); name; name = strtok(NULL, " \t\r\n")) {
+        for (int bit = 0; bit < 8; bit++) {
+            if (strcmp(name, names[bit]) == 0) {
+                buttons |= 1 << bit;
+            }
+        }
+    }
+    return buttons;
+}
+
+int main(int argc, char** argv) {
+    const char* boot_rom_path = NULL;
+    const char* inputs_path = NULL;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:m:r:")) != -1) {
+        switch (opt) {
+            case 'b':
+                boot_rom_path = optarg;
+                break;
+            case 'i':
+                inputs_path = optarg;
+                break;
+            case 'm':
+                record_path = optarg;
+                break;
+            case 'r':
+                replay_path = optarg;
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+        }
+    }
+    const char* rom_path = optind < argc ? argv[optind] : "roms/rom1.gb";
+    // Run for the given number of frames, or forever
+    long frames = optind + 1 < argc ? atol(argv[optind + 1]) : -1;
+    char save_path[4096];
+
+    // Battery backed ram is stored next to the rom, with .sav as extension.
+    // A replay must not depend on or change it.
+    snprintf(save_path, sizeof(save_path), "%s", rom_path);
+    char* extension = strrchr(save_path, '.');
+    if (extension && !strchr(extension, '/')) {
+        *extension = '\0';
+    }
+    strncat(save_path, ".sav", sizeof(save_path) - strlen(save_path) - 1);
+
+    // Without a boot rom, the emulation starts at the entry point of the
+    // cartridge
+    if (!gameboy_init(&gameboy, rom_path, boot_rom_path, replay_path ? NULL : save_path)) {
+        fprintf(stderr, "Could not open all required files\n");
+        return 1;
+    }
+    struct Cartridge* cart = &gameboy.cart;
+    fprintf(stderr, "=> %s (type %02X, %u rom banks, %u bytes ram)\n", cart->title, cart->type, cart->rom_banks, cart->ram_size);
+
+    FILE* inputs = NULL;
+    if (inputs_path && (inputs = fopen(inputs_path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", inputs_path);
+        return 1;
+    }
+    struct Movie movie;
+    if (replay_path) {
+        if (!movie_load(&movie, replay_path) || !movie_start_replay(&movie, &gameboy)) {
+            return 1;
+        }
+        if (optind + 1 >= argc) {
+            frames = movie.frames;
+        }
+    } else if (record_path && !movie_record(&movie, &gameboy)) {
+        return 1;
+    }
+    // The state at the start of every frame played from an inputs file is
+    // kept, so REWIND can go back to it
+    struct Rewind history;
+    bool rewinding = inputs && !replay_path;
+    if (rewinding && !rewind_init(&history, &gameboy, REWIND_BUFFER_SIZE, 1)) {
+        return 1;
+    }
+
+    // Execute the program. A replay prints the hashes of the framebuffer
+    // and the memory after every frame, so diverging runs can be compared
+    // without any video.
+    char line[256];
+    for (long frame = 0; frame != frames; frame++) {
+        BYTE buttons = 0;
+        if (replay_path) {
+            buttons = movie_input(&movie, frame);
+        } else if (inputs && fgets(line, sizeof(line), inputs)) {
+            // A REWIND line undoes the last frame instead of playing one,
+            // and drops it from the movie being recorded
+            if (strncmp(line, "REWIND", 6) == 0) {
+                if (rewind_step_back(&history, &gameboy)) {
+                    frame--;
+                    if (record_path) {
+                        movie_truncate(&movie, frame);
+                    }
+                }
+                // The line itself is no frame
+                frame--;
+                continue;
+            }
+            buttons = parse_buttons(line);
+        }
+        if (rewinding) {
+            rewind_frame(&history, &gameboy);
+        }
+        if (record_path && !replay_path) {
+            movie_add_frame(&movie, buttons);
+        }
+        joypad_set_buttons(&gameboy, buttons);
+        gameboy_run_frames(&gameboy, 1);
+
+        if (replay_path) {
+            printf("%ld %016llx %016llx\n", frame, (unsigned long long)gameboy_framebuffer_hash(&gameboy),
+                (unsigned long long)gameboy_memory_hash(&gameboy));
+        }
+    }
+
+    if (record_path && !replay_path && !movie_save(&movie, record_path)) {
+        return 1;
+    }
+    if (replay_path || record_path) {
+        movie_free(&movie);
+    }
+    if (rewinding) {
+        rewind_free(&history);
+    }
+    if (inputs) {
+        fclose(inputs);
+    }
+    gameboy_free(&gameboy);
     return 0;
 }
@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/mbc.h"
+#include "../include/mmu.h"
+#include "../include/cartridge.h"
+
+#define RTC_SECONDS 0x08
+#define RTC_DAY_HIGH 0x0C
+#define RTC_HALT (1 << 6)
+#define RTC_DAY_CARRY (1 << 7)
+// The rtc counts seconds of the emulated clock, so it is deterministic
+#define RTC_CYCLES_PER_SECOND 4194304
+
+// Map the given ram bank, or leave the area to the slow path if the
+// ram is disabled or an rtc register is selected
+static void map_ram(struct MemoryManagementUnit* mmu, unsigned int bank) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (!mbc->ram_enabled || mbc->rtc_register || mbc->ram_size == 0) {
+        mbc->mapped_ram = NULL;
+        mmu_map_eram(mmu, NULL, 0);
+        return;
+    }
+    unsigned int banks = (mbc->ram_size + RAM_BANK_SIZE - 1) / RAM_BANK_SIZE;
+    mbc->mapped_ram = mbc->ram + (bank % banks) * RAM_BANK_SIZE;
+    mmu_map_eram(mmu, mbc->mapped_ram, mbc->ram_size);
+
+    // Clean pages of battery backed ram are not writable, pages shared
+    // with the parent of a fork are read from there
+    unsigned int first_page = (mbc->mapped_ram - mbc->ram) >> 8;
+    for (unsigned int page = 0; page < RAM_BANK_SIZE >> 8; page++) {
+        BYTE* shared = mbc->shared_ram[first_page + page];
+        if (shared) {
+            mmu->read_pages[(0xA000 >> 8) + page] = shared;
+            mmu->write_pages[(0xA000 >> 8) + page] = NULL;
+        } else if (mbc->battery && !mbc->dirty[first_page + page]) {
+            mmu->write_pages[(0xA000 >> 8) + page] = NULL;
+        }
+    }
+}
+
+// Disabled or missing ram reads as 0xFF and ignores writes
+static BYTE read_disabled_ram(struct MemoryManagementUnit* mmu, WORD addr) {
+    return 0xFF;
+}
+
+static void write_disabled_ram(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+}
+
+// MBC1: 5 bit rom bank register, 2 bit register which selects either the ram
+// bank or the upper rom bank bits, depending on the banking mode
+static void mbc1_map(struct MemoryManagementUnit* mmu) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    unsigned int upper = (mbc->ram_bank & 0x3) << 5;
+    mmu_map_rom_bank(mmu, upper | mbc->rom_bank);
+    mmu_map_rom_bank0(mmu, mbc->advanced_mode ? upper : 0);
+    map_ram(mmu, mbc->advanced_mode ? mbc->ram_bank : 0);
+}
+
+static void mbc1_write_rom(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    switch (addr >> 13) {
+        case 0:
+            mbc->ram_enabled = (data & 0xF) == 0xA;
+            break;
+        case 1:
+            // Bank 0 can not be selected, it maps bank 1 instead
+            mbc->rom_bank = (data & 0x1F) ? data & 0x1F : 1;
+            break;
+        case 2:
+            mbc->ram_bank = data & 0x3;
+            break;
+        default:
+            mbc->advanced_mode = data & 1;
+            break;
+    }
+    mbc1_map(mmu);
+}
+
+// Get the value of the clock in seconds at the given emulated time
+static long long rtc_now(struct RealTimeClock* rtc, unsigned long long time) {
+    return rtc->halted ? rtc->halted_value : ((long long)time - rtc->base) / RTC_CYCLES_PER_SECOND;
+}
+
+// Set the clock to value seconds at the given emulated time
+static void rtc_set(struct RealTimeClock* rtc, unsigned long long time, long long value) {
+    rtc->halted_value = value;
+    rtc->base = (long long)time - value * RTC_CYCLES_PER_SECOND;
+}
+
+// Split the clock into the seconds, minutes, hours, day low and day high
+// registers
+static void rtc_registers(struct RealTimeClock* rtc, unsigned long long time, BYTE* regs) {
+    long long now = rtc_now(rtc, time);
+    long long days = now / 86400;
+
+    // The day counter has 9 bits, its overflow is sticky
+    if (days > 0x1FF) {
+        rtc->day_carry = true;
+        days &= 0x1FF;
+        rtc_set(rtc, time, days * 86400 + now % 86400);
+    }
+    regs[0] = now % 60;
+    regs[1] = now / 60 % 60;
+    regs[2] = now / 3600 % 24;
+    regs[3] = days & 0xFF;
+    regs[4] = (days >> 8) | (rtc->halted ? RTC_HALT : 0) | (rtc->day_carry ? RTC_DAY_CARRY : 0);
+}
+
+// Write one of the rtc registers, keeping the others
+static void rtc_write(struct RealTimeClock* rtc, unsigned long long time, BYTE reg, BYTE data) {
+    BYTE regs[5];
+    rtc_registers(rtc, time, regs);
+    regs[reg - RTC_SECONDS] = data;
+
+    long long days = regs[3] | ((regs[4] & 1) << 8);
+    long long value = days * 86400 + regs[2] * 3600 + regs[1] * 60 + regs[0];
+    rtc->day_carry = regs[4] & RTC_DAY_CARRY;
+    rtc->halted = false;
+    rtc_set(rtc, time, value);
+    rtc->halted = regs[4] & RTC_HALT;
+}
+
+static BYTE mbc3_read_ram(struct MemoryManagementUnit* mmu, WORD addr) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (mbc->ram_enabled && mbc->rtc_register) {
+        return mbc->rtc.latched[mbc->rtc_register - RTC_SECONDS];
+    }
+    return 0xFF;
+}
+
+static void mbc3_write_ram(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (mbc->ram_enabled && mbc->rtc_register) {
+        rtc_write(&mbc->rtc, *mbc->clock, mbc->rtc_register, data);
+    }
+}
+
+// MBC3: 7 bit rom bank register, ram bank or rtc register select and
+// the rtc latch
+static void mbc3_write_rom(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    switch (addr >> 13) {
+        case 0:
+            mbc->ram_enabled = (data & 0xF) == 0xA;
+            break;
+        case 1:
+            mbc->rom_bank = (data & 0x7F) ? data & 0x7F : 1;
+            mmu_map_rom_bank(mmu, mbc->rom_bank);
+            return;
+        case 2:
+            if (data >= RTC_SECONDS && data <= RTC_DAY_HIGH) {
+                mbc->rtc_register = data;
+            } else {
+                mbc->rtc_register = 0;
+                mbc->ram_bank = data & 0x3;
+            }
+            break;
+        default:
+            // Writing 0 and then 1 latches the clock
+            if (mbc->rtc.latch == 0 && data == 1) {
+                rtc_registers(&mbc->rtc, *mbc->clock, mbc->rtc.latched);
+            }
+            mbc->rtc.latch = data;
+            return;
+    }
+    map_ram(mmu, mbc->ram_bank);
+}
+
+// A write to ram which is not mapped for writing. This is the first write
+// to a clean page of battery backed ram, which marks the page dirty, or to a
+// page shared with the parent of a fork, which copies it. Either way the
+// page is mapped for writing afterwards.
+static void write_tracked_ram(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (mbc->rtc_register) {
+        mbc3_write_ram(mmu, addr, data);
+        return;
+    }
+    if (mbc->mapped_ram == NULL) {
+        return;
+    }
+    unsigned int offset = (mbc->mapped_ram - mbc->ram) + (addr - 0xA000);
+    if (offset >= mbc->ram_size) {
+        return;
+    }
+    BYTE* page = mbc->ram + (offset & ~0xFF);
+    if (mbc->shared_ram[offset >> 8]) {
+        memcpy(page, mbc->shared_ram[offset >> 8], 0x100);
+        mbc->shared_ram[offset >> 8] = NULL;
+        mmu->read_pages[addr >> 8] = page;
+    }
+    page[offset & 0xFF] = data;
+    if (mbc->battery) {
+        mbc->dirty[offset >> 8] = true;
+        mbc->any_dirty = true;
+    }
+    mmu->write_pages[addr >> 8] = page;
+}
+
+// Milliseconds of a monotonic clock
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sync the dirty pages of battery backed ram to the save file. Unless force
+// is set, this happens at most every SAVE_FLUSH_INTERVAL_MS, so it can be
+// called on every frame.
+void mbc_flush_ram(struct MemoryManagementUnit* mmu, bool force) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (!mbc->battery || !mbc->any_dirty) {
+        return;
+    }
+    long long now = now_ms();
+    if (!force && now - mbc->last_flush < SAVE_FLUSH_INTERVAL_MS) {
+        return;
+    }
+
+    // msync works on whole host pages
+    unsigned int host_page = sysconf(_SC_PAGESIZE);
+    unsigned int pages = mbc->ram_size >> 8;
+    for (unsigned int page = 0; page < pages; page += host_page >> 8) {
+        bool dirty = false;
+        for (unsigned int i = page; i < page + (host_page >> 8) && i < pages; i++) {
+            dirty |= mbc->dirty[i];
+            mbc->dirty[i] = false;
+        }
+        if (dirty) {
+            unsigned int size = mbc->ram_size - (page << 8) < host_page ? mbc->ram_size - (page << 8) : host_page;
+            msync(mbc->ram + (page << 8), size, MS_SYNC);
+        }
+    }
+    mbc->any_dirty = false;
+    mbc->last_flush = now;
+
+    // Catch the next write to every page again
+    if (mbc->mapped_ram) {
+        for (unsigned int page = 0; page < RAM_BANK_SIZE >> 8; page++) {
+            mmu->write_pages[(0xA000 >> 8) + page] = NULL;
+        }
+    }
+}
+
+// Map the save file at path as battery backed ram, creating it if needed
+static bool open_save(struct MemoryManagementUnit* mmu, const char* path, unsigned int size) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    if (st.st_size < size && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Could not resize %s\n", path);
+        close(fd);
+        return false;
+    }
+    void* ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ram == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        close(fd);
+        return false;
+    }
+    mbc->ram = ram;
+    mbc->save_fd = fd;
+    mbc->battery = true;
+    mbc->last_flush = now_ms();
+    return true;
+}
+
+// MBC5: 9 bit rom bank register split over two addresses, 4 bit ram bank
+// register. Unlike the others, bank 0 can be mapped to 0x4000 - 0x7FFF.
+static void mbc5_write_rom(struct MemoryManagementUnit* mmu, WORD addr, BYTE data) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    switch (addr >> 12) {
+        case 0:
+        case 1:
+            mbc->ram_enabled = (data & 0xF) == 0xA;
+            map_ram(mmu, mbc->ram_bank);
+            break;
+        case 2:
+            mbc->rom_bank = (mbc->rom_bank & 0x100) | data;
+            mmu_map_rom_bank(mmu, mbc->rom_bank);
+            break;
+        case 3:
+            mbc->rom_bank = (mbc->rom_bank & 0xFF) | ((data & 1) << 8);
+            mmu_map_rom_bank(mmu, mbc->rom_bank);
+            break;
+        case 4:
+        case 5:
+            mbc->ram_bank = data & 0xF;
+            map_ram(mmu, mbc->ram_bank);
+            break;
+    }
+}
+
+// Whether the cartridge type has a battery to keep its ram
+static bool has_battery(BYTE type) {
+    switch (type) {
+        case 0x03:
+        case 0x09:
+        case 0x0F:
+        case 0x10:
+        case 0x13:
+        case 0x1B:
+        case 0x1E:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Map the rom of the cartridge and set up the memory bank controller for
+// its type. Battery backed ram is kept in the file at save_path, if given.
+// The rtc runs on clock, the emulated clock of the gameboy. Returns false
+// if the type is not supported.
+bool mbc_init(struct MemoryManagementUnit* mmu, struct Cartridge* cart, const char* save_path, const unsigned long long* clock) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    memset(mbc, 0, sizeof(*mbc));
+    mbc->rom_bank = 1;
+    mbc->read_ram = read_disabled_ram;
+    mbc->write_ram = write_disabled_ram;
+    mbc->clock = clock;
+    mbc->rtc.base = *clock;
+
+    switch (cart->type) {
+        // ROM only, possibly with ram
+        case 0x00:
+        case 0x08:
+        case 0x09:
+            mbc->ram_enabled = true;
+            break;
+        case 0x01:
+        case 0x02:
+        case 0x03:
+            mbc->write_rom = mbc1_write_rom;
+            break;
+        case 0x0F:
+        case 0x10:
+        case 0x11:
+        case 0x12:
+        case 0x13:
+            mbc->write_rom = mbc3_write_rom;
+            mbc->read_ram = mbc3_read_ram;
+            mbc->write_ram = mbc3_write_ram;
+            break;
+        case 0x19:
+        case 0x1A:
+        case 0x1B:
+        case 0x1C:
+        case 0x1D:
+        case 0x1E:
+            mbc->write_rom = mbc5_write_rom;
+            break;
+        default:
+            fprintf(stderr, "Unsupported cartridge type %02X\n", cart->type);
+            return false;
+    }
+
+    if (cart->ram_size) {
+        if (save_path && has_battery(cart->type)) {
+            if (!open_save(mmu, save_path, cart->ram_size)) {
+                return false;
+            }
+            mbc->write_ram = write_tracked_ram;
+        } else {
+            mbc->ram = mbc->internal_ram;
+        }
+        mbc->ram_size = cart->ram_size;
+    }
+    mmu_set_rom(mmu, cart->rom, cart->rom_banks);
+    map_ram(mmu, mbc->ram_bank);
+    return true;
+}
+
+// Map the rom and ram banks selected by the bank registers
+static void map_banks(struct MemoryManagementUnit* mmu) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (mbc->write_rom == mbc1_write_rom) {
+        mbc1_map(mmu);
+        return;
+    }
+    mmu_map_rom_bank(mmu, mbc->rom_bank);
+    map_ram(mmu, mbc->ram_bank);
+}
+
+// Rebuild the mappings from the bank registers, after they and the ram
+// were restored from a save state
+void mbc_remap(struct MemoryManagementUnit* mmu) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    // The restored ram is not shared with anything
+    memset(mbc->shared_ram, 0, sizeof(mbc->shared_ram));
+    if (mbc->battery) {
+        // All of the ram may have changed, it is synced by the next flush
+        memset(mbc->dirty, true, mbc->ram_size >> 8);
+        mbc->any_dirty = mbc->ram_size > 0;
+    }
+    map_banks(mmu);
+}
+
+// Set up the memory bank controller of a fork in the same state as from,
+// the one of its parent. The ram of the fork is its own
+// internal ram, which starts out sharing every page with the parent and
+// only copies a page on the first write to it. The battery stays with the
+// parent, a fork never writes the save file. The rtc of the fork runs on
+// clock.
+void mbc_fork(struct MemoryManagementUnit* mmu, struct MemoryBankController* from, const unsigned long long* clock) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    memset(mbc, 0, offsetof(struct MemoryBankController, internal_ram));
+    mbc->clock = clock;
+    mbc->write_rom = from->write_rom;
+    mbc->read_ram = from->read_ram;
+    mbc->write_ram = from->write_ram;
+    mbc->ram_enabled = from->ram_enabled;
+    mbc->rom_bank = from->rom_bank;
+    mbc->ram_bank = from->ram_bank;
+    mbc->advanced_mode = from->advanced_mode;
+    mbc->rtc_register = from->rtc_register;
+    mbc->rtc = from->rtc;
+
+    if (from->ram_size) {
+        mbc->ram = mbc->internal_ram;
+        mbc->ram_size = from->ram_size;
+        mbc->write_ram = write_tracked_ram;
+        for (unsigned int page = 0; page < from->ram_size >> 8; page++) {
+            // A page the parent did not copy yet is shared with its parent
+            mbc->shared_ram[page] = from->shared_ram[page] ? from->shared_ram[page] : from->ram + (page << 8);
+        }
+    }
+    map_banks(mmu);
+}
+
+void mbc_free(struct MemoryManagementUnit* mmu) {
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (mbc->battery) {
+        mbc_flush_ram(mmu, true);
+        munmap(mbc->ram, mbc->ram_size);
+        close(mbc->save_fd);
+        mbc->battery = false;
+    }
+    mbc->ram = NULL;
+    mbc->ram_size = 0;
+    mmu_map_eram(mmu, NULL, 0);
+}
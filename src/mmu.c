@@ -1,61 +1,371 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../include/mmu.h"
+#include "../include/serial.h"
+#include "../include/timer.h"
+#include "../include/dma.h"
+#include "../include/joypad.h"
+#include "../include/gameboy.h"
 
-// // The Memory Management Unit
-// typedef struct MemoryManagementUnit {
-//     BYTE bios[0x100];
-//     union {
-//         BYTE mem[0x10000];
-//         struct {
-//             // ROM bank 0 and 1
-//             BYTE rom[2][0x4000];
-//             // Video RAM
-//             BYTE vram[0x2000];
-//             // External RAM
-//             BYTE eram[0x2000];
-//             // Work RAM
-//             BYTE wram[0x2000];
-//             BYTE wrams[0x1E00];
-//             // Sprite attribute table
-//             BYTE oam[0xA0];
-//             // Unusable
-//             BYTE empty[0x60];
-//             // IO registers
-//             BYTE io[0x80];
-//             // High RAM
-//             BYTE hram[0x80];
-//             // Interrupt register
-//             BYTE Interrupts;
-//         };
-//     };
-// } MMU;
-
-// // Read a byte from memory
-// BYTE read(MMU* mmu, WORD addr) {
-//     return mmu->mem[addr];
-// }
-// 
-// // Read a word from memory
-// WORD read_word(WORD addr) {
-//     return bytes_to_word(mem[addr], mem[addr + 1]);
-// }
-// 
-// // Read the byte at the current memory address and increment
-// // the program counter
-// BYTE read_next() {
-//     return mem[pc++];
-// }
-// 
-// // Read two bytes from the current memory address and increment
-// // the program counter twice
-// WORD read_next_word() {
-//     return bytes_to_word(mem[pc++], mem[pc++]);;
-// }
-// 
-// void write(WORD addr, BYTE data) {
-//     mem[addr] = data;
-// }
-// 
-// void write_word(WORD addr, WORD data) {
-//     mem[addr] = data;
-// }
+// Point the pages of [start, start + size) to consecutive pages of mem
+static void map_pages(BYTE** pages, unsigned int start, unsigned int size, BYTE* mem) {
+    for (unsigned int offset = 0; offset < size; offset += PAGE_SIZE) {
+        pages[(start + offset) >> 8] = mem ? mem + offset : NULL;
+    }
+}
+
+// Point the decoded instructions of the 64 pages from start to those of a
+// rom bank. Forks on other threads may publish pages of a shared rom at the
+// same time.
+static void map_rom_code(struct MemoryManagementUnit* mmu, unsigned int start, unsigned int bank) {
+    struct DecodedInstruction** pages = &mmu->code_pages[start >> 8];
+    if (mmu->rom_code) {
+        struct DecodedInstruction** code = &mmu->rom_code[bank * (ROM_BANK_SIZE / PAGE_SIZE)];
+        for (unsigned int page = 0; page < ROM_BANK_SIZE / PAGE_SIZE; page++) {
+            pages[page] = __atomic_load_n(&code[page], __ATOMIC_ACQUIRE);
+        }
+    } else {
+        memset(pages, 0, ROM_BANK_SIZE / PAGE_SIZE * sizeof(*pages));
+    }
+}
+
+// Free the decoded instructions of the rom, unless they are shared with the
+// parent of a fork
+static void free_rom_code(struct MemoryManagementUnit* mmu) {
+    if (mmu->rom_code_shared) {
+        mmu->rom_code = NULL;
+        mmu->rom_code_shared = false;
+    }
+    if (mmu->rom_code) {
+        for (unsigned int i = 0; i < mmu->rom_banks * (ROM_BANK_SIZE / PAGE_SIZE); i++) {
+            free(mmu->rom_code[i]);
+        }
+        free(mmu->rom_code);
+        mmu->rom_code = NULL;
+    }
+}
+
+// Set up the page tables for the power on state: boot rom mapped, the
+// internal rom banks as cartridge. The mmu is either zeroed or was set up
+// before, like a fork which is forked again, whose decoded instructions
+// are freed.
+void mmu_init(struct MemoryManagementUnit* mmu) {
+    map_pages(mmu->read_pages, 0x0000, MEM_SIZE, NULL);
+    map_pages(mmu->write_pages, 0x0000, MEM_SIZE, NULL);
+    mmu_free_code(mmu);
+
+    // Writes to the rom go to the memory bank controller
+    mmu_set_rom(mmu, mmu->rom[0], 2);
+
+    map_pages(mmu->read_pages, 0x8000, 0x6000, mmu->vram);
+    map_pages(mmu->write_pages, 0x8000, 0x6000, mmu->vram);
+    // Echo of the work ram
+    map_pages(mmu->read_pages, 0xE000, 0x1E00, mmu->wram);
+    map_pages(mmu->write_pages, 0xE000, 0x1E00, mmu->wram);
+    map_pages(mmu->read_pages, 0xFE00, PAGE_SIZE, mmu->oam);
+    map_pages(mmu->write_pages, 0xFE00, PAGE_SIZE, mmu->oam);
+    // 0xFF00 - 0xFFFF holds the IO registers and stays on the slow path,
+    // where high ram is checked before anything else
+
+    mmu->bios_mapped = true;
+    mmu->read_pages[0x00] = mmu->bios;
+}
+
+// Use rom as cartridge, which consists of the given number of banks
+void mmu_set_rom(struct MemoryManagementUnit* mmu, BYTE* rom, unsigned int banks) {
+    free_rom_code(mmu);
+    mmu->cartridge = rom;
+    mmu->rom_banks = banks;
+    mmu_map_rom_bank0(mmu, 0);
+    mmu_map_rom_bank(mmu, 1);
+}
+
+// Map the given rom bank to 0x0000 - 0x3FFF, which is only ever switched by
+// MBC1 cartridges
+void mmu_map_rom_bank0(struct MemoryManagementUnit* mmu, unsigned int bank) {
+    mmu->rom_bank0 = bank % mmu->rom_banks;
+    map_pages(mmu->read_pages, 0x0000, ROM_BANK_SIZE, mmu->cartridge + mmu->rom_bank0 * ROM_BANK_SIZE);
+    map_rom_code(mmu, 0x0000, mmu->rom_bank0);
+    if (mmu->bios_mapped) {
+        mmu->read_pages[0x00] = mmu->bios;
+        mmu->code_pages[0x00] = NULL;
+    }
+}
+
+// Map the given rom bank to 0x4000 - 0x7FFF. This only swaps the page
+// pointers, the rom itself is never copied.
+void mmu_map_rom_bank(struct MemoryManagementUnit* mmu, unsigned int bank) {
+    mmu->rom_bank = bank % mmu->rom_banks;
+    map_pages(mmu->read_pages, 0x4000, ROM_BANK_SIZE, mmu->cartridge + mmu->rom_bank * ROM_BANK_SIZE);
+    map_rom_code(mmu, 0x4000, mmu->rom_bank);
+}
+
+// Map size bytes of ram to 0xA000 - 0xBFFF. The rest of the area, or all of
+// it if ram is NULL, goes through the memory bank controller.
+void mmu_map_eram(struct MemoryManagementUnit* mmu, BYTE* ram, unsigned int size) {
+    if (ram == NULL || size > RAM_BANK_SIZE) {
+        size = ram == NULL ? 0 : RAM_BANK_SIZE;
+    }
+    map_pages(mmu->read_pages, 0xA000, RAM_BANK_SIZE, NULL);
+    map_pages(mmu->write_pages, 0xA000, RAM_BANK_SIZE, NULL);
+    map_pages(mmu->read_pages, 0xA000, size, ram);
+    map_pages(mmu->write_pages, 0xA000, size, ram);
+}
+
+// Map a page of work ram and its echo, which is read only while it is
+// shared with the parent of a fork or holds decoded instructions
+static void map_wram_page(struct MemoryManagementUnit* mmu, unsigned int page) {
+    BYTE* own = mmu->wram + page * PAGE_SIZE;
+    BYTE* shared = mmu->shared_wram[page];
+    BYTE* writable = shared || mmu->code_wram[page] ? NULL : own;
+    mmu->read_pages[(0xC000 >> 8) + page] = shared ? shared : own;
+    mmu->write_pages[(0xC000 >> 8) + page] = writable;
+    mmu->code_pages[(0xC000 >> 8) + page] = mmu->wram_code[page];
+    if (page < 0x1E) {
+        mmu->read_pages[(0xE000 >> 8) + page] = shared ? shared : own;
+        mmu->write_pages[(0xE000 >> 8) + page] = writable;
+        mmu->code_pages[(0xE000 >> 8) + page] = mmu->wram_code[page];
+    }
+}
+
+// Share the work ram of parent copy on write: every page is read from the
+// parent, or from wherever the parent reads it, until it is first written.
+// Without a parent, all pages are the own ones again. Decoded instructions
+// in the work ram must have been invalidated.
+void mmu_share_wram(struct MemoryManagementUnit* mmu, struct MemoryManagementUnit* parent) {
+    for (unsigned int page = 0; page < 0x2000 / PAGE_SIZE; page++) {
+        if (parent == NULL) {
+            mmu->shared_wram[page] = NULL;
+        } else if (parent->shared_wram[page]) {
+            mmu->shared_wram[page] = parent->shared_wram[page];
+        } else {
+            mmu->shared_wram[page] = parent->wram + page * PAGE_SIZE;
+        }
+        map_wram_page(mmu, page);
+    }
+}
+
+static struct DecodedInstruction** alloc_rom_code(struct MemoryManagementUnit* mmu) {
+    return calloc(mmu->rom_banks * (ROM_BANK_SIZE / PAGE_SIZE), sizeof(struct DecodedInstruction*));
+}
+
+// Use the decoded instructions of the rom of parent, which runs the same
+// cartridge, instead of decoding it again. The parent gets them first if it
+// has none yet, so all of its forks share them. The banks have to be mapped
+// afterwards to use them.
+void mmu_share_rom_code(struct MemoryManagementUnit* mmu, struct MemoryManagementUnit* parent) {
+    free_rom_code(mmu);
+    if (parent->rom_code == NULL) {
+        parent->rom_code = alloc_rom_code(parent);
+    }
+    mmu->rom_code = parent->rom_code;
+    mmu->rom_code_shared = parent->rom_code != NULL;
+}
+
+// The decoded instructions of the rom page at addr, decoding all of it if
+// it is new. Forks sharing the rom may decode the same page on other
+// threads, the first one to publish it wins.
+static struct DecodedInstruction* rom_code_page(struct GameBoy* gb, WORD addr) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    if (mmu->rom_code == NULL) {
+        mmu->rom_code = alloc_rom_code(mmu);
+        if (mmu->rom_code == NULL) {
+            return NULL;
+        }
+    }
+    unsigned int bank = addr < 0x4000 ? mmu->rom_bank0 : mmu->rom_bank;
+    struct DecodedInstruction** code = &mmu->rom_code[bank * (ROM_BANK_SIZE / PAGE_SIZE) + ((addr & 0x3FFF) >> 8)];
+    struct DecodedInstruction* page = __atomic_load_n(code, __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        page = calloc(PAGE_SIZE, sizeof(struct DecodedInstruction));
+        if (page == NULL) {
+            return NULL;
+        }
+        // The last two instructions may cross into the next page, they are
+        // never kept
+        WORD start = addr & 0xFF00;
+        for (unsigned int offset = 0; offset < PAGE_SIZE - 2; offset++) {
+            cpu_decode(gb, &page[offset], start + offset);
+        }
+        struct DecodedInstruction* published = NULL;
+        if (!__atomic_compare_exchange_n(code, &published, page, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(page);
+            page = published;
+        }
+    }
+    mmu->code_pages[addr >> 8] = page;
+    return page;
+}
+
+// The decoded instructions of the page at addr, allocating them if needed,
+// or NULL if they are not kept for it. Only rom and work ram are decoded
+// ahead. A page of rom is decoded as a whole, a page of work ram one
+// instruction at a time, and stays read only while it has decoded
+// instructions.
+struct DecodedInstruction* mmu_code_page(struct GameBoy* gb, WORD addr) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    if (addr < 0x8000 && !(addr < 0x100 && mmu->bios_mapped)) {
+        return rom_code_page(gb, addr);
+    }
+    if (addr < 0xC000 || addr >= 0xFE00) {
+        return NULL;
+    }
+
+    struct DecodedInstruction** code = &mmu->wram_code[(addr & 0x1FFF) >> 8];
+    if (*code == NULL) {
+        *code = calloc(PAGE_SIZE, sizeof(struct DecodedInstruction));
+        if (*code == NULL) {
+            return NULL;
+        }
+    }
+    unsigned int page = (addr & 0x1FFF) >> 8;
+    mmu->code_wram[page] = true;
+    map_wram_page(mmu, page);
+    return *code;
+}
+
+// Invalidate the decoded instructions of all of the work ram, before it is
+// overwritten as a whole
+void mmu_invalidate_code(struct MemoryManagementUnit* mmu) {
+    for (unsigned int page = 0; page < 0x2000 / PAGE_SIZE; page++) {
+        if (mmu->code_wram[page]) {
+            memset(mmu->wram_code[page], 0, PAGE_SIZE * sizeof(struct DecodedInstruction));
+            mmu->code_wram[page] = false;
+            map_wram_page(mmu, page);
+        }
+    }
+}
+
+// Free all decoded instructions
+void mmu_free_code(struct MemoryManagementUnit* mmu) {
+    free_rom_code(mmu);
+    for (unsigned int page = 0; page < 0x2000 / PAGE_SIZE; page++) {
+        free(mmu->wram_code[page]);
+        mmu->wram_code[page] = NULL;
+        mmu->code_wram[page] = false;
+    }
+    memset(mmu->code_pages, 0, sizeof(mmu->code_pages));
+}
+
+// Read a byte from a page which needs special handling
+BYTE mmu_read_slow(struct GameBoy* gb, WORD addr) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    // High ram shares its page with the IO registers, but the stack and hot
+    // loops often live there, so it is checked first
+    if (addr >= 0xFF80 && addr != 0xFFFF) {
+        return mmu->hram[addr - 0xFF80];
+    }
+    if (addr >= 0xFF00) {
+        if (addr >= 0xFF04 && addr <= 0xFF07) {
+            return timer_read(gb, addr);
+        }
+        // The upper bits of IF do not exist and read as 1
+        if (addr == 0xFF0F) {
+            return mmu->mem[addr] | 0xE0;
+        }
+        return mmu->mem[addr];
+    }
+    if (addr >= 0xA000 && addr < 0xC000 && mmu->mbc.read_ram) {
+        return mmu->mbc.read_ram(mmu, addr);
+    }
+    // Unmapped memory reads as 0xFF
+    return 0xFF;
+}
+
+// Write a byte to a page which needs special handling
+void mmu_write_slow(struct GameBoy* gb, WORD addr, BYTE data) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    if (addr >= 0xFF80 && addr != 0xFFFF) {
+        mmu->hram[addr - 0xFF80] = data;
+        return;
+    }
+    if (addr < 0x8000) {
+        // Writes to the rom control the memory bank controller. A new bank
+        // ends the batch, so no code compiled for the old one keeps running.
+        if (mmu->mbc.write_rom) {
+            mmu->mbc.write_rom(mmu, addr, data);
+            scheduler_end_batch(&gb->scheduler);
+            gb->idle.key = 0;
+        }
+        return;
+    }
+    if (addr < 0x9800) {
+        ppu_write_tile_data(gb, addr, data);
+        return;
+    }
+    if (addr >= 0xA000 && addr < 0xC000) {
+        if (mmu->mbc.write_ram) {
+            mmu->mbc.write_ram(mmu, addr, data);
+        }
+        return;
+    }
+    if (addr >= 0xC000 && addr < 0xFE00) {
+        // A write to a page of work ram holding decoded instructions drops
+        // the ones which contain the written byte. Instructions crossing a
+        // page are never kept, so they all start on this page.
+        unsigned int page = (addr & 0x1FFF) >> 8;
+        if (mmu->code_wram[page]) {
+            for (int offset = addr & 0xFF; offset >= 0 && offset >= (addr & 0xFF) - 2; offset--) {
+                mmu->wram_code[page][offset].handler = NULL;
+            }
+        }
+        // The first write to a page of work ram shared with the parent
+        if (mmu->shared_wram[page]) {
+            memcpy(mmu->wram + page * PAGE_SIZE, mmu->shared_wram[page], PAGE_SIZE);
+            mmu->shared_wram[page] = NULL;
+            map_wram_page(mmu, page);
+        }
+        mmu->wram[addr & 0x1FFF] = data;
+        return;
+    }
+    if (addr >= 0xFF00) {
+        switch (addr) {
+            case 0xFF00:
+                joypad_write(gb, data);
+                return;
+            case 0xFF02:
+                serial_write_control(gb, data);
+                return;
+            case 0xFF04:
+            case 0xFF05:
+            case 0xFF06:
+            case 0xFF07:
+                timer_write(gb, addr, data);
+                return;
+            case 0xFF46:
+                dma_write(gb, data);
+                return;
+            case 0xFF40:
+            case 0xFF41:
+            case 0xFF44:
+            case 0xFF45:
+                ppu_write_register(gb, addr, data);
+                return;
+            case 0xFF0F:
+            case 0xFFFF:
+                write_interrupt_register(gb, addr, data);
+                return;
+            case 0xFF50:
+                // Writing 0xFF50 unmaps the boot rom
+                if (data != 0 && mmu->bios_mapped) {
+                    mmu->bios_mapped = false;
+                    mmu_map_rom_bank0(mmu, mmu->rom_bank0);
+                    gb->idle.key = 0;
+                }
+                break;
+        }
+        mmu->mem[addr] = data;
+    }
+}
+
+// Read a word from memory
+WORD mmu_read_word(struct GameBoy* gb, WORD addr) {
+    return bytes_to_word(mmu_read(gb, addr + 1), mmu_read(gb, addr));
+}
+
+// Write a word to memory, low byte first
+void mmu_write_word(struct GameBoy* gb, WORD addr, WORD data) {
+    mmu_write(gb, addr, data & 0xFF);
+    mmu_write(gb, addr + 1, data >> 8);
+}
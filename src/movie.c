@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/movie.h"
+
+// Start recording a movie from the current state of gb
+bool movie_record(struct Movie* movie, struct GameBoy* gb) {
+    memset(movie, 0, sizeof(*movie));
+    movie->rom_hash = cartridge_hash(&gb->cart);
+    movie->boot_rom_hash = gb->boot_rom_hash;
+    movie->state_size = savestate_size(gb);
+    movie->start = malloc(movie->state_size);
+    if (movie->start == NULL) {
+        return false;
+    }
+    savestate_save(gb, movie->start, movie->state_size);
+    return true;
+}
+
+// Append the buttons pressed during the next frame
+void movie_add_frame(struct Movie* movie, BYTE buttons) {
+    if (movie->frames == movie->capacity) {
+        movie->capacity = movie->capacity ? movie->capacity * 2 : 1024;
+        movie->inputs = realloc(movie->inputs, movie->capacity);
+    }
+    movie->inputs[movie->frames++] = buttons;
+}
+
+// Drop the buttons from the given frame on, after the run went back to it
+void movie_truncate(struct Movie* movie, unsigned long frames) {
+    if (frames < movie->frames) {
+        movie->frames = frames;
+    }
+}
+
+bool movie_save(struct Movie* movie, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    struct MovieHeader header = {
+        .version = MOVIE_VERSION,
+        .rom_hash = movie->rom_hash,
+        .boot_rom_hash = movie->boot_rom_hash,
+        .state_size = movie->state_size,
+        .frames = movie->frames,
+    };
+    memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(movie->start, movie->state_size, 1, file) == 1
+        && fwrite(movie->inputs, 1, movie->frames, file) == movie->frames;
+    ok &= fclose(file) == 0;
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    return ok;
+}
+
+bool movie_load(struct Movie* movie, const char* path) {
+    memset(movie, 0, sizeof(*movie));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    struct MovieHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != MOVIE_VERSION) {
+        fprintf(stderr, "%s is not a movie of this version\n", path);
+        fclose(file);
+        return false;
+    }
+    movie->rom_hash = header.rom_hash;
+    movie->boot_rom_hash = header.boot_rom_hash;
+    movie->state_size = header.state_size;
+    movie->frames = movie->capacity = header.frames;
+    movie->start = malloc(movie->state_size);
+    movie->inputs = malloc(movie->frames ? movie->frames : 1);
+    bool ok = movie->start && movie->inputs
+        && fread(movie->start, movie->state_size, 1, file) == 1
+        && fread(movie->inputs, 1, movie->frames, file) == movie->frames;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s is truncated\n", path);
+        movie_free(movie);
+    }
+    return ok;
+}
+
+// Put gb into the starting state of the movie. Fails if gb runs a
+// different rom or boot rom, or the state is from an other version.
+bool movie_start_replay(struct Movie* movie, struct GameBoy* gb) {
+    if (cartridge_hash(&gb->cart) != movie->rom_hash) {
+        fprintf(stderr, "The movie was recorded with a different rom\n");
+        return false;
+    }
+    if (gb->boot_rom_hash != movie->boot_rom_hash) {
+        fprintf(stderr, "The movie was recorded %s boot rom\n", movie->boot_rom_hash ? "with a different" : "without a");
+        return false;
+    }
+    return savestate_load(gb, movie->start, movie->state_size);
+}
+
+// The buttons of the given frame, none after the end of the movie
+BYTE movie_input(struct Movie* movie, unsigned long frame) {
+    return frame < movie->frames ? movie->inputs[frame] : 0;
+}
+
+void movie_free(struct Movie* movie) {
+    free(movie->start);
+    free(movie->inputs);
+    memset(movie, 0, sizeof(*movie));
+}
@@ -0,0 +1,305 @@
+#include <string.h>
+#include <stdint.h>
+#include "../include/ppu.h"
+#include "../include/gameboy.h"
+
+#define LCDC 0x40
+#define STAT 0x41
+#define SCY 0x42
+#define SCX 0x43
+#define LY 0x44
+#define LYC 0x45
+#define BGP 0x47
+#define OBP0 0x48
+#define OBP1 0x49
+#define WY 0x4A
+#define WX 0x4B
+
+#define STAT_LYC_EQUAL (1 << 2)
+#define STAT_LYC_INTERRUPT (1 << 6)
+
+#define MAX_SPRITES_PER_LINE 10
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// Expand the 8 bits of a tile row to 8 bytes, the leftmost pixel (bit 7)
+// in the first byte. The multiplication places a copy of the byte shifted
+// by 7 - x bits at every byte x, so bit 7 - x ends up in bit 7 of it.
+static inline uint64_t expand_bits(BYTE bits) {
+#ifdef __BMI2__
+    return __builtin_bswap64(_pdep_u64(bits, 0x0101010101010101ull));
+#else
+    return ((bits * 0x8040201008040201ull) >> 7) & 0x0101010101010101ull;
+#endif
+}
+
+// Decode the 16 tiles on a page of tile data. A 2bpp row is a low and a high
+// bit plane, which expand to the two bits of the 8 color indices at once.
+static void decode_page(struct GameBoy* gb, unsigned int page) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    struct PixelProcessingUnit* ppu = &gb->ppu;
+    for (unsigned int tile = page * 16; tile < page * 16 + 16; tile++) {
+        for (int row = 0; row < 8; row++) {
+            BYTE low = mmu->vram[tile * 16 + row * 2];
+            BYTE high = mmu->vram[tile * 16 + row * 2 + 1];
+            uint64_t pixels = expand_bits(low) | (expand_bits(high) << 1);
+            memcpy(ppu->tiles[tile][row], &pixels, 8);
+        }
+    }
+    // Catch the next write to the page again
+    ppu->dirty_pages[page] = false;
+    mmu->write_pages[(0x8000 >> 8) + page] = NULL;
+}
+
+// Get the 8 color indices of row of the tile at offset in vram, decoding
+// the tile first if its page was written since it was last decoded
+static inline const BYTE* tile_row(struct GameBoy* gb, unsigned int offset, BYTE row) {
+    struct PixelProcessingUnit* ppu = &gb->ppu;
+    if (ppu->dirty_pages[offset >> 8]) {
+        decode_page(gb, offset >> 8);
+    }
+    return ppu->tiles[offset / 16][row];
+}
+
+// A write to a page of tile data whose tiles are decoded. Marks the page
+// dirty and maps it for writing until it is decoded again.
+void ppu_write_tile_data(struct GameBoy* gb, WORD addr, BYTE data) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    unsigned int page = (addr - 0x8000) >> 8;
+    mmu->vram[addr - 0x8000] = data;
+    gb->ppu.dirty_pages[page] = true;
+    mmu->write_pages[addr >> 8] = mmu->vram + (page << 8);
+}
+
+// Drop all decoded tiles, after vram was changed without going through
+// the page tables
+void ppu_invalidate_tiles(struct GameBoy* gb) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    struct PixelProcessingUnit* ppu = &gb->ppu;
+    for (unsigned int page = 0; page < TILE_DATA_PAGES; page++) {
+        ppu->dirty_pages[page] = true;
+        mmu->write_pages[(0x8000 >> 8) + page] = mmu->vram + (page << 8);
+    }
+}
+
+// Offset in vram of a background or window tile
+static unsigned int tile_offset(struct GameBoy* gb, BYTE tile) {
+    if (gb->mmu.io[LCDC] & LCDC_TILE_DATA) {
+        return tile * 16;
+    }
+    return 0x1000 + (SIGNED_BYTE)tile * 16;
+}
+
+static BYTE shade(BYTE palette, BYTE color) {
+    return (palette >> (color * 2)) & 3;
+}
+
+// Draw the tile map starting at map_offset from x = start to the end of
+// the line, with (map_x, map_y) the map pixel of the first drawn pixel
+static void render_tiles(struct GameBoy* gb, BYTE* line, BYTE* colors, unsigned int map_offset, int start, BYTE map_x, BYTE map_y) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    int x = start;
+    while (x < SCREEN_WIDTH) {
+        BYTE tile = mmu->vram[map_offset + (map_y / 8) * 32 + (map_x / 8)];
+        const BYTE* pixels = tile_row(gb, tile_offset(gb, tile), map_y % 8);
+        for (int col = map_x % 8; col < 8 && x < SCREEN_WIDTH; col++, x++, map_x++) {
+            colors[x] = pixels[col];
+            line[x] = shade(mmu->io[BGP], pixels[col]);
+        }
+    }
+}
+
+// Draw up to 10 sprites on the line
+static void render_sprites(struct GameBoy* gb, BYTE ly, BYTE* line, BYTE* colors) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    int height = mmu->io[LCDC] & LCDC_OBJ_SIZE ? 16 : 8;
+    BYTE* selected[MAX_SPRITES_PER_LINE];
+    int count = 0;
+
+    // The first 10 sprites in OAM which cover the line are drawn
+    for (int i = 0; i < 40 && count < MAX_SPRITES_PER_LINE; i++) {
+        BYTE* sprite = mmu->oam + i * 4;
+        int y = sprite[0] - 16;
+        if (ly < y || ly >= y + height) {
+            continue;
+        }
+        // Sort by x, keeping the OAM order for equal x, which is the priority
+        int ix = count++;
+        while (ix > 0 && selected[ix - 1][1] > sprite[1]) {
+            selected[ix] = selected[ix - 1];
+            ix--;
+        }
+        selected[ix] = sprite;
+    }
+
+    // Draw the lowest priority first, so higher priorities end up on top
+    for (int i = count - 1; i >= 0; i--) {
+        BYTE* sprite = selected[i];
+        int x = sprite[1] - 8;
+        BYTE tile = sprite[2];
+        BYTE flags = sprite[3];
+        int row = ly - (sprite[0] - 16);
+
+        if (flags & (1 << 6)) {
+            row = height - 1 - row;
+        }
+        if (height == 16) {
+            tile &= 0xFE;
+        }
+        const BYTE* pixels = tile_row(gb, tile * 16 + (row / 8) * 16, row % 8);
+
+        BYTE palette = mmu->io[flags & (1 << 4) ? OBP1 : OBP0];
+        for (int col = 0; col < 8; col++) {
+            int px = x + col;
+            BYTE color = pixels[flags & (1 << 5) ? 7 - col : col];
+            if (px < 0 || px >= SCREEN_WIDTH || color == 0) {
+                continue;
+            }
+            // With bit 7 set, the sprite is behind background colors 1-3
+            if ((flags & (1 << 7)) && colors[px] != 0) {
+                continue;
+            }
+            line[px] = shade(palette, color);
+        }
+    }
+}
+
+// Render line ly of the framebuffer from the current vram and registers
+static void render_line(struct GameBoy* gb, BYTE ly) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    struct PixelProcessingUnit* ppu = &gb->ppu;
+    BYTE* line = ppu->framebuffer[ly];
+    BYTE colors[SCREEN_WIDTH];
+    BYTE lcdc = mmu->io[LCDC];
+
+    memset(colors, 0, sizeof(colors));
+    memset(line, shade(mmu->io[BGP], 0), SCREEN_WIDTH);
+
+    if (lcdc & LCDC_BG_ENABLE) {
+        unsigned int map = lcdc & LCDC_BG_MAP ? 0x1C00 : 0x1800;
+        render_tiles(gb, line, colors, map, 0, mmu->io[SCX], mmu->io[SCY] + ly);
+
+        int window_x = mmu->io[WX] - 7;
+        if ((lcdc & LCDC_WINDOW_ENABLE) && ly >= mmu->io[WY] && window_x < SCREEN_WIDTH) {
+            unsigned int window_map = lcdc & LCDC_WINDOW_MAP ? 0x1C00 : 0x1800;
+            int start = window_x < 0 ? 0 : window_x;
+            render_tiles(gb, line, colors, window_map, start, start - window_x, ppu->window_line);
+            ppu->window_line++;
+        }
+    }
+    if (lcdc & LCDC_OBJ_ENABLE) {
+        render_sprites(gb, ly, line, colors);
+    }
+}
+
+// Switch to the mode, requesting the STAT interrupt if it is enabled for it
+static void set_mode(struct GameBoy* gb, BYTE mode) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    mmu->io[STAT] = (mmu->io[STAT] & ~3) | mode;
+    if (mode != MODE_DRAWING && (mmu->io[STAT] & (1 << (3 + mode)))) {
+        request_interrupt(gb, INTERRUPT_STAT);
+    }
+}
+
+// Update the LY == LYC flag, requesting the STAT interrupt if enabled
+static void compare_ly(struct GameBoy* gb) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    if (mmu->io[LY] == mmu->io[LYC]) {
+        mmu->io[STAT] |= STAT_LYC_EQUAL;
+        if (mmu->io[STAT] & STAT_LYC_INTERRUPT) {
+            request_interrupt(gb, INTERRUPT_STAT);
+        }
+    } else {
+        mmu->io[STAT] &= ~STAT_LYC_EQUAL;
+    }
+}
+
+// The end of the current mode. Lines are rendered as a whole at the end of
+// the drawing mode.
+static void mode_done(struct GameBoy* gb, unsigned long long time) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    switch (mmu->io[STAT] & 3) {
+        case MODE_OAM_SCAN:
+            set_mode(gb, MODE_DRAWING);
+            scheduler_schedule(&gb->scheduler, EVENT_PPU, time + DRAWING_CYCLES);
+            return;
+        case MODE_DRAWING:
+            render_line(gb, mmu->io[LY]);
+            set_mode(gb, MODE_HBLANK);
+            scheduler_schedule(&gb->scheduler, EVENT_PPU, time + HBLANK_CYCLES);
+            return;
+        case MODE_HBLANK:
+            mmu->io[LY]++;
+            compare_ly(gb);
+            if (mmu->io[LY] == SCREEN_HEIGHT) {
+                set_mode(gb, MODE_VBLANK);
+                request_interrupt(gb, INTERRUPT_VBLANK);
+                gb->ppu.frames++;
+                // Frame boundary, flush the save if it is due
+                mbc_flush_ram(mmu, false);
+                scheduler_schedule(&gb->scheduler, EVENT_PPU, time + LINE_CYCLES);
+            } else {
+                set_mode(gb, MODE_OAM_SCAN);
+                scheduler_schedule(&gb->scheduler, EVENT_PPU, time + OAM_SCAN_CYCLES);
+            }
+            return;
+        default:
+            if (mmu->io[LY] == LINES - 1) {
+                mmu->io[LY] = 0;
+                gb->ppu.window_line = 0;
+                compare_ly(gb);
+                set_mode(gb, MODE_OAM_SCAN);
+                scheduler_schedule(&gb->scheduler, EVENT_PPU, time + OAM_SCAN_CYCLES);
+            } else {
+                mmu->io[LY]++;
+                compare_ly(gb);
+                scheduler_schedule(&gb->scheduler, EVENT_PPU, time + LINE_CYCLES);
+            }
+            return;
+    }
+}
+
+void ppu_init(struct GameBoy* gb) {
+    memset(&gb->ppu, 0, sizeof(gb->ppu));
+    scheduler_set_handler(&gb->scheduler, EVENT_PPU, mode_done);
+    ppu_invalidate_tiles(gb);
+}
+
+// Handle a write to one of the LCD registers
+void ppu_write_register(struct GameBoy* gb, WORD addr, BYTE data) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    BYTE reg = addr & 0x7F;
+    switch (reg) {
+        case LCDC:
+            if ((data & LCDC_ENABLE) && !(mmu->io[LCDC] & LCDC_ENABLE)) {
+                // Turning the display on starts a new frame
+                mmu->io[LCDC] = data;
+                mmu->io[LY] = 0;
+                gb->ppu.window_line = 0;
+                compare_ly(gb);
+                set_mode(gb, MODE_OAM_SCAN);
+                scheduler_schedule(&gb->scheduler, EVENT_PPU, gb->scheduler.now + OAM_SCAN_CYCLES);
+            } else if (!(data & LCDC_ENABLE) && (mmu->io[LCDC] & LCDC_ENABLE)) {
+                mmu->io[LY] = 0;
+                mmu->io[STAT] &= ~3;
+                scheduler_cancel(&gb->scheduler, EVENT_PPU);
+            }
+            break;
+        case STAT:
+            // Only the interrupt enable bits are writable
+            data = (data & 0x78) | (mmu->io[STAT] & 0x07) | 0x80;
+            break;
+        case LY:
+            // Read only
+            return;
+        case LYC:
+            mmu->io[LYC] = data;
+            if (mmu->io[LCDC] & LCDC_ENABLE) {
+                compare_ly(gb);
+            }
+            return;
+    }
+    mmu->io[reg] = data;
+}
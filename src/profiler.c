@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../include/profiler.h"
+#include "../include/gameboy.h"
+
+// Every thread counts into a profile of its own, so gameboys running on
+// several threads, like in batch runs, never share counters. The profiles
+// are merged when the report is written at exit.
+
+struct OpcodeProfile {
+    unsigned long long count;
+    unsigned long long cycles;
+};
+
+// A program counter with the bank it is in and the opcode found there. The
+// key is (bank << 24 | pc << 8 | opcode) + 1, so 0 marks an empty slot.
+struct Sample {
+    uint64_t key;
+    unsigned long long count;
+};
+
+struct Profile {
+    struct OpcodeProfile base[256];
+    struct OpcodeProfile cb[256];
+    struct Sample samples[PROFILE_SLOTS];
+    unsigned long long dropped_samples;
+
+    // Cycles of skipped idle loop iterations, with the samples falling
+    // into them, and those not yet taken out of the instruction which
+    // skipped them
+    unsigned long long idle_cycles;
+    unsigned long long idle_samples;
+    int pending_idle_cycles;
+
+    unsigned long long total_cycles;
+    unsigned long long next_sample;
+    uint64_t sample_state;
+
+    // The profile of the thread which started before
+    struct Profile* next;
+};
+
+// The profile of this thread, and those of all threads which counted
+static _Thread_local struct Profile* thread_profile;
+static struct Profile* profiles;
+static bool registered;
+
+static unsigned int sample_bank(uint64_t key) { return (key - 1) >> 24; }
+static WORD sample_pc(uint64_t key) { return (key - 1) >> 8; }
+static BYTE sample_opcode(uint64_t key) { return key - 1; }
+
+// Name of the memory a program counter is in, for the frames of the stacks
+static const char* region_name(WORD pc) {
+    if (pc < 0x8000) return "rom";
+    if (pc < 0xA000) return "vram";
+    if (pc < 0xC000) return "sram";
+    if (pc < 0xFE00) return "wram";
+    return "hram";
+}
+
+static void add_sample(struct Profile* profile, uint64_t key, unsigned long long count) {
+    unsigned int slot = (key * 0x9E3779B97F4A7C15ULL) >> 48 & (PROFILE_SLOTS - 1);
+    for (unsigned int probe = 0; probe < PROFILE_SLOTS; probe++) {
+        struct Sample* sample = &profile->samples[(slot + probe) & (PROFILE_SLOTS - 1)];
+        if (sample->key == key || sample->key == 0) {
+            sample->key = key;
+            sample->count += count;
+            return;
+        }
+    }
+    profile->dropped_samples += count;
+}
+
+static const struct OpcodeProfile* sorted_profile;
+
+// Order opcodes by the cycles spent in them, most first
+static int compare_opcodes(const void* a, const void* b) {
+    unsigned long long cycles_a = sorted_profile[*(const int*)a].cycles;
+    unsigned long long cycles_b = sorted_profile[*(const int*)b].cycles;
+    return (cycles_a < cycles_b) - (cycles_a > cycles_b);
+}
+
+// Order samples by their count, most first
+static int compare_samples(const void* a, const void* b) {
+    unsigned long long count_a = ((const struct Sample*)a)->count;
+    unsigned long long count_b = ((const struct Sample*)b)->count;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+static void report_opcodes(const char* title, const char* prefix, const struct OpcodeProfile* opcodes,
+                           unsigned long long total_cycles) {
+    int order[256];
+    for (int op = 0; op < 256; op++) {
+        order[op] = op;
+    }
+    sorted_profile = opcodes;
+    qsort(order, 256, sizeof(order[0]), compare_opcodes);
+
+    fprintf(stderr, "%s\n    opcode            count          cycles  share\n", title);
+    for (int ix = 0; ix < 256 && opcodes[order[ix]].count; ix++) {
+        const struct OpcodeProfile* entry = &opcodes[order[ix]];
+        char name[8];
+        snprintf(name, sizeof(name), "%s%02X", prefix, order[ix]);
+        fprintf(stderr, "    %-6s %16llu %15llu %5.1f%%\n", name, entry->count, entry->cycles,
+                total_cycles ? entry->cycles * 100.0 / total_cycles : 0.0);
+    }
+}
+
+// Add the counts of profile to merged
+static void merge_profile(struct Profile* merged, const struct Profile* profile) {
+    for (int op = 0; op < 256; op++) {
+        merged->base[op].count += profile->base[op].count;
+        merged->base[op].cycles += profile->base[op].cycles;
+        merged->cb[op].count += profile->cb[op].count;
+        merged->cb[op].cycles += profile->cb[op].cycles;
+    }
+    for (unsigned int slot = 0; slot < PROFILE_SLOTS; slot++) {
+        if (profile->samples[slot].key) {
+            add_sample(merged, profile->samples[slot].key, profile->samples[slot].count);
+        }
+    }
+    merged->dropped_samples += profile->dropped_samples;
+    merged->idle_cycles += profile->idle_cycles;
+    merged->idle_samples += profile->idle_samples;
+    merged->total_cycles += profile->total_cycles;
+}
+
+// Write the report of all threads and the folded stacks. The threads have
+// finished by the time the program exits.
+static void profile_dump(void) {
+    struct Profile* profile = calloc(1, sizeof(struct Profile));
+    if (profile == NULL) {
+        return;
+    }
+    for (struct Profile* other = __atomic_load_n(&profiles, __ATOMIC_ACQUIRE); other; other = other->next) {
+        merge_profile(profile, other);
+    }
+    struct Sample* samples = profile->samples;
+
+    unsigned long long instructions = 0;
+    for (int op = 0; op < 256; op++) {
+        instructions += profile->base[op].count;
+    }
+    fprintf(stderr, "Profile: %llu instructions, %llu cycles\n", instructions, profile->total_cycles);
+    fprintf(stderr, "Idle loops skipped: %llu cycles %5.1f%%\n", profile->idle_cycles,
+            profile->total_cycles ? profile->idle_cycles * 100.0 / profile->total_cycles : 0.0);
+    report_opcodes("Opcodes by cycles:", "", profile->base, profile->total_cycles);
+    report_opcodes("CB opcodes by cycles:", "CB ", profile->cb, profile->total_cycles);
+
+    // The used slots, most frequent first
+    unsigned int used = 0;
+    for (unsigned int slot = 0; slot < PROFILE_SLOTS; slot++) {
+        if (samples[slot].key) {
+            samples[used++] = samples[slot];
+        }
+    }
+    qsort(samples, used, sizeof(samples[0]), compare_samples);
+
+    unsigned long long sampled = profile->dropped_samples + profile->idle_samples;
+    for (unsigned int ix = 0; ix < used; ix++) {
+        sampled += samples[ix].count;
+    }
+    fprintf(stderr, "Hot program counters (%llu samples every %d cycles):\n", sampled, PROFILE_SAMPLE_PERIOD);
+    for (unsigned int ix = 0; ix < used && ix < PROFILE_REPORT_PCS; ix++) {
+        uint64_t key = samples[ix].key;
+        fprintf(stderr, "    %03X:%04X  %02X %16llu %5.1f%%\n", sample_bank(key), sample_pc(key), sample_opcode(key),
+                samples[ix].count, samples[ix].count * 100.0 / sampled);
+    }
+
+    // One stack per sampled address: the memory region and bank, the
+    // address and the opcode there. Skipped idle loops get a stack of their
+    // own.
+    FILE* folded = fopen(PROFILE_FOLDED_PATH, "w");
+    if (folded == NULL) {
+        fprintf(stderr, "Could not open %s\n", PROFILE_FOLDED_PATH);
+        free(profile);
+        return;
+    }
+    for (unsigned int ix = 0; ix < used; ix++) {
+        uint64_t key = samples[ix].key;
+        fprintf(folded, "%s_%03X;%03X:%04X;op_%02X %llu\n", region_name(sample_pc(key)), sample_bank(key),
+                sample_bank(key), sample_pc(key), sample_opcode(key), samples[ix].count);
+    }
+    if (profile->idle_samples) {
+        fprintf(folded, "idle %llu\n", profile->idle_samples);
+    }
+    fclose(folded);
+    free(profile);
+}
+
+// The profile of this thread, set up when it first counts. Returns NULL if
+// it could not be allocated.
+static struct Profile* get_profile(void) {
+    if (thread_profile == NULL) {
+        struct Profile* profile = calloc(1, sizeof(struct Profile));
+        if (profile == NULL) {
+            return NULL;
+        }
+        profile->next = __atomic_load_n(&profiles, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&profiles, &profile->next, profile, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        if (!__atomic_exchange_n(&registered, true, __ATOMIC_ACQ_REL)) {
+            atexit(profile_dump);
+        }
+        thread_profile = profile;
+    }
+    return thread_profile;
+}
+
+// Whether the clock of profile passed the next sample, which is then moved
+// on. The period is jittered, so loops running in step with it do not
+// always get sampled at the same instruction.
+static bool sample_due(struct Profile* profile) {
+    if (profile->total_cycles < profile->next_sample) {
+        return false;
+    }
+    profile->sample_state = profile->sample_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    profile->next_sample = profile->total_cycles + PROFILE_SAMPLE_PERIOD / 2
+        + (profile->sample_state >> 33) % PROFILE_SAMPLE_PERIOD;
+    return true;
+}
+
+unsigned int profile_bank(struct GameBoy* gb, WORD pc) {
+    if (pc < 0x4000) {
+        return gb->mmu.rom_bank0;
+    }
+    return pc < 0x8000 ? gb->mmu.rom_bank : 0;
+}
+
+void profile_idle(int cycles) {
+    struct Profile* profile = get_profile();
+    if (profile) {
+        profile->pending_idle_cycles += cycles;
+    }
+}
+
+void profile_instruction(WORD pc, unsigned int bank, BYTE op, WORD operand, int cycles) {
+    struct Profile* profile = get_profile();
+    if (profile == NULL) {
+        return;
+    }
+
+    int idle = profile->pending_idle_cycles;
+    profile->pending_idle_cycles = 0;
+    cycles -= idle;
+
+    struct OpcodeProfile* entry = op == 0xCB ? &profile->cb[operand & 0xFF] : &profile->base[op];
+    entry->count++;
+    entry->cycles += cycles;
+    if (op == 0xCB) {
+        profile->base[0xCB].count++;
+        profile->base[0xCB].cycles += cycles;
+    }
+
+    profile->total_cycles += cycles;
+    if (sample_due(profile)) {
+        add_sample(profile, ((uint64_t)bank << 24 | pc << 8 | op) + 1, 1);
+    }
+
+    // The samples during the skipped iterations, one per period
+    if (idle) {
+        profile->idle_cycles += idle;
+        profile->total_cycles += idle;
+        if (profile->total_cycles >= profile->next_sample) {
+            profile->idle_samples += (profile->total_cycles - profile->next_sample) / PROFILE_SAMPLE_PERIOD;
+        }
+        profile->idle_samples += sample_due(profile);
+    }
+}
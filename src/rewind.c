@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/rewind.h"
+
+// Keep a history of the states of gb in capacity bytes of deltas, recording
+// one every interval frames. All memory is allocated up front.
+bool rewind_init(struct Rewind* rewind, struct GameBoy* gb, size_t capacity, unsigned int interval) {
+    memset(rewind, 0, sizeof(*rewind));
+    rewind->interval = interval ? interval : 1;
+    rewind->state_size = savestate_size(gb);
+    rewind->capacity = capacity;
+    // Deltas of a whole frame are hardly ever smaller than this
+    rewind->max_entries = capacity / 256 + 1;
+
+    rewind->current = malloc(rewind->state_size);
+    rewind->next = malloc(rewind->state_size);
+    // A delta is at most 1.4 times the size of the state, see encode_delta
+    rewind->delta = malloc(rewind->state_size * 2 + 32);
+    rewind->buffer = malloc(capacity);
+    rewind->entries = malloc(rewind->max_entries * sizeof(struct RewindEntry));
+    if (!rewind->current || !rewind->next || !rewind->delta || !rewind->buffer || !rewind->entries) {
+        fprintf(stderr, "Could not allocate the rewind buffer\n");
+        rewind_free(rewind);
+        return false;
+    }
+    return true;
+}
+
+// Write v in 7 bit groups, the lowest first, with the top bit set on all
+// but the last one
+static BYTE* put_varint(BYTE* out, size_t v) {
+    while (v >= 0x80) {
+        *out++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *out++ = v;
+    return out;
+}
+
+static const BYTE* get_varint(const BYTE* in, size_t* v) {
+    *v = 0;
+    for (int shift = 0;; shift += 7) {
+        *v |= (size_t)(*in & 0x7F) << shift;
+        if (!(*in++ & 0x80)) {
+            return in;
+        }
+    }
+}
+
+static inline uint64_t load64(const BYTE* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Run length encode a ^ b into out, as pairs of a run of zero bytes, which
+// is only counted, and a run of literal bytes, which follow the pair.
+// Literal runs continue through fewer than REWIND_MIN_ZERO_RUN zeros, so
+// every pair but the first covers at least 5 bytes with at most 6 bytes
+// of counts. Returns the size of the encoded delta.
+static size_t encode_delta(const BYTE* a, const BYTE* b, size_t size, BYTE* out) {
+    BYTE* start = out;
+    size_t i = 0;
+    while (i < size) {
+        size_t zeros_start = i;
+        while (i + 8 <= size && load64(a + i) == load64(b + i)) {
+            i += 8;
+        }
+        while (i < size && a[i] == b[i]) {
+            i++;
+        }
+        size_t zeros = i - zeros_start;
+
+        size_t literal_start = i;
+        size_t equal = 0;
+        while (i < size && equal < REWIND_MIN_ZERO_RUN) {
+            equal = a[i] == b[i] ? equal + 1 : 0;
+            i++;
+        }
+        // The trailing equal bytes start the next zero run
+        i -= equal;
+
+        out = put_varint(out, zeros);
+        out = put_varint(out, i - literal_start);
+        for (size_t j = literal_start; j < i; j++) {
+            *out++ = a[j] ^ b[j];
+        }
+    }
+    return out - start;
+}
+
+// XOR the encoded delta into state
+static void apply_delta(BYTE* state, const BYTE* delta, size_t size) {
+    const BYTE* end = delta + size;
+    size_t i = 0;
+    while (delta < end) {
+        size_t zeros, literal;
+        delta = get_varint(delta, &zeros);
+        delta = get_varint(delta, &literal);
+        i += zeros;
+        while (literal--) {
+            state[i++] ^= *delta++;
+        }
+    }
+}
+
+static struct RewindEntry* entry(struct Rewind* rewind, unsigned int ix) {
+    return &rewind->entries[(rewind->first + ix) % rewind->max_entries];
+}
+
+// Store a delta in the ring, dropping the oldest ones to make room
+static void push_delta(struct Rewind* rewind, const BYTE* delta, size_t size) {
+    if (size > rewind->capacity) {
+        // Without this delta, none of the older states can be reached
+        rewind->count = 0;
+        return;
+    }
+    size_t end = 0;
+    if (rewind->count) {
+        struct RewindEntry* newest = entry(rewind, rewind->count - 1);
+        end = newest->offset + newest->size;
+    }
+    size_t offset = end + size > rewind->capacity ? 0 : end;
+
+    // Deltas are never split. When the new one starts over at the
+    // beginning of the buffer, the ones after the end are the oldest and
+    // go as well, since the history has to stay contiguous.
+    while (rewind->count) {
+        struct RewindEntry* oldest = entry(rewind, 0);
+        bool overlaps = oldest->offset < offset + size && oldest->offset + oldest->size > offset;
+        bool skipped = offset < end && oldest->offset >= end;
+        if (!overlaps && !skipped && rewind->count < rewind->max_entries) {
+            break;
+        }
+        rewind->first = (rewind->first + 1) % rewind->max_entries;
+        rewind->count--;
+    }
+
+    memcpy(rewind->buffer + offset, delta, size);
+    struct RewindEntry* added = entry(rewind, rewind->count++);
+    added->offset = offset;
+    added->size = size;
+}
+
+// Record the state of gb
+void rewind_record(struct Rewind* rewind, struct GameBoy* gb) {
+    savestate_save(gb, rewind->next, rewind->state_size);
+    if (rewind->has_current) {
+        // The delta turns the new state back into the previous one
+        size_t size = encode_delta((BYTE*)rewind->current, (BYTE*)rewind->next, rewind->state_size, rewind->delta);
+        push_delta(rewind, rewind->delta, size);
+    }
+    struct SaveState* previous = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = previous;
+    rewind->has_current = true;
+    rewind->frames = 0;
+}
+
+// Call once per frame, records the state of gb every interval frames
+void rewind_frame(struct Rewind* rewind, struct GameBoy* gb) {
+    if (++rewind->frames >= rewind->interval) {
+        rewind_record(rewind, gb);
+    }
+}
+
+// Go back to the most recent recorded state, which is removed from the
+// history. Returns false if there is none left.
+bool rewind_step_back(struct Rewind* rewind, struct GameBoy* gb) {
+    if (!rewind->has_current || !savestate_load(gb, rewind->current, rewind->state_size)) {
+        return false;
+    }
+    if (rewind->count) {
+        struct RewindEntry* newest = entry(rewind, --rewind->count);
+        apply_delta((BYTE*)rewind->current, rewind->buffer + newest->offset, newest->size);
+    } else {
+        rewind->has_current = false;
+    }
+    rewind->frames = 0;
+    return true;
+}
+
+void rewind_free(struct Rewind* rewind) {
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->delta);
+    free(rewind->buffer);
+    free(rewind->entries);
+    memset(rewind, 0, sizeof(*rewind));
+}
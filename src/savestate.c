@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/savestate.h"
+#include "../include/dma.h"
+
+// Bytes needed for a save state of the gameboy
+size_t savestate_size(struct GameBoy* gb) {
+    return sizeof(struct SaveState) + gb->mmu.mbc.ram_size;
+}
+
+// Save the state of the gameboy to state, which holds size bytes. Returns
+// the size of the state, or 0 if it does not fit. The state is written
+// in place, so snapshots can be taken without any allocation.
+size_t savestate_save(struct GameBoy* gb, struct SaveState* state, size_t size) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    struct MemoryBankController* mbc = &mmu->mbc;
+    size_t needed = savestate_size(gb);
+    if (size < needed) {
+        return 0;
+    }
+
+    memcpy(state->magic, SAVESTATE_MAGIC, sizeof(state->magic));
+    state->version = SAVESTATE_VERSION;
+    state->header_size = sizeof(struct SaveState);
+    state->global_checksum = gb->cart.global_checksum;
+    state->cartridge_type = gb->cart.type;
+    state->ram_size = mbc->ram_size;
+    state->boot_rom_hash = gb->boot_rom_hash;
+
+    state->cpu = gb->cpu;
+    state->buttons = gb->buttons;
+
+    state->now = gb->scheduler.now;
+    memcpy(state->events, gb->scheduler.heap, sizeof(state->events));
+    state->event_count = gb->scheduler.size;
+    memcpy(state->event_position, gb->scheduler.position, sizeof(state->event_position));
+
+    state->bios_mapped = mmu->bios_mapped;
+    state->rom_bank0 = mmu->rom_bank0;
+    state->ram_enabled = mbc->ram_enabled;
+    state->rom_bank = mbc->rom_bank;
+    state->ram_bank = mbc->ram_bank;
+    state->advanced_mode = mbc->advanced_mode;
+    state->rtc_register = mbc->rtc_register;
+    state->rtc = mbc->rtc;
+
+    state->timer = gb->timer;
+
+    state->window_line = gb->ppu.window_line;
+    state->frames = gb->ppu.frames;
+    memcpy(state->framebuffer, gb->ppu.framebuffer, sizeof(state->framebuffer));
+
+    memcpy(state->memory, mmu->mem + 0x8000, sizeof(state->memory));
+    if (mbc->ram_size) {
+        memcpy(state->ram, mbc->ram, mbc->ram_size);
+    }
+    // Pages a fork still shares with its parent are stale in its own memory
+    for (unsigned int page = 0; page < 0x2000 / PAGE_SIZE; page++) {
+        if (mmu->shared_wram[page]) {
+            memcpy(state->memory + 0x4000 + page * PAGE_SIZE, mmu->shared_wram[page], PAGE_SIZE);
+        }
+    }
+    for (unsigned int page = 0; page < mbc->ram_size >> 8; page++) {
+        if (mbc->shared_ram[page]) {
+            memcpy(state->ram + (page << 8), mbc->shared_ram[page], 0x100);
+        }
+    }
+    return needed;
+}
+
+// Load a state saved by savestate_save into a gameboy running the same
+// cartridge. Returns false, leaving the gameboy untouched, if the state is
+// from an other version, build or cartridge, or still runs an other boot
+// rom, or if forks still share the memory it would overwrite. A fork gets
+// all of its memory of its own, and only keeps the cartridge of its parent.
+bool savestate_load(struct GameBoy* gb, const struct SaveState* state, size_t size) {
+    struct MemoryManagementUnit* mmu = &gb->mmu;
+    struct MemoryBankController* mbc = &mmu->mbc;
+    if (size < sizeof(struct SaveState)
+            || memcmp(state->magic, SAVESTATE_MAGIC, sizeof(state->magic)) != 0
+            || state->version != SAVESTATE_VERSION
+            || state->header_size != sizeof(struct SaveState)) {
+        fprintf(stderr, "Incompatible save state\n");
+        return false;
+    }
+    if (state->global_checksum != gb->cart.global_checksum
+            || state->cartridge_type != gb->cart.type
+            || state->ram_size != mbc->ram_size
+            || size < sizeof(struct SaveState) + state->ram_size) {
+        fprintf(stderr, "Save state is for a different cartridge\n");
+        return false;
+    }
+    if (gb->sharing) {
+        fprintf(stderr, "Save state can not be loaded while forks share the memory\n");
+        return false;
+    }
+    // Once the boot rom is unmapped, it does not matter which one ran
+    if (state->bios_mapped && state->boot_rom_hash != gb->boot_rom_hash) {
+        fprintf(stderr, "Save state is for a different boot rom\n");
+        return false;
+    }
+
+    gb->cpu = state->cpu;
+    gb->buttons = state->buttons;
+
+    // The current batch, if any, ends with the load
+    gb->scheduler.now = state->now;
+    gb->scheduler.deadline = state->now;
+    memcpy(gb->scheduler.heap, state->events, sizeof(state->events));
+    gb->scheduler.size = state->event_count;
+    memcpy(gb->scheduler.position, state->event_position, sizeof(state->event_position));
+
+    mmu->bios_mapped = state->bios_mapped;
+    mbc->ram_enabled = state->ram_enabled;
+    mbc->rom_bank = state->rom_bank;
+    mbc->ram_bank = state->ram_bank;
+    mbc->advanced_mode = state->advanced_mode;
+    mbc->rtc_register = state->rtc_register;
+    mbc->rtc = state->rtc;
+
+    gb->timer = state->timer;
+
+    gb->ppu.window_line = state->window_line;
+    gb->ppu.frames = state->frames;
+    memcpy(gb->ppu.framebuffer, state->framebuffer, sizeof(state->framebuffer));
+
+    mmu_invalidate_code(mmu);
+    memset(&gb->idle, 0, sizeof(gb->idle));
+    memcpy(mmu->mem + 0x8000, state->memory, sizeof(state->memory));
+    if (state->ram_size) {
+        memcpy(mbc->ram, state->ram, state->ram_size);
+    }
+
+    // The page tables point into this gameboy, so they are derived from
+    // the restored bank registers instead of being part of the state
+    mmu_map_rom_bank0(mmu, state->rom_bank0);
+    mmu_share_wram(mmu, NULL);
+    mbc_remap(mmu);
+    if (gb->shares_parent) {
+        gb->parent->sharing--;
+        gb->shares_parent = false;
+    }
+    dma_remap(gb);
+    ppu_invalidate_tiles(gb);
+    return true;
+}
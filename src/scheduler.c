@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../include/scheduler.h"
+#include "../include/gameboy.h"
+
+static void swap(struct Scheduler* scheduler, int a, int b) {
+    struct Event tmp = scheduler->heap[a];
+    scheduler->heap[a] = scheduler->heap[b];
+    scheduler->heap[b] = tmp;
+    scheduler->position[scheduler->heap[a].type] = a;
+    scheduler->position[scheduler->heap[b].type] = b;
+}
+
+// Restore the heap order for the event at ix
+static void sift(struct Scheduler* scheduler, int ix) {
+    while (ix > 0 && scheduler->heap[ix].time < scheduler->heap[(ix - 1) / 2].time) {
+        swap(scheduler, ix, (ix - 1) / 2);
+        ix = (ix - 1) / 2;
+    }
+    for (;;) {
+        int smallest = ix;
+        for (int child = 2 * ix + 1; child <= 2 * ix + 2 && child < scheduler->size; child++) {
+            if (scheduler->heap[child].time < scheduler->heap[smallest].time) {
+                smallest = child;
+            }
+        }
+        if (smallest == ix) {
+            return;
+        }
+        swap(scheduler, ix, smallest);
+        ix = smallest;
+    }
+}
+
+void scheduler_init(struct Scheduler* scheduler) {
+    scheduler->now = 0;
+    scheduler->deadline = 0;
+    scheduler->size = 0;
+    for (int type = 0; type < EVENT_COUNT; type++) {
+        scheduler->position[type] = -1;
+    }
+}
+
+void scheduler_set_handler(struct Scheduler* scheduler, enum EventType type, event_handler handler) {
+    scheduler->handlers[type] = handler;
+}
+
+// Schedule the event at the given time, replacing a pending one of
+// the same type
+void scheduler_schedule(struct Scheduler* scheduler, enum EventType type, unsigned long long time) {
+    int ix = scheduler->position[type];
+    if (ix < 0) {
+        ix = scheduler->size++;
+        scheduler->heap[ix].type = type;
+        scheduler->position[type] = ix;
+    }
+    scheduler->heap[ix].time = time;
+    sift(scheduler, ix);
+
+    // An event scheduled during a batch can end it early
+    if (time < scheduler->deadline) {
+        scheduler->deadline = time;
+    }
+}
+
+void scheduler_cancel(struct Scheduler* scheduler, enum EventType type) {
+    int ix = scheduler->position[type];
+    if (ix < 0) {
+        return;
+    }
+    swap(scheduler, ix, --scheduler->size);
+    scheduler->position[type] = -1;
+    if (ix < scheduler->size) {
+        sift(scheduler, ix);
+    }
+}
+
+// End the current batch after this instruction, e.g. because the
+// interrupt state changed
+void scheduler_end_batch(struct Scheduler* scheduler) {
+    scheduler->deadline = scheduler->now;
+}
+
+// Update the pending interrupts of the cpu after IE or IF changed. An
+// interrupt which just became pending ends the batch, so it is serviced, or
+// ends HALT, right after the current instruction.
+void update_pending_interrupts(struct GameBoy* gb) {
+    BYTE pending = gb->mmu.Interrupts & gb->mmu.io[0x0F] & 0x1F;
+    if (pending & ~gb->cpu.interrupts_pending) {
+        scheduler_end_batch(&gb->scheduler);
+    }
+    gb->cpu.interrupts_pending = pending;
+}
+
+// Set the bit of the interrupt in IF
+void request_interrupt(struct GameBoy* gb, int interrupt) {
+    gb->mmu.io[0x0F] |= 1 << interrupt;
+    update_pending_interrupts(gb);
+}
+
+// Write IF (0xFF0F) or IE (0xFFFF). IF only has the lower five bits.
+void write_interrupt_register(struct GameBoy* gb, WORD addr, BYTE data) {
+    gb->mmu.mem[addr] = addr == 0xFF0F ? data & 0x1F : data;
+    update_pending_interrupts(gb);
+}
+
+// Run all events which are due
+static void run_events(struct GameBoy* gb) {
+    struct Scheduler* scheduler = &gb->scheduler;
+    while (scheduler->size > 0 && scheduler->heap[0].time <= scheduler->now) {
+        struct Event event = scheduler->heap[0];
+        scheduler_cancel(scheduler, event.type);
+        scheduler->handlers[event.type](gb, event.time);
+    }
+}
+
+// Run the emulation until the clock reaches target. The cpu runs in
+// batches up to the next event, instead of updating every peripheral
+// after every instruction.
+void scheduler_run_until(struct GameBoy* gb, unsigned long long target) {
+    struct Processor* cpu = &gb->cpu;
+    struct Scheduler* scheduler = &gb->scheduler;
+    // Children read the memory of their parent as it was at the fork
+    assert(gb->sharing == 0);
+    while (scheduler->now < target) {
+        scheduler->deadline = target;
+        if (scheduler->size > 0 && scheduler->heap[0].time < target) {
+            scheduler->deadline = scheduler->heap[0].time;
+        }
+
+        // Memory may have changed since the last batch, so an idle loop
+        // has to run once more before it is skipped
+        gb->idle.disturbed = true;
+        if (cpu->is_halted) {
+            // Only an event can request the interrupt which ends HALT (or
+            // STOP), so skip straight to the next one instead of idling.
+            // Events which do not wake the cpu just lead to the next skip.
+            // An interrupt requested between two runs, like a button press
+            // of the front end, is already pending and wakes the cpu now.
+            if (!cpu->interrupts_pending && scheduler->deadline > scheduler->now) {
+                scheduler->now = scheduler->deadline;
+            }
+        } else {
+            cpu_run(gb);
+        }
+
+        // EI takes effect after the instruction following it, unless that
+        // is DI
+        if (cpu->enable_interrupts_instruction) {
+            if (!cpu->is_halted) {
+                scheduler->now += execute_next(gb);
+            }
+            cpu->interrupts_enabled = cpu->enable_interrupts_instruction;
+            cpu->enable_interrupts_instruction = false;
+        }
+
+        run_events(gb);
+        if (cpu->interrupts_pending) {
+            scheduler->now += cpu_service_interrupts(gb);
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#include "../include/serial.h"
+#include "../include/scheduler.h"
+#include "../include/gameboy.h"
+
+#define SB 0x01
+#define SC 0x02
+
+// The transfer is done. Without a link partner every bit shifted in is 1.
+static void transfer_done(struct GameBoy* gb, unsigned long long time) {
+    gb->mmu.io[SB] = 0xFF;
+    gb->mmu.io[SC] &= 0x7F;
+    request_interrupt(gb, INTERRUPT_SERIAL);
+}
+
+void serial_init(struct GameBoy* gb) {
+    scheduler_set_handler(&gb->scheduler, EVENT_SERIAL, transfer_done);
+}
+
+// Writing SC with bit 7 set starts a transfer. Only the internal clock is
+// emulated, with an external one the transfer never completes.
+void serial_write_control(struct GameBoy* gb, BYTE data) {
+    gb->mmu.io[SC] = data;
+    if ((data & 0x81) == 0x81) {
+        scheduler_schedule(&gb->scheduler, EVENT_SERIAL, gb->scheduler.now + 8 * SERIAL_CYCLES_PER_BIT);
+    } else {
+        scheduler_cancel(&gb->scheduler, EVENT_SERIAL);
+    }
+}
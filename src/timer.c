@@ -0,0 +1,135 @@
+#include "../include/timer.h"
+#include "../include/scheduler.h"
+#include "../include/gameboy.h"
+
+#define DIV 0x04
+#define TIMA 0x05
+#define TMA 0x06
+#define TAC 0x07
+
+#define TAC_ENABLE (1 << 2)
+
+// Clock cycles between two increments of TIMA for each clock select of TAC.
+// TIMA counts when the divider bit half a period below falls.
+static const unsigned int periods[] = {1024, 16, 64, 256};
+
+static unsigned int period(struct GameBoy* gb) {
+    return periods[gb->mmu.io[TAC] & 3];
+}
+
+// The 16 bit divider at time
+static WORD divider(struct GameBoy* gb, unsigned long long time) {
+    return time - gb->timer.divider_base;
+}
+
+// Increments of TIMA since it was brought up to date
+static unsigned long long ticks(struct GameBoy* gb, unsigned long long time) {
+    struct Timer* timer = &gb->timer;
+    if (!(gb->mmu.io[TAC] & TAC_ENABLE)) {
+        return 0;
+    }
+    return (time - timer->divider_base) / period(gb) - (timer->counter_base - timer->divider_base) / period(gb);
+}
+
+// TIMA at time. An overflow reloads TMA, which the event does on time, but
+// an instruction may read TIMA just before the event runs.
+static BYTE counter(struct GameBoy* gb, unsigned long long time) {
+    unsigned long long value = gb->mmu.io[TIMA] + ticks(gb, time);
+    while (value > 0xFF) {
+        value = gb->mmu.io[TMA] + value - 0x100;
+    }
+    return value;
+}
+
+// Bring io[TIMA] up to date with the clock
+static void sync_counter(struct GameBoy* gb) {
+    unsigned long long now = gb->scheduler.now;
+    gb->mmu.io[TIMA] = counter(gb, now);
+    gb->timer.counter_base = now;
+}
+
+// Schedule the overflow of TIMA, which has to be up to date
+static void schedule_overflow(struct GameBoy* gb) {
+    struct Timer* timer = &gb->timer;
+    if (!(gb->mmu.io[TAC] & TAC_ENABLE)) {
+        scheduler_cancel(&gb->scheduler, EVENT_TIMER);
+        return;
+    }
+    unsigned long long increments = (timer->counter_base - timer->divider_base) / period(gb) + 0x100 - gb->mmu.io[TIMA];
+    scheduler_schedule(&gb->scheduler, EVENT_TIMER, timer->divider_base + increments * period(gb));
+}
+
+// TIMA overflowed: reload it from TMA and request the interrupt
+static void overflow(struct GameBoy* gb, unsigned long long time) {
+    gb->mmu.io[TIMA] = gb->mmu.io[TMA];
+    gb->timer.counter_base = time;
+    request_interrupt(gb, INTERRUPT_TIMER);
+    schedule_overflow(gb);
+}
+
+// Increment TIMA outside of the regular ticks, when a write makes the bit
+// it counts fall
+static void increment_counter(struct GameBoy* gb) {
+    if (gb->mmu.io[TIMA] == 0xFF) {
+        gb->mmu.io[TIMA] = gb->mmu.io[TMA];
+        request_interrupt(gb, INTERRUPT_TIMER);
+        scheduler_end_batch(&gb->scheduler);
+    } else {
+        gb->mmu.io[TIMA]++;
+    }
+}
+
+// Whether the divider bit TIMA counts the falling edges of is set
+static bool counted_bit(struct GameBoy* gb) {
+    return (gb->mmu.io[TAC] & TAC_ENABLE) && (divider(gb, gb->scheduler.now) & (period(gb) / 2));
+}
+
+void timer_init(struct GameBoy* gb) {
+    scheduler_set_handler(&gb->scheduler, EVENT_TIMER, overflow);
+}
+
+BYTE timer_read(struct GameBoy* gb, WORD addr) {
+    switch (addr & 0xFF) {
+        case DIV:
+            return divider(gb, gb->scheduler.now) >> 8;
+        case TIMA:
+            return counter(gb, gb->scheduler.now);
+        case TAC:
+            return gb->mmu.io[TAC] | 0xF8;
+        default:
+            return gb->mmu.io[addr & 0xFF];
+    }
+}
+
+void timer_write(struct GameBoy* gb, WORD addr, BYTE data) {
+    switch (addr & 0xFF) {
+        case DIV:
+            // Any write resets the divider, which is a falling edge if the
+            // counted bit was set
+            sync_counter(gb);
+            if (counted_bit(gb)) {
+                increment_counter(gb);
+            }
+            gb->timer.divider_base = gb->scheduler.now;
+            break;
+        case TIMA:
+            sync_counter(gb);
+            gb->mmu.io[TIMA] = data;
+            break;
+        case TMA:
+            gb->mmu.io[TMA] = data;
+            return;
+        case TAC: {
+            // Disabling the timer or selecting an other bit is a falling
+            // edge as well if the counted bit was set and the new one is not
+            sync_counter(gb);
+            bool was_set = counted_bit(gb);
+            gb->mmu.io[TAC] = data & 0x07;
+            if (was_set && !counted_bit(gb)) {
+                increment_counter(gb);
+            }
+            break;
+        }
+    }
+    schedule_overflow(gb);
+}
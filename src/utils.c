@@ -1,6 +1,14 @@
 #include "../include/mmu.h"
 
+// Combine a high and a low byte into a word
 WORD bytes_to_word(BYTE a, BYTE b) {
-    // TODO: is this the right order?
     return ((WORD)a << 8) + b;
 }
+
+// Continue the FNV-1a hash with size bytes of data
+uint64_t hash_bytes(uint64_t hash, const BYTE* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
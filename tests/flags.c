@@ -0,0 +1,274 @@
+#include "test.h"
+
+// The cpu evaluates Z, N and H lazily. These tests run instructions on the
+// emulated cpu for every combination of operands and compare the flags,
+// read back through PUSH AF, with the eager semantics computed here.
+
+// Masks of the flags in F
+#define F_Z (1 << FLAG_Z)
+#define F_N (1 << FLAG_N)
+#define F_H (1 << FLAG_H)
+#define F_C (1 << FLAG_C)
+
+// Where the code under test is placed, and the stack it passes AF on
+#define CODE 0xC000
+#define STACK 0xD000
+
+static struct GameBoy gb;
+
+// Place code in work ram and run it to its end with AF taken from the
+// stack: every program starts with POP AF and ends with PUSH AF, so F is
+// passed in and out the way a game would see it. Returns the AF which was
+// pushed.
+static WORD run(const BYTE* code, size_t size, WORD af) {
+    for (size_t ix = 0; ix < size; ix++) {
+        mmu_write(&gb, CODE + ix, code[ix]);
+    }
+    mmu_write_word(&gb, STACK - 2, af);
+    gb.cpu.SP = STACK - 2;
+    gb.cpu.PC = CODE;
+    while (gb.cpu.PC != CODE + size) {
+        execute_next(&gb);
+    }
+    return mmu_read_word(&gb, STACK - 2);
+}
+
+static BYTE flags(bool z, bool n, bool h, bool c) {
+    return (z ? F_Z : 0) | (n ? F_N : 0) | (h ? F_H : 0) | (c ? F_C : 0);
+}
+
+// Eager flags of ADD and ADC
+static BYTE add_flags(BYTE a, BYTE b, int carry) {
+    return flags((BYTE)(a + b + carry) == 0, false, (a & 0xF) + (b & 0xF) + carry > 0xF, a + b + carry > 0xFF);
+}
+
+// Eager flags of SUB, SBC and CP
+static BYTE sub_flags(BYTE a, BYTE b, int carry) {
+    return flags((BYTE)(a - b - carry) == 0, true, (a & 0xF) < (b & 0xF) + carry, a < b + carry);
+}
+
+// The result of DAA with its flags, after an operation which left a and f
+static WORD daa(BYTE a, BYTE f) {
+    bool carry = f & F_C;
+    if (f & F_N) {
+        if (carry) {
+            a -= 0x60;
+        }
+        if (f & F_H) {
+            a -= 0x06;
+        }
+    } else {
+        if (carry || a > 0x99) {
+            a += 0x60;
+            carry = true;
+        }
+        if ((f & F_H) || (a & 0xF) > 0x9) {
+            a += 0x06;
+        }
+    }
+    return a << 8 | flags(a == 0, f & F_N, false, carry);
+}
+
+// ADD, ADC, SUB, SBC and CP with register B, followed by a conditional jump
+// which reads Z without the other flags being computed: C is 1 if it was
+// not taken
+static void check_alu(BYTE op, bool with_carry, bool subtract, bool keep_a) {
+    const BYTE code[] = {
+        0xF1,           // POP AF
+        op,             // op A,B
+        0x0E, 0x00,     // LD C,00
+        0x20, 0x02,     // JR NZ,+2
+        0x0E, 0x01,     // LD C,01
+        0xF5,           // PUSH AF
+    };
+    for (int carry_in = 0; carry_in <= 1; carry_in++) {
+        for (int a = 0; a < 0x100; a++) {
+            for (int b = 0; b < 0x100; b++) {
+                gb.cpu.B = b;
+                WORD af = run(code, sizeof(code), a << 8 | (carry_in ? F_C : 0));
+                int carry = with_carry && carry_in;
+                BYTE expected = subtract ? sub_flags(a, b, carry) : add_flags(a, b, carry);
+                BYTE result = keep_a ? a : subtract ? a - b - carry : a + b + carry;
+                if (!CHECK((af & 0xFF) == expected) || !CHECK(af >> 8 == result)
+                        || !CHECK(gb.cpu.C == ((expected & F_Z) != 0))) {
+                    fprintf(stderr, "    op %02X a %02X b %02X carry %d: AF %04X, expected F %02X\n",
+                            op, a, b, carry_in, af, expected);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void test_add() {
+    check_alu(0x80, false, false, false);
+}
+
+static void test_adc() {
+    check_alu(0x88, true, false, false);
+}
+
+static void test_sub() {
+    check_alu(0x90, false, true, false);
+}
+
+static void test_sbc() {
+    check_alu(0x98, true, true, false);
+}
+
+static void test_cp() {
+    check_alu(0xB8, false, true, true);
+}
+
+// The operands of INC and DEC: A, which the decoder treats apart, B and
+// (HL)
+enum Operand { OPERAND_A, OPERAND_B, OPERAND_HL };
+#define HL_ADDR 0xC800
+
+// INC and DEC never change the carry flag
+static void check_inc_dec(BYTE op, enum Operand operand, bool decrement) {
+    const BYTE code[] = {
+        0xF1,           // POP AF
+        op,
+        0xF5,           // PUSH AF
+    };
+    for (int carry_in = 0; carry_in <= 1; carry_in++) {
+        // All other flags set, so only the carry may be left over
+        BYTE f = F_Z | F_N | F_H | (carry_in ? F_C : 0);
+        for (int value = 0; value < 0x100; value++) {
+            BYTE a = operand == OPERAND_A ? value : 0x5A;
+            gb.cpu.B = value;
+            gb.cpu.HL = HL_ADDR;
+            mmu_write(&gb, HL_ADDR, value);
+            WORD af = run(code, sizeof(code), a << 8 | f);
+            BYTE result = decrement ? value - 1 : value + 1;
+            bool half = decrement ? (value & 0xF) == 0 : (value & 0xF) == 0xF;
+            BYTE expected = flags(result == 0, decrement, half, carry_in);
+            BYTE actual = operand == OPERAND_A ? af >> 8 : operand == OPERAND_B ? gb.cpu.B : mmu_read(&gb, HL_ADDR);
+            if (!CHECK((af & 0xFF) == expected) || !CHECK(actual == result)) {
+                fprintf(stderr, "    op %02X value %02X carry %d: AF %04X, expected F %02X\n",
+                        op, value, carry_in, af, expected);
+                return;
+            }
+        }
+    }
+}
+
+static void test_inc_preserves_carry() {
+    check_inc_dec(0x3C, OPERAND_A, false);
+    check_inc_dec(0x04, OPERAND_B, false);
+    check_inc_dec(0x34, OPERAND_HL, false);
+}
+
+static void test_dec_preserves_carry() {
+    check_inc_dec(0x3D, OPERAND_A, true);
+    check_inc_dec(0x05, OPERAND_B, true);
+    check_inc_dec(0x35, OPERAND_HL, true);
+}
+
+// BIT sets Z from the tested bit, clears N, sets H and keeps the carry
+static void test_bit() {
+    for (int bit = 0; bit < 8; bit++) {
+        const BYTE code[] = {
+            0xF1,                       // POP AF
+            0xCB, 0x40 | bit << 3,      // BIT bit,B
+            0xF5,                       // PUSH AF
+        };
+        for (int carry_in = 0; carry_in <= 1; carry_in++) {
+            for (int value = 0; value < 0x100; value++) {
+                gb.cpu.B = value;
+                WORD af = run(code, sizeof(code), 0x1200 | F_N | (carry_in ? F_C : 0));
+                BYTE expected = flags(!(value & (1 << bit)), false, true, carry_in);
+                if (!CHECK((af & 0xFF) == expected)) {
+                    fprintf(stderr, "    BIT %d value %02X carry %d: F %02X, expected %02X\n",
+                            bit, value, carry_in, af & 0xFF, expected);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// DAA right after an addition or subtraction, whose flags it reads
+static void check_daa(BYTE op, bool subtract) {
+    const BYTE code[] = {
+        0xF1,           // POP AF
+        op,             // ADD A,B or SUB B
+        0x27,           // DAA
+        0xF5,           // PUSH AF
+    };
+    for (int a = 0; a < 0x100; a++) {
+        for (int b = 0; b < 0x100; b++) {
+            gb.cpu.B = b;
+            WORD af = run(code, sizeof(code), a << 8);
+            BYTE result = subtract ? a - b : a + b;
+            WORD expected = daa(result, subtract ? sub_flags(a, b, 0) : add_flags(a, b, 0));
+            if (!CHECK(af == expected)) {
+                fprintf(stderr, "    op %02X a %02X b %02X: AF %04X, expected %04X\n", op, a, b, af, expected);
+                return;
+            }
+        }
+    }
+}
+
+static void test_daa_after_add() {
+    check_daa(0x80, false);
+}
+
+static void test_daa_after_sub() {
+    check_daa(0x90, true);
+}
+
+// POP AF loads the flags as they are, except that the low nibble of F does
+// not exist, and PUSH AF writes them back
+static void test_push_pop_af() {
+    const BYTE code[] = {
+        0xF1,           // POP AF
+        0xF5,           // PUSH AF
+    };
+    for (int af = 0; af < 0x10000; af++) {
+        WORD pushed = run(code, sizeof(code), af);
+        if (!CHECK(pushed == (af & 0xFFF0))) {
+            fprintf(stderr, "    AF %04X pushed as %04X\n", af, pushed);
+            return;
+        }
+    }
+
+    // Flags left lazy by an operation are written back computed, and POP AF
+    // replaces them
+    const BYTE lazy[] = {
+        0xF1,           // POP AF
+        0x90,           // SUB B
+        0xF5,           // PUSH AF
+        0xF1,           // POP AF
+        0xF5,           // PUSH AF
+    };
+    gb.cpu.B = 0x01;
+    CHECK(run(lazy, 3, 0x1000) == (0x0F00 | F_N | F_H));
+    CHECK(run(lazy, sizeof(lazy), 0x1000) == (0x0F00 | F_N | F_H));
+}
+
+int main() {
+    // JR -2, the code under test is placed and run by itself
+    static const BYTE idle[] = { 0x18, 0xFE };
+    if (!test_init(&gb, idle, sizeof(idle))) {
+        return 1;
+    }
+    // Nothing but the code under test runs
+    mmu_write(&gb, 0xFF40, 0x00);
+    mmu_write(&gb, 0xFFFF, 0x00);
+
+    RUN_TEST(test_add);
+    RUN_TEST(test_adc);
+    RUN_TEST(test_sub);
+    RUN_TEST(test_sbc);
+    RUN_TEST(test_cp);
+    RUN_TEST(test_inc_preserves_carry);
+    RUN_TEST(test_dec_preserves_carry);
+    RUN_TEST(test_bit);
+    RUN_TEST(test_daa_after_add);
+    RUN_TEST(test_daa_after_sub);
+    RUN_TEST(test_push_pop_af);
+    gameboy_free(&gb);
+    return TEST_REPORT();
+}
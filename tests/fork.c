@@ -0,0 +1,181 @@
+#include <pthread.h>
+#include "test.h"
+#include "../include/savestate.h"
+
+#define FRAMES 60
+
+static struct GameBoy parent;
+static struct GameBoy child;
+static struct GameBoy sibling;
+
+// Run a copy of the parent from its current state for the given frames,
+// without running the parent itself, and return the hash it ends with
+static uint64_t run_copy(long frames) {
+    static struct GameBoy copy;
+    size_t size = savestate_size(&parent);
+    struct SaveState* state = malloc(size);
+    uint64_t hash = 0;
+    savestate_save(&parent, state, size);
+    if (CHECK(test_init_workload(&copy)) && CHECK(savestate_load(&copy, state, size))) {
+        gameboy_run_frames(&copy, frames);
+        hash = test_hash(&copy);
+        gameboy_free(&copy);
+    }
+    free(state);
+    return hash;
+}
+
+// A child runs exactly like its parent would have, and the parent runs on
+// the same way once the child is freed
+static void test_child_runs_like_parent() {
+    if (!CHECK(test_init_workload(&parent))) {
+        return;
+    }
+    gameboy_run_frames(&parent, 20);
+    uint64_t expected = run_copy(FRAMES);
+
+    gameboy_fork(&parent, &child);
+    CHECK(parent.children == 1);
+    CHECK(gameboy_memory_hash(&child) == gameboy_memory_hash(&parent));
+    CHECK(gameboy_framebuffer_hash(&child) == gameboy_framebuffer_hash(&parent));
+    // The rom is not decoded again
+    CHECK(child.mmu.rom_code == parent.mmu.rom_code && child.mmu.code_pages[0x01] == parent.mmu.code_pages[0x01]);
+    gameboy_run_frames(&child, FRAMES);
+    CHECK(test_hash(&child) == expected);
+    gameboy_free(&child);
+    CHECK(parent.children == 0);
+
+    gameboy_run_frames(&parent, FRAMES);
+    CHECK(test_hash(&parent) == expected);
+    gameboy_free(&parent);
+}
+
+// Children share the memory of the parent copy on write, so what one child
+// writes is neither seen by the parent nor by its siblings
+static void test_copy_on_write() {
+    if (!CHECK(test_init_workload(&parent))) {
+        return;
+    }
+    gameboy_run_frames(&parent, 20);
+    uint64_t parent_memory = gameboy_memory_hash(&parent);
+    uint64_t expected = run_copy(FRAMES);
+
+    gameboy_fork(&parent, &child);
+    gameboy_fork(&parent, &sibling);
+    CHECK(parent.children == 2);
+    BYTE value = mmu_read(&parent, 0xD123);
+    mmu_write(&child, 0xD123, value ^ 0xFF);
+    CHECK(mmu_read(&child, 0xD123) == (value ^ 0xFF));
+    CHECK(mmu_read(&sibling, 0xD123) == value);
+    CHECK(mmu_read(&parent, 0xD123) == value);
+
+    gameboy_run_frames(&child, FRAMES);
+    gameboy_run_frames(&sibling, FRAMES);
+    CHECK(test_hash(&sibling) == expected);
+    CHECK(gameboy_memory_hash(&parent) == parent_memory);
+    gameboy_free(&child);
+    gameboy_free(&sibling);
+    gameboy_free(&parent);
+}
+
+// A fork of a fork, and a child which is forked again, run like the
+// parent too
+static void test_forks_of_forks() {
+    if (!CHECK(test_init_workload(&parent))) {
+        return;
+    }
+    gameboy_run_frames(&parent, 20);
+    uint64_t expected = run_copy(2 * FRAMES);
+
+    gameboy_fork(&parent, &child);
+    gameboy_run_frames(&child, FRAMES);
+    gameboy_fork(&child, &sibling);
+    CHECK(child.children == 1);
+    gameboy_run_frames(&sibling, FRAMES);
+    CHECK(test_hash(&sibling) == expected);
+
+    // The grandchild is forked again from the parent
+    gameboy_fork(&parent, &sibling);
+    CHECK(child.children == 0);
+    CHECK(parent.children == 2);
+    gameboy_run_frames(&sibling, 2 * FRAMES);
+    CHECK(test_hash(&sibling) == expected);
+
+    gameboy_free(&sibling);
+    gameboy_free(&child);
+    CHECK(parent.children == 0);
+    gameboy_free(&parent);
+}
+
+// A parent can not load a state over the memory its children share. A
+// child which loads one stops sharing, so the parent may run again, but
+// still uses its cartridge.
+static void test_load_state() {
+    if (!CHECK(test_init_workload(&parent))) {
+        return;
+    }
+    gameboy_run_frames(&parent, 20);
+    size_t size = savestate_size(&parent);
+    struct SaveState* state = malloc(size);
+    savestate_save(&parent, state, size);
+    gameboy_run_frames(&parent, 10);
+    uint64_t expected = run_copy(FRAMES);
+
+    gameboy_fork(&parent, &child);
+    uint64_t parent_memory = gameboy_memory_hash(&parent);
+    CHECK(!savestate_load(&parent, state, size));
+    CHECK(gameboy_memory_hash(&parent) == parent_memory);
+    CHECK(parent.sharing == 1);
+
+    CHECK(savestate_load(&child, state, size));
+    CHECK(parent.sharing == 0 && parent.children == 1);
+    gameboy_run_frames(&parent, FRAMES);
+    CHECK(test_hash(&parent) == expected);
+    gameboy_run_frames(&child, 10 + FRAMES);
+    CHECK(test_hash(&child) == expected);
+
+    gameboy_free(&child);
+    CHECK(parent.children == 0);
+    gameboy_free(&parent);
+    free(state);
+}
+
+static void* run_frames(void* gb) {
+    gameboy_run_frames(gb, FRAMES);
+    return NULL;
+}
+
+// Forks of one parent run on threads of their own, decoding the rom they
+// share at the same time. The parent is forked after its first few
+// instructions, so the vblank handler is not decoded yet.
+static void test_forks_on_threads() {
+    if (!CHECK(test_init_workload(&parent))) {
+        return;
+    }
+    scheduler_run_until(&parent, 64);
+    uint64_t expected = run_copy(FRAMES);
+
+    gameboy_fork(&parent, &child);
+    gameboy_fork(&parent, &sibling);
+    pthread_t threads[2];
+    CHECK(pthread_create(&threads[0], NULL, run_frames, &child) == 0);
+    CHECK(pthread_create(&threads[1], NULL, run_frames, &sibling) == 0);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    CHECK(test_hash(&child) == expected);
+    CHECK(test_hash(&sibling) == expected);
+    CHECK(child.mmu.code_pages[0x00] == sibling.mmu.code_pages[0x00]);
+
+    gameboy_free(&child);
+    gameboy_free(&sibling);
+    gameboy_free(&parent);
+}
+
+int main() {
+    RUN_TEST(test_child_runs_like_parent);
+    RUN_TEST(test_copy_on_write);
+    RUN_TEST(test_forks_of_forks);
+    RUN_TEST(test_load_state);
+    RUN_TEST(test_forks_on_threads);
+    return TEST_REPORT();
+}
@@ -0,0 +1,66 @@
+#include "test.h"
+
+// Idle loop skipping must not change the emulation. A polling loop is run
+// in whole frames, where its iterations are skipped, and one clock cycle at
+// a time, where they never are, and both have to end in the same state.
+
+#define PHASES 16
+#define FRAMES 30
+
+static struct GameBoy batched;
+static struct GameBoy stepped;
+
+// Wait for LY to reach 0x90 and store DIV at HL each time it does, so the
+// stored values tell when the loop saw the change
+static const BYTE poll_ly[] = {
+    0x31, 0xFE, 0xFF,       // LD SP,FFFE
+    0x21, 0x00, 0xC0,       // LD HL,C000
+    // wait:
+    0xF0, 0x44,             // LDH A,(44)
+    0xFE, 0x90,             // CP 90
+    0x20, 0xFA,             // JR NZ,wait
+    0xF0, 0x04,             // LDH A,(04)
+    0x22,                   // LD (HL+),A
+    // leave:
+    0xF0, 0x44,             // LDH A,(44)
+    0xFE, 0x90,             // CP 90
+    0x28, 0xFA,             // JR Z,leave
+    0x18, 0xEF,             // JR wait
+};
+
+static void step_until(struct GameBoy* gb, unsigned long long target) {
+    while (gb->scheduler.now < target) {
+        scheduler_run_until(gb, gb->scheduler.now + 1);
+    }
+}
+
+// Every start phase, so the events fall on every point of the loop
+static void test_polling_matches_stepping() {
+    for (int phase = 0; phase < PHASES; phase++) {
+        if (!CHECK(test_init(&batched, poll_ly, sizeof(poll_ly))) || !CHECK(test_init(&stepped, poll_ly, sizeof(poll_ly)))) {
+            return;
+        }
+        step_until(&batched, phase * 4);
+        step_until(&stepped, phase * 4);
+
+        unsigned long long target = stepped.scheduler.now + FRAMES * 70224ULL;
+        scheduler_run_until(&batched, target);
+        step_until(&stepped, target);
+        if (!CHECK(test_hash(&batched) == test_hash(&stepped))) {
+            fprintf(stderr, "    phase %d: stored %02X %02X %02X, stepping stored %02X %02X %02X\n", phase,
+                    mmu_read(&batched, 0xC000), mmu_read(&batched, 0xC001), mmu_read(&batched, 0xC002),
+                    mmu_read(&stepped, 0xC000), mmu_read(&stepped, 0xC001), mmu_read(&stepped, 0xC002));
+        }
+        // The loop is one which gets skipped, and the skipped iterations
+        // are counted like the executed ones
+        CHECK(batched.idle.pollable);
+        CHECK(batched.instructions == stepped.instructions);
+        gameboy_free(&batched);
+        gameboy_free(&stepped);
+    }
+}
+
+int main() {
+    RUN_TEST(test_polling_matches_stepping);
+    return TEST_REPORT();
+}
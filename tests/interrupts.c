@@ -0,0 +1,65 @@
+#include "test.h"
+
+// Timing of EI and DI around interrupts which become pending. The timer
+// handler of test_init counts the timer interrupts at 0xFF81.
+
+static struct GameBoy gb;
+
+// EI enables interrupts only after the next instruction, so DI right after
+// it keeps them disabled, even with the timer requesting one every 16
+// cycles. The loop clears IF, so every request is a new one.
+static void test_ei_di_never_services() {
+    static const BYTE code[] = {
+        0x31, 0xFE, 0xFF,       // LD SP,FFFE
+        0x3E, 0xFF,             // LD A,FF
+        0xE0, 0x06,             // LDH (06),A, TMA = FF
+        0xE0, 0x05,             // LDH (05),A, TIMA = FF
+        0x3E, 0x05,             // LD A,05
+        0xE0, 0x07,             // LDH (07),A, TAC = enabled, 16 cycles
+        0x3E, 0x04,             // LD A,04
+        0xE0, 0xFF,             // LDH (FF),A, IE = timer
+        // loop:
+        0xAF,                   // XOR A
+        0xE0, 0x0F,             // LDH (0F),A
+        0xFB,                   // EI
+        0xF3,                   // DI
+        0x18, 0xF9,             // JR loop
+    };
+    if (!CHECK(test_init(&gb, code, sizeof(code)))) {
+        return;
+    }
+    gameboy_run_frames(&gb, 10);
+    CHECK(mmu_read(&gb, 0xFF81) == 0x00);
+    gameboy_free(&gb);
+}
+
+// With an interrupt already pending, EI still runs the next instruction
+// before the interrupt is serviced
+static void test_ei_delays_one_instruction() {
+    static const BYTE code[] = {
+        0x31, 0xFE, 0xFF,       // LD SP,FFFE
+        0x3E, 0x04,             // LD A,04
+        0xE0, 0xFF,             // LDH (FF),A, IE = timer
+        0xE0, 0x0F,             // LDH (0F),A, IF = timer
+        0xFB,                   // EI
+        0x04,                   // INC B, at 015A
+        0x04,                   // INC B, at 015B
+        0x18, 0xFE,             // JR -2
+    };
+    if (!CHECK(test_init(&gb, code, sizeof(code)))) {
+        return;
+    }
+    gb.cpu.B = 0;
+    gameboy_run_frames(&gb, 1);
+    CHECK(mmu_read(&gb, 0xFF81) == 0x01);
+    // The return address pushed by the interrupt is the second INC B
+    CHECK(mmu_read_word(&gb, 0xFFFC) == 0x015B);
+    CHECK(gb.cpu.B == 2);
+    gameboy_free(&gb);
+}
+
+int main() {
+    RUN_TEST(test_ei_di_never_services);
+    RUN_TEST(test_ei_delays_one_instruction);
+    return TEST_REPORT();
+}
@@ -0,0 +1,124 @@
+#include "test.h"
+#include "../include/rewind.h"
+
+#define FRAMES 60
+
+static struct GameBoy gb;
+static struct Rewind history;
+// The state before every frame
+static uint64_t hashes[FRAMES];
+
+// Record the state before each of the frames into the history
+static void play(unsigned int frames) {
+    for (unsigned int frame = 0; frame < frames; frame++) {
+        hashes[frame] = test_hash(&gb);
+        rewind_frame(&history, &gb);
+        gameboy_run_frames(&gb, 1);
+    }
+}
+
+// Stepping back goes through the recorded states from the most recent
+// one, and playing the same frames again ends where the first run did
+static void test_step_back() {
+    if (!CHECK(test_init_workload(&gb)) || !CHECK(rewind_init(&history, &gb, 4 << 20, 1))) {
+        return;
+    }
+    play(FRAMES);
+    uint64_t end = test_hash(&gb);
+    CHECK(history.count == FRAMES - 1);
+    for (int frame = FRAMES - 1; frame >= 0; frame--) {
+        if (!CHECK(rewind_step_back(&history, &gb)) || !CHECK(test_hash(&gb) == hashes[frame])) {
+            fprintf(stderr, "    frame %d\n", frame);
+            break;
+        }
+    }
+    CHECK(!rewind_step_back(&history, &gb));
+    CHECK(test_hash(&gb) == hashes[0]);
+
+    gameboy_run_frames(&gb, FRAMES);
+    CHECK(test_hash(&gb) == end);
+    rewind_free(&history);
+    gameboy_free(&gb);
+}
+
+// With a small buffer the ring wraps around, deltas which do not fit at the
+// end start over at the beginning and drop the oldest ones. The states
+// which are left are still exact.
+static void test_ring_wraps() {
+    if (!CHECK(test_init_workload(&gb)) || !CHECK(rewind_init(&history, &gb, 16 << 10, 1))) {
+        return;
+    }
+    bool wrapped = false;
+    for (unsigned int frame = 0; frame < FRAMES; frame++) {
+        hashes[frame] = test_hash(&gb);
+        rewind_frame(&history, &gb);
+        gameboy_run_frames(&gb, 1);
+        if (history.count > 1) {
+            wrapped |= history.entries[(history.first + history.count - 1) % history.max_entries].offset == 0;
+        }
+    }
+    CHECK(wrapped);
+    CHECK(history.count > 1 && history.count < FRAMES - 1);
+
+    // The most recent state is kept in full, the others are deltas
+    unsigned int reachable = history.count + 1;
+    for (unsigned int step = 0; step < reachable; step++) {
+        int frame = FRAMES - 1 - step;
+        if (!CHECK(rewind_step_back(&history, &gb)) || !CHECK(test_hash(&gb) == hashes[frame])) {
+            fprintf(stderr, "    frame %d\n", frame);
+            break;
+        }
+    }
+    CHECK(!rewind_step_back(&history, &gb));
+    rewind_free(&history);
+    gameboy_free(&gb);
+}
+
+// A delta larger than the whole buffer is dropped along with all the older
+// ones, since they can only be reached through it. The state it was taken
+// from is still kept in full.
+static void test_oversized_delta() {
+    if (!CHECK(test_init_workload(&gb)) || !CHECK(rewind_init(&history, &gb, 16 << 10, 1))) {
+        return;
+    }
+    play(10);
+    CHECK(history.count > 0);
+
+    // Changing all of video and work ram makes the delta larger than 16 KB
+    for (unsigned int ix = 0; ix < sizeof(gb.mmu.vram); ix++) {
+        gb.mmu.vram[ix] ^= 0xFF;
+        gb.mmu.wram[ix] ^= 0xFF;
+    }
+    uint64_t changed = test_hash(&gb);
+    rewind_record(&history, &gb);
+    CHECK(history.count == 0);
+    CHECK(rewind_step_back(&history, &gb));
+    CHECK(test_hash(&gb) == changed);
+    CHECK(!rewind_step_back(&history, &gb));
+    rewind_free(&history);
+    gameboy_free(&gb);
+}
+
+// A state is recorded every interval frames
+static void test_interval() {
+    if (!CHECK(test_init_workload(&gb)) || !CHECK(rewind_init(&history, &gb, 4 << 20, 4))) {
+        return;
+    }
+    play(FRAMES);
+    CHECK(history.count == FRAMES / 4 - 1);
+    for (int frame = FRAMES - 1; frame >= 0; frame -= 4) {
+        CHECK(rewind_step_back(&history, &gb));
+        CHECK(test_hash(&gb) == hashes[frame]);
+    }
+    CHECK(!rewind_step_back(&history, &gb));
+    rewind_free(&history);
+    gameboy_free(&gb);
+}
+
+int main() {
+    RUN_TEST(test_step_back);
+    RUN_TEST(test_ring_wraps);
+    RUN_TEST(test_oversized_delta);
+    RUN_TEST(test_interval);
+    return TEST_REPORT();
+}
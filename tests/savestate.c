@@ -0,0 +1,96 @@
+#include "test.h"
+#include "../include/savestate.h"
+
+#define FRAMES 60
+
+static struct GameBoy gb;
+static struct GameBoy other;
+
+// Saving, running and loading again repeats the same run
+static void test_round_trip() {
+    if (!CHECK(test_init_workload(&gb))) {
+        return;
+    }
+    gameboy_run_frames(&gb, 30);
+    size_t size = savestate_size(&gb);
+    struct SaveState* state = malloc(size);
+    CHECK(savestate_save(&gb, state, size) == size);
+
+    gameboy_run_frames(&gb, FRAMES);
+    uint64_t expected = test_hash(&gb);
+    CHECK(savestate_load(&gb, state, size));
+    gameboy_run_frames(&gb, FRAMES);
+    CHECK(test_hash(&gb) == expected);
+
+    // Into an other gameboy running the same cartridge
+    if (CHECK(test_init_workload(&other))) {
+        CHECK(savestate_load(&other, state, size));
+        gameboy_run_frames(&other, FRAMES);
+        CHECK(test_hash(&other) == expected);
+        gameboy_free(&other);
+    }
+    free(state);
+    gameboy_free(&gb);
+}
+
+// A state saved in the middle of a frame and while halted continues the
+// same way too
+static void test_mid_frame() {
+    if (!CHECK(test_init_workload(&gb))) {
+        return;
+    }
+    scheduler_run_until(&gb, 12345);
+    while (!gb.cpu.is_halted) {
+        scheduler_run_until(&gb, gb.scheduler.now + 1);
+    }
+    size_t size = savestate_size(&gb);
+    struct SaveState* state = malloc(size);
+    CHECK(savestate_save(&gb, state, size) == size);
+
+    gameboy_run_frames(&gb, FRAMES);
+    uint64_t expected = test_hash(&gb);
+    CHECK(savestate_load(&gb, state, size));
+    CHECK(gb.cpu.is_halted);
+    gameboy_run_frames(&gb, FRAMES);
+    CHECK(test_hash(&gb) == expected);
+    free(state);
+    gameboy_free(&gb);
+}
+
+// States which do not fit, or are for an other cartridge or boot rom, are
+// neither saved nor loaded, and a rejected load leaves the gameboy as it
+// was
+static void test_rejected() {
+    if (!CHECK(test_init_workload(&gb))) {
+        return;
+    }
+    gameboy_run_frames(&gb, 10);
+    size_t size = savestate_size(&gb);
+    struct SaveState* state = malloc(size);
+    CHECK(savestate_save(&gb, state, size - 1) == 0);
+    CHECK(savestate_save(&gb, state, size) == size);
+
+    gameboy_run_frames(&gb, 10);
+    uint64_t expected = test_hash(&gb);
+    CHECK(!savestate_load(&gb, state, size - 1));
+    state->version++;
+    CHECK(!savestate_load(&gb, state, size));
+    state->version--;
+    state->global_checksum++;
+    CHECK(!savestate_load(&gb, state, size));
+    state->global_checksum--;
+    // The boot rom only matters while it is mapped
+    state->boot_rom_hash = 1;
+    state->bios_mapped = true;
+    CHECK(!savestate_load(&gb, state, size));
+    CHECK(test_hash(&gb) == expected);
+    free(state);
+    gameboy_free(&gb);
+}
+
+int main() {
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_mid_frame);
+    RUN_TEST(test_rejected);
+    return TEST_REPORT();
+}
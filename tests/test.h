@@ -0,0 +1,131 @@
+#ifndef __TEST_H_
+#define __TEST_H_ 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/gameboy.h"
+#include "../include/cartridge.h"
+
+// A minimal harness for the test programs in tests/, which make test builds
+// and runs one by one. Every failed CHECK is reported with its location,
+// and TEST_REPORT gives the exit status.
+
+static int test_checks;
+static int test_failures;
+
+static inline bool test_check(bool passed, const char* file, int line, const char* condition) {
+    test_checks++;
+    if (!passed) {
+        test_failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+    }
+    return passed;
+}
+
+// Check a condition, evaluating to whether it holds, so sweeps over many
+// inputs can stop at the first failure
+#define CHECK(condition) test_check((condition), __FILE__, __LINE__, #condition)
+
+#define RUN_TEST(test) do { \
+        int failures = test_failures; \
+        test(); \
+        fprintf(stderr, "%-40s %s\n", #test, test_failures == failures ? "ok" : "FAILED"); \
+    } while (0)
+
+#define TEST_REPORT() (fprintf(stderr, "%d checks, %d failed\n", test_checks, test_failures), test_failures != 0)
+
+// Start a gameboy without a boot rom on a rom only cartridge, which jumps
+// from the entry point to code placed at 0x0150. The vblank handler at 0x0040
+// counts the frames at 0xFF80, the timer handler at 0x0050 the timer
+// interrupts at 0xFF81. The cartridge is written to a temporary file, which
+// is removed again once it is mapped.
+static inline bool test_init(struct GameBoy* gb, const BYTE* code, size_t size) {
+    static BYTE image[2 * ROM_BANK_SIZE];
+    static const BYTE vblank[] = {
+        // PUSH AF; LDH A,(80); INC A; LDH (80),A; POP AF; RETI
+        0xF5, 0xF0, 0x80, 0x3C, 0xE0, 0x80, 0xF1, 0xD9,
+    };
+    static const BYTE timer[] = {
+        // PUSH AF; LDH A,(81); INC A; LDH (81),A; POP AF; RETI
+        0xF5, 0xF0, 0x81, 0x3C, 0xE0, 0x81, 0xF1, 0xD9,
+    };
+    memset(image, 0, sizeof(image));
+    memcpy(image + 0x0040, vblank, sizeof(vblank));
+    memcpy(image + 0x0050, timer, sizeof(timer));
+    // JP 0150
+    image[0x0100] = 0xC3;
+    image[0x0101] = 0x50;
+    image[0x0102] = 0x01;
+    memcpy(image + HEADER_TITLE, "TEST", 4);
+    BYTE checksum = 0;
+    for (int addr = HEADER_TITLE; addr < HEADER_CHECKSUM; addr++) {
+        checksum = checksum - image[addr] - 1;
+    }
+    image[HEADER_CHECKSUM] = checksum;
+    memcpy(image + 0x0150, code, size);
+
+    char path[] = "/tmp/gameboy-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create a temporary rom\n");
+        return false;
+    }
+    bool written = write(fd, image, sizeof(image)) == sizeof(image);
+    close(fd);
+    bool ok = written && gameboy_init(gb, path, NULL, NULL);
+    unlink(path);
+    return ok;
+}
+
+// Hash of what runs are compared by: the framebuffer, the memory, the
+// registers and the clock
+static inline uint64_t test_hash(struct GameBoy* gb) {
+    struct Processor* cpu = &gb->cpu;
+    WORD registers[] = { cpu->AF, cpu->BC, cpu->DE, cpu->HL, cpu->SP, cpu->PC };
+    uint64_t hash = hash_bytes(gameboy_framebuffer_hash(gb), (const BYTE*)registers, sizeof(registers));
+    hash = hash_bytes(hash, (const BYTE*)&gb->scheduler.now, sizeof(gb->scheduler.now));
+    return hash ^ gameboy_memory_hash(gb);
+}
+
+// Start a gameboy on a busy program, which keeps writing a pseudo random
+// sequence mixed with the frame counter over all of work ram and vram, so
+// the framebuffer changes too,
+// halts for vblank after every pass over the work ram and counts the frames
+// in its vblank handler
+static inline bool test_init_workload(struct GameBoy* gb) {
+    static const BYTE code[] = {
+        0x31, 0xFE, 0xFF,       // LD SP,FFFE
+        0x21, 0x00, 0xC0,       // LD HL,C000
+        0x01, 0x00, 0x80,       // LD BC,8000
+        0x3E, 0x01,             // LD A,01
+        0xE0, 0xFF,             // LDH (FF),A, IE = vblank
+        0xFB,                   // EI
+        // loop: E = E * 5 + 1
+        0x7B,                   // LD A,E
+        0x87,                   // ADD A,A
+        0x87,                   // ADD A,A
+        0x83,                   // ADD A,E
+        0x3C,                   // INC A
+        0x5F,                   // LD E,A
+        0xF0, 0x80,             // LDH A,(80), the frame counter
+        0xAB,                   // XOR E
+        0x22,                   // LD (HL+),A
+        0x02,                   // LD (BC),A
+        0x03,                   // INC BC
+        0x78,                   // LD A,B
+        0xFE, 0xA0,             // CP A0
+        0x20, 0x02,             // JR NZ,+2
+        0x06, 0x80,             // LD B,80
+        0x7C,                   // LD A,H
+        0xFE, 0xE0,             // CP E0
+        0x20, 0xE8,             // JR NZ,loop
+        0x21, 0x00, 0xC0,       // LD HL,C000
+        0x76,                   // HALT
+        0x18, 0xE2,             // JR loop
+    };
+    return test_init(gb, code, sizeof(code));
+}
+
+#endif